@@ -0,0 +1,60 @@
+// Offline converter from glTF/GLB to the baked model layout read by
+// ModelResource, see baked_model.h. The build runs it for the scene models:
+//
+//     asset_baker <model.glb|model.gltf> <output.bake>
+
+#include "baked_model.h"
+
+#include <iostream>
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        std::cerr << "usage: " << argv[0] << " <model.glb|model.gltf> <output.bake>" << std::endl;
+        return 2;
+    }
+    std::string source = argv[1];
+    std::string destination = argv[2];
+
+    tinygltf::TinyGLTF loader;
+    tinygltf::Model model;
+    std::string err, warn;
+    bool binary = source.size() > 4 && source.compare(source.size() - 4, 4, ".glb") == 0;
+    bool res = binary ? loader.LoadBinaryFromFile(&model, &err, &warn, source)
+                      : loader.LoadASCIIFromFile(&model, &err, &warn, source);
+    if (!warn.empty()) {
+        std::cerr << "WARN: " << warn << std::endl;
+    }
+    if (!res) {
+        std::cerr << "Failed to load glTF: " << source << ": " << err << std::endl;
+        return 1;
+    }
+
+    if (!bake_model(model, source, destination, err)) {
+        std::cerr << "Failed to bake " << source << ": " << err << std::endl;
+        return 1;
+    }
+
+    size_t sourceVertexBytes = 0;
+    for (const tinygltf::BufferView &view : model.bufferViews) {
+        if (view.target != 0) {
+            sourceVertexBytes += view.byteLength;
+        }
+    }
+    MappedFile baked;
+    tinygltf::Model check;
+    float scale[3], offset[3];
+    std::vector<uint32_t> pixelOffsets;
+    if (!baked.open(destination) || !read_baked_model(baked, source, check, scale, offset, pixelOffsets)) {
+        std::cerr << "Baked model does not read back: " << destination << std::endl;
+        return 1;
+    }
+    size_t bakedVertexBytes = 0;
+    for (const tinygltf::BufferView &view : check.bufferViews) {
+        if (view.target != 0) {
+            bakedVertexBytes += view.byteLength;
+        }
+    }
+    std::cout << "Baked " << source << " -> " << destination << ": " << baked.size() / 1024 << " KB, vertices and indices "
+              << sourceVertexBytes / 1024 << " KB -> " << bakedVertexBytes / 1024 << " KB" << std::endl;
+    return 0;
+}
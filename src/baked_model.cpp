@@ -0,0 +1,690 @@
+#include "baked_model.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <map>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+static const char BAKED_MAGIC[4] = { 'B', 'A', 'K', 'E' };
+
+static bool source_stamp(const std::string &source, uint64_t &size, int64_t &time) {
+    struct stat info;
+    if (stat(source.c_str(), &info) != 0) {
+        return false;
+    }
+    size = info.st_size;
+    time = info.st_mtime;
+    return true;
+}
+
+std::string baked_model_path(const std::string &source) {
+    size_t slash = source.find_last_of("/\\");
+    std::string name = slash == std::string::npos ? source : source.substr(slash + 1);
+    return "assets/" + name.substr(0, name.find_last_of('.')) + ".bake";
+}
+
+void read_accessor(const tinygltf::Model &model, const std::vector<const unsigned char *> &buffers,
+                   int accessorIndex, size_t index, float *out) {
+    const tinygltf::Accessor &accessor = model.accessors[accessorIndex];
+    const tinygltf::BufferView &view = model.bufferViews[accessor.bufferView];
+    int components = tinygltf::GetNumComponentsInType(accessor.type);
+    int size = tinygltf::GetComponentSizeInBytes(accessor.componentType);
+    size_t stride = view.byteStride ? view.byteStride : (size_t)components * size;
+    const unsigned char *element = buffers[view.buffer] + view.byteOffset + accessor.byteOffset + index * stride;
+    for (int c = 0; c < components; c++) {
+        const unsigned char *p = element + c * size;
+        float value = 0;
+        switch (accessor.componentType) {
+        case TINYGLTF_COMPONENT_TYPE_FLOAT: { float v; std::memcpy(&v, p, 4); value = v; break; }
+        case TINYGLTF_COMPONENT_TYPE_BYTE: { int8_t v; std::memcpy(&v, p, 1); value = accessor.normalized ? std::max(v / 127.0f, -1.0f) : v; break; }
+        case TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE: { uint8_t v = *p; value = accessor.normalized ? v / 255.0f : v; break; }
+        case TINYGLTF_COMPONENT_TYPE_SHORT: { int16_t v; std::memcpy(&v, p, 2); value = accessor.normalized ? std::max(v / 32767.0f, -1.0f) : v; break; }
+        case TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT: { uint16_t v; std::memcpy(&v, p, 2); value = accessor.normalized ? v / 65535.0f : v; break; }
+        case TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT: { uint32_t v; std::memcpy(&v, p, 4); value = (float)v; break; }
+        }
+        out[c] = value;
+    }
+}
+
+static uint32_t read_index(const tinygltf::Model &model, const std::vector<const unsigned char *> &buffers,
+                           int accessorIndex, size_t index) {
+    const tinygltf::Accessor &accessor = model.accessors[accessorIndex];
+    const tinygltf::BufferView &view = model.bufferViews[accessor.bufferView];
+    int size = tinygltf::GetComponentSizeInBytes(accessor.componentType);
+    size_t stride = view.byteStride ? view.byteStride : size;
+    const unsigned char *p = buffers[view.buffer] + view.byteOffset + accessor.byteOffset + index * stride;
+    if (size == 1) {
+        return *p;
+    }
+    if (size == 2) {
+        uint16_t v;
+        std::memcpy(&v, p, 2);
+        return v;
+    }
+    uint32_t v;
+    std::memcpy(&v, p, 4);
+    return v;
+}
+
+
+// Records and the data block as they are built; data offsets are relative
+// to the data block until the layout is known
+struct BakeState {
+    const tinygltf::Model &model;
+    std::vector<const unsigned char *> buffers;
+    std::vector<unsigned char> data;
+    std::vector<BakedAccessor> accessors;
+    std::vector<BakedBufferView> views;
+    std::map<int, int> copiedAccessors;
+
+    BakeState(const tinygltf::Model &model) : model(model) {}
+
+    uint32_t append(const void *bytes, size_t size) {
+        data.resize((data.size() + 15) & ~(size_t)15);
+        uint32_t offset = data.size();
+        data.insert(data.end(), (const unsigned char *)bytes, (const unsigned char *)bytes + size);
+        return offset;
+    }
+
+    int add_view(uint32_t offset, uint32_t length, uint32_t stride, uint32_t target) {
+        BakedBufferView view = { offset, length, stride, target };
+        views.push_back(view);
+        return views.size() - 1;
+    }
+
+    int add_accessor(int view, uint32_t byteOffset, int componentType, bool normalized, uint32_t count, int type) {
+        BakedAccessor accessor = { view, byteOffset, componentType, normalized, count, type };
+        accessors.push_back(accessor);
+        return accessors.size() - 1;
+    }
+
+    // Float data such as matrices and keyframes, tightly packed. Accessors
+    // shared by several samplers are copied once.
+    int copy_floats(int source) {
+        std::map<int, int>::iterator found = copiedAccessors.find(source);
+        if (found != copiedAccessors.end()) {
+            return found->second;
+        }
+        const tinygltf::Accessor &accessor = model.accessors[source];
+        int components = tinygltf::GetNumComponentsInType(accessor.type);
+        std::vector<float> values(accessor.count * components);
+        for (size_t i = 0; i < accessor.count; i++) {
+            read_accessor(model, buffers, source, i, &values[i * components]);
+        }
+        uint32_t offset = append(values.empty() ? NULL : &values[0], values.size() * sizeof(float));
+        int view = add_view(offset, values.size() * sizeof(float), 0, 0);
+        int baked = add_accessor(view, 0, TINYGLTF_COMPONENT_TYPE_FLOAT, false, accessor.count, accessor.type);
+        copiedAccessors[source] = baked;
+        return baked;
+    }
+};
+
+static int attribute_accessor(const tinygltf::Primitive &primitive, const char *name) {
+    std::map<std::string, int>::const_iterator it = primitive.attributes.find(name);
+    return it == primitive.attributes.end() ? -1 : it->second;
+}
+
+static const char *ATTRIBUTE_NAMES[BAKED_ATTRIBUTE_COUNT] = { "POSITION", "NORMAL", "TEXCOORD_0", "JOINTS_0", "WEIGHTS_0" };
+
+// Interleaves and quantizes one primitive: unsigned normalized short
+// positions inside the model bounds, signed byte normals, unsigned
+// normalized short UVs when they stay in [0, 1], byte joints and unsigned
+// byte weights that still sum to one
+static bool bake_primitive(BakeState &state, const tinygltf::Primitive &primitive, const float *boundsMin, const float *extent,
+                           std::vector<unsigned char> &indexData, BakedPrimitive &baked, std::string &err) {
+    const tinygltf::Model &model = state.model;
+    int source[BAKED_ATTRIBUTE_COUNT];
+    for (int a = 0; a < BAKED_ATTRIBUTE_COUNT; a++) {
+        source[a] = attribute_accessor(primitive, ATTRIBUTE_NAMES[a]);
+        baked.attributes[a] = -1;
+    }
+    if (source[BAKED_POSITION] < 0 || primitive.indices < 0) {
+        err = "primitives need positions and indices";
+        return false;
+    }
+    size_t count = model.accessors[source[BAKED_POSITION]].count;
+
+    bool uvUnit = true;
+    float uv[4];
+    if (source[BAKED_TEXCOORD] >= 0) {
+        for (size_t i = 0; i < count && uvUnit; i++) {
+            read_accessor(model, state.buffers, source[BAKED_TEXCOORD], i, uv);
+            uvUnit = uv[0] >= 0 && uv[0] <= 1 && uv[1] >= 0 && uv[1] <= 1;
+        }
+    }
+    float joint[4];
+    float maxJoint = 0;
+    if (source[BAKED_JOINTS] >= 0) {
+        for (size_t i = 0; i < count; i++) {
+            read_accessor(model, state.buffers, source[BAKED_JOINTS], i, joint);
+            maxJoint = std::max(std::max(maxJoint, std::max(joint[0], joint[1])), std::max(joint[2], joint[3]));
+        }
+    }
+    bool shortJoints = maxJoint > 255;
+
+    // Layout and stride
+    uint32_t offsets[BAKED_ATTRIBUTE_COUNT] = {};
+    uint32_t stride = 0;
+    offsets[BAKED_POSITION] = stride; stride += 8;
+    if (source[BAKED_NORMAL] >= 0) { offsets[BAKED_NORMAL] = stride; stride += 4; }
+    if (source[BAKED_TEXCOORD] >= 0) { offsets[BAKED_TEXCOORD] = stride; stride += uvUnit ? 4 : 8; }
+    if (source[BAKED_JOINTS] >= 0) { offsets[BAKED_JOINTS] = stride; stride += shortJoints ? 8 : 4; }
+    if (source[BAKED_WEIGHTS] >= 0) { offsets[BAKED_WEIGHTS] = stride; stride += 4; }
+
+    std::vector<unsigned char> vertices(count * stride, 0);
+    float value[4];
+    for (size_t i = 0; i < count; i++) {
+        unsigned char *vertex = &vertices[i * stride];
+        read_accessor(model, state.buffers, source[BAKED_POSITION], i, value);
+        for (int c = 0; c < 3; c++) {
+            float t = extent[c] > 0 ? (value[c] - boundsMin[c]) / extent[c] : 0;
+            uint16_t q = (uint16_t)std::min(std::max(std::floor(t * 65535 + 0.5f), 0.0f), 65535.0f);
+            std::memcpy(vertex + offsets[BAKED_POSITION] + 2 * c, &q, 2);
+        }
+        if (source[BAKED_NORMAL] >= 0) {
+            read_accessor(model, state.buffers, source[BAKED_NORMAL], i, value);
+            for (int c = 0; c < 3; c++) {
+                int8_t q = (int8_t)std::min(std::max(std::floor(value[c] * 127 + 0.5f), -127.0f), 127.0f);
+                std::memcpy(vertex + offsets[BAKED_NORMAL] + c, &q, 1);
+            }
+        }
+        if (source[BAKED_TEXCOORD] >= 0) {
+            read_accessor(model, state.buffers, source[BAKED_TEXCOORD], i, value);
+            for (int c = 0; c < 2; c++) {
+                if (uvUnit) {
+                    uint16_t q = (uint16_t)std::floor(value[c] * 65535 + 0.5f);
+                    std::memcpy(vertex + offsets[BAKED_TEXCOORD] + 2 * c, &q, 2);
+                } else {
+                    std::memcpy(vertex + offsets[BAKED_TEXCOORD] + 4 * c, &value[c], 4);
+                }
+            }
+        }
+        if (source[BAKED_JOINTS] >= 0) {
+            read_accessor(model, state.buffers, source[BAKED_JOINTS], i, value);
+            for (int c = 0; c < 4; c++) {
+                if (shortJoints) {
+                    uint16_t q = (uint16_t)value[c];
+                    std::memcpy(vertex + offsets[BAKED_JOINTS] + 2 * c, &q, 2);
+                } else {
+                    vertex[offsets[BAKED_JOINTS] + c] = (unsigned char)value[c];
+                }
+            }
+        }
+        if (source[BAKED_WEIGHTS] >= 0) {
+            // Round, then hand the leftover to the largest weights
+            read_accessor(model, state.buffers, source[BAKED_WEIGHTS], i, value);
+            float sum = value[0] + value[1] + value[2] + value[3];
+            int q[4];
+            int total = 0;
+            for (int c = 0; c < 4; c++) {
+                q[c] = (int)std::floor((sum > 0 ? value[c] / sum : 0) * 255 + 0.5f);
+                total += q[c];
+            }
+            while (total != 255 && sum > 0) {
+                int largest = (int)(std::max_element(q, q + 4) - q);
+                int step = total < 255 ? 1 : -1;
+                q[largest] += step;
+                total += step;
+            }
+            for (int c = 0; c < 4; c++) {
+                vertex[offsets[BAKED_WEIGHTS] + c] = (unsigned char)q[c];
+            }
+        }
+    }
+
+    uint32_t vertexOffset = state.append(&vertices[0], vertices.size());
+    int view = state.add_view(vertexOffset, vertices.size(), stride, TINYGLTF_TARGET_ARRAY_BUFFER);
+    baked.attributes[BAKED_POSITION] = state.add_accessor(view, offsets[BAKED_POSITION], TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT, true, count, TINYGLTF_TYPE_VEC3);
+    if (source[BAKED_NORMAL] >= 0) {
+        baked.attributes[BAKED_NORMAL] = state.add_accessor(view, offsets[BAKED_NORMAL], TINYGLTF_COMPONENT_TYPE_BYTE, true, count, TINYGLTF_TYPE_VEC3);
+    }
+    if (source[BAKED_TEXCOORD] >= 0) {
+        baked.attributes[BAKED_TEXCOORD] = state.add_accessor(view, offsets[BAKED_TEXCOORD],
+            uvUnit ? TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT : TINYGLTF_COMPONENT_TYPE_FLOAT, uvUnit, count, TINYGLTF_TYPE_VEC2);
+    }
+    if (source[BAKED_JOINTS] >= 0) {
+        baked.attributes[BAKED_JOINTS] = state.add_accessor(view, offsets[BAKED_JOINTS],
+            shortJoints ? TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT : TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE, false, count, TINYGLTF_TYPE_VEC4);
+    }
+    if (source[BAKED_WEIGHTS] >= 0) {
+        baked.attributes[BAKED_WEIGHTS] = state.add_accessor(view, offsets[BAKED_WEIGHTS], TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE, true, count, TINYGLTF_TYPE_VEC4);
+    }
+
+    // 16-bit indices whenever the vertex count allows, appended to the
+    // model's single index buffer; the view is filled in by the caller
+    size_t indexCount = model.accessors[primitive.indices].count;
+    bool shortIndices = count <= 65536;
+    indexData.resize((indexData.size() + 3) & ~(size_t)3);
+    uint32_t indexOffset = indexData.size();
+    for (size_t i = 0; i < indexCount; i++) {
+        uint32_t index = read_index(model, state.buffers, primitive.indices, i);
+        if (index >= count) {
+            err = "index out of range";
+            return false;
+        }
+        if (shortIndices) {
+            uint16_t shortIndex = index;
+            indexData.insert(indexData.end(), (unsigned char *)&shortIndex, (unsigned char *)&shortIndex + 2);
+        } else {
+            indexData.insert(indexData.end(), (unsigned char *)&index, (unsigned char *)&index + 4);
+        }
+    }
+    baked.indices = state.add_accessor(-1, indexOffset,
+        shortIndices ? TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT : TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT, false, indexCount, TINYGLTF_TYPE_SCALAR);
+    baked.material = primitive.material;
+    baked.mode = primitive.mode;
+    return true;
+}
+
+static int path_code(const std::string &path) {
+    if (path == "translation") return BAKED_PATH_TRANSLATION;
+    if (path == "rotation") return BAKED_PATH_ROTATION;
+    if (path == "scale") return BAKED_PATH_SCALE;
+    return BAKED_PATH_WEIGHTS;
+}
+
+static int interpolation_code(const std::string &interpolation) {
+    if (interpolation == "STEP") return 1;
+    if (interpolation == "CUBICSPLINE") return 2;
+    return 0;
+}
+
+template <typename T>
+static void write_table(BakedHeader &header, BakedTable table, const std::vector<T> &records, uint32_t &offset) {
+    header.tables[table].offset = offset;
+    header.tables[table].count = records.size();
+    offset = (offset + records.size() * sizeof(T) + 15) & ~15u;
+}
+
+bool bake_model(const tinygltf::Model &model, const std::string &source, const std::string &destination, std::string &err) {
+    BakeState state(model);
+    for (size_t i = 0; i < model.buffers.size(); i++) {
+        state.buffers.push_back(model.buffers[i].data.data());
+    }
+
+    // Position bounds over the whole model, so one decode serves every primitive
+    float boundsMin[3] = { 1e30f, 1e30f, 1e30f }, boundsMax[3] = { -1e30f, -1e30f, -1e30f };
+    for (const tinygltf::Mesh &mesh : model.meshes) {
+        for (const tinygltf::Primitive &primitive : mesh.primitives) {
+            int position = attribute_accessor(primitive, "POSITION");
+            if (position < 0) {
+                continue;
+            }
+            float value[4];
+            for (size_t i = 0; i < model.accessors[position].count; i++) {
+                read_accessor(model, state.buffers, position, i, value);
+                for (int c = 0; c < 3; c++) {
+                    boundsMin[c] = std::min(boundsMin[c], value[c]);
+                    boundsMax[c] = std::max(boundsMax[c], value[c]);
+                }
+            }
+        }
+    }
+    float extent[3];
+    for (int c = 0; c < 3; c++) {
+        if (boundsMin[c] > boundsMax[c]) {
+            boundsMin[c] = boundsMax[c] = 0;
+        }
+        extent[c] = boundsMax[c] - boundsMin[c];
+    }
+
+    std::vector<BakedMesh> meshes;
+    std::vector<BakedPrimitive> primitives;
+    std::vector<unsigned char> indexData;
+    for (const tinygltf::Mesh &mesh : model.meshes) {
+        BakedMesh bakedMesh = { (uint32_t)primitives.size(), (uint32_t)mesh.primitives.size() };
+        meshes.push_back(bakedMesh);
+        for (const tinygltf::Primitive &primitive : mesh.primitives) {
+            BakedPrimitive bakedPrimitive;
+            if (!bake_primitive(state, primitive, boundsMin, extent, indexData, bakedPrimitive, err)) {
+                return false;
+            }
+            primitives.push_back(bakedPrimitive);
+        }
+    }
+    if (!indexData.empty()) {
+        uint32_t indexOffset = state.append(&indexData[0], indexData.size());
+        int indexView = state.add_view(indexOffset, indexData.size(), 0, TINYGLTF_TARGET_ELEMENT_ARRAY_BUFFER);
+        for (const BakedPrimitive &primitive : primitives) {
+            state.accessors[primitive.indices].bufferView = indexView;
+        }
+    }
+
+    std::vector<BakedNode> nodes;
+    std::vector<int32_t> children;
+    for (const tinygltf::Node &node : model.nodes) {
+        BakedNode baked;
+        std::memset(&baked, 0, sizeof(baked));
+        if (node.translation.size() == 3) {
+            baked.flags |= BAKED_NODE_TRANSLATION;
+            std::copy(node.translation.begin(), node.translation.end(), baked.translation);
+        }
+        if (node.rotation.size() == 4) {
+            baked.flags |= BAKED_NODE_ROTATION;
+            std::copy(node.rotation.begin(), node.rotation.end(), baked.rotation);
+        }
+        if (node.scale.size() == 3) {
+            baked.flags |= BAKED_NODE_SCALE;
+            std::copy(node.scale.begin(), node.scale.end(), baked.scale);
+        }
+        if (node.matrix.size() == 16) {
+            baked.flags |= BAKED_NODE_MATRIX;
+            std::copy(node.matrix.begin(), node.matrix.end(), baked.matrix);
+        }
+        baked.mesh = node.mesh;
+        baked.skin = node.skin;
+        baked.firstChild = children.size();
+        baked.childCount = node.children.size();
+        children.insert(children.end(), node.children.begin(), node.children.end());
+        nodes.push_back(baked);
+    }
+    std::vector<int32_t> roots;
+    if (!model.scenes.empty()) {
+        const tinygltf::Scene &scene = model.scenes[model.defaultScene >= 0 ? model.defaultScene : 0];
+        roots.assign(scene.nodes.begin(), scene.nodes.end());
+    }
+
+    std::vector<BakedMaterial> materials;
+    for (const tinygltf::Material &material : model.materials) {
+        BakedMaterial baked = { { 1, 1, 1, 1 }, -1, -1 };
+        if (material.pbrMetallicRoughness.baseColorFactor.size() == 4) {
+            std::copy(material.pbrMetallicRoughness.baseColorFactor.begin(), material.pbrMetallicRoughness.baseColorFactor.end(), baked.baseColorFactor);
+        }
+        int texture = material.pbrMetallicRoughness.baseColorTexture.index;
+        baked.baseColorTexture = texture >= 0 ? model.textures[texture].source : -1;
+        texture = material.normalTexture.index;
+        baked.normalTexture = texture >= 0 ? model.textures[texture].source : -1;
+        materials.push_back(baked);
+    }
+
+    std::vector<BakedImage> images;
+    std::string strings;
+    for (const tinygltf::Image &image : model.images) {
+        BakedImage baked = { (uint32_t)image.width, (uint32_t)image.height, (uint32_t)image.component, (uint32_t)image.bits,
+                             0, (uint32_t)image.image.size(), (uint32_t)strings.size(), (uint32_t)image.uri.size() };
+        // Embedded images have no file to share with other models
+        if (image.uri.compare(0, 5, "data:") == 0) {
+            baked.uriLength = 0;
+        } else {
+            strings += image.uri;
+        }
+        if (!image.image.empty()) {
+            baked.pixelOffset = state.append(&image.image[0], image.image.size());
+        }
+        images.push_back(baked);
+    }
+
+    std::vector<BakedSkin> skins;
+    std::vector<int32_t> joints;
+    for (const tinygltf::Skin &skin : model.skins) {
+        BakedSkin baked = { skin.inverseBindMatrices >= 0 ? state.copy_floats(skin.inverseBindMatrices) : -1,
+                            (uint32_t)joints.size(), (uint32_t)skin.joints.size() };
+        joints.insert(joints.end(), skin.joints.begin(), skin.joints.end());
+        skins.push_back(baked);
+    }
+
+    std::vector<BakedAnimation> animations;
+    std::vector<BakedChannel> channels;
+    std::vector<BakedSampler> samplers;
+    for (const tinygltf::Animation &animation : model.animations) {
+        BakedAnimation baked = { (uint32_t)channels.size(), (uint32_t)animation.channels.size(),
+                                 (uint32_t)samplers.size(), (uint32_t)animation.samplers.size() };
+        for (const tinygltf::AnimationChannel &channel : animation.channels) {
+            BakedChannel bakedChannel = { channel.sampler, channel.target_node, path_code(channel.target_path) };
+            channels.push_back(bakedChannel);
+        }
+        for (const tinygltf::AnimationSampler &sampler : animation.samplers) {
+            BakedSampler bakedSampler = { state.copy_floats(sampler.input), state.copy_floats(sampler.output),
+                                          interpolation_code(sampler.interpolation) };
+            samplers.push_back(bakedSampler);
+        }
+        animations.push_back(baked);
+    }
+
+    // Layout: header, tables, data
+    BakedHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, BAKED_MAGIC, 4);
+    header.version = BAKED_MODEL_VERSION;
+    source_stamp(source, header.sourceSize, header.sourceTime);
+    for (int c = 0; c < 3; c++) {
+        header.positionScale[c] = extent[c];
+        header.positionOffset[c] = boundsMin[c];
+    }
+    uint32_t offset = (sizeof(BakedHeader) + 15) & ~15u;
+    write_table(header, BAKED_NODES, nodes, offset);
+    write_table(header, BAKED_CHILDREN, children, offset);
+    write_table(header, BAKED_ROOTS, roots, offset);
+    write_table(header, BAKED_MESHES, meshes, offset);
+    write_table(header, BAKED_PRIMITIVES, primitives, offset);
+    write_table(header, BAKED_ACCESSORS, state.accessors, offset);
+    write_table(header, BAKED_BUFFER_VIEWS, state.views, offset);
+    write_table(header, BAKED_MATERIALS, materials, offset);
+    write_table(header, BAKED_IMAGES, images, offset);
+    write_table(header, BAKED_SKINS, skins, offset);
+    write_table(header, BAKED_SKIN_JOINTS, joints, offset);
+    write_table(header, BAKED_ANIMATIONS, animations, offset);
+    write_table(header, BAKED_CHANNELS, channels, offset);
+    write_table(header, BAKED_SAMPLERS, samplers, offset);
+    header.tables[BAKED_STRINGS].offset = offset;
+    header.tables[BAKED_STRINGS].count = strings.size();
+    uint32_t dataStart = (offset + strings.size() + 15) & ~15u;
+    for (BakedBufferView &view : state.views) {
+        view.byteOffset += dataStart;
+    }
+    for (BakedImage &image : images) {
+        image.pixelOffset += dataStart;
+    }
+
+    std::vector<unsigned char> file(dataStart + state.data.size(), 0);
+    std::memcpy(&file[0], &header, sizeof(header));
+#define COPY_TABLE(table, records) \
+    if (!records.empty()) std::memcpy(&file[header.tables[table].offset], &records[0], records.size() * sizeof(records[0]))
+    COPY_TABLE(BAKED_NODES, nodes);
+    COPY_TABLE(BAKED_CHILDREN, children);
+    COPY_TABLE(BAKED_ROOTS, roots);
+    COPY_TABLE(BAKED_MESHES, meshes);
+    COPY_TABLE(BAKED_PRIMITIVES, primitives);
+    COPY_TABLE(BAKED_ACCESSORS, state.accessors);
+    COPY_TABLE(BAKED_BUFFER_VIEWS, state.views);
+    COPY_TABLE(BAKED_MATERIALS, materials);
+    COPY_TABLE(BAKED_IMAGES, images);
+    COPY_TABLE(BAKED_SKINS, skins);
+    COPY_TABLE(BAKED_SKIN_JOINTS, joints);
+    COPY_TABLE(BAKED_ANIMATIONS, animations);
+    COPY_TABLE(BAKED_CHANNELS, channels);
+    COPY_TABLE(BAKED_SAMPLERS, samplers);
+    COPY_TABLE(BAKED_STRINGS, strings);
+#undef COPY_TABLE
+    if (!state.data.empty()) {
+        std::memcpy(&file[dataStart], &state.data[0], state.data.size());
+    }
+
+    // Write beside the final name and rename, like the chunk cache
+    std::string tmpName = destination + ".tmp";
+    std::ofstream out(tmpName.c_str(), std::ios::binary | std::ios::trunc);
+    out.write((const char *)&file[0], file.size());
+    out.close();
+    if (!out) {
+        std::remove(tmpName.c_str());
+        err = "cannot write " + destination;
+        return false;
+    }
+#ifdef _WIN32
+    std::remove(destination.c_str());
+#endif
+    std::rename(tmpName.c_str(), destination.c_str());
+    return true;
+}
+
+
+template <typename T>
+static const T *table(const MappedFile &file, const BakedHeader &header, BakedTable table, size_t elementSize = sizeof(T)) {
+    const BakedTableEntry &entry = header.tables[table];
+    if ((size_t)entry.offset + (size_t)entry.count * elementSize > file.size()) {
+        return NULL;
+    }
+    return (const T *)(file.data() + entry.offset);
+}
+
+static const char *PATH_NAMES[] = { "translation", "rotation", "scale", "weights" };
+static const char *INTERPOLATION_NAMES[] = { "LINEAR", "STEP", "CUBICSPLINE" };
+
+bool read_baked_model(const MappedFile &file, const std::string &source, tinygltf::Model &model,
+                      float positionScale[3], float positionOffset[3], std::vector<uint32_t> &pixelOffsets) {
+    if (file.size() < sizeof(BakedHeader)) {
+        return false;
+    }
+    const BakedHeader &header = *(const BakedHeader *)file.data();
+    if (std::memcmp(header.magic, BAKED_MAGIC, 4) != 0 || header.version != BAKED_MODEL_VERSION) {
+        return false;
+    }
+    // A missing source is fine, the blob may ship on its own
+    uint64_t sourceSize;
+    int64_t sourceTime;
+    if (source_stamp(source, sourceSize, sourceTime) && (sourceSize != header.sourceSize || sourceTime != header.sourceTime)) {
+        return false;
+    }
+
+    const BakedNode *nodes = table<BakedNode>(file, header, BAKED_NODES);
+    const int32_t *children = table<int32_t>(file, header, BAKED_CHILDREN);
+    const int32_t *roots = table<int32_t>(file, header, BAKED_ROOTS);
+    const BakedMesh *meshes = table<BakedMesh>(file, header, BAKED_MESHES);
+    const BakedPrimitive *primitives = table<BakedPrimitive>(file, header, BAKED_PRIMITIVES);
+    const BakedAccessor *accessors = table<BakedAccessor>(file, header, BAKED_ACCESSORS);
+    const BakedBufferView *views = table<BakedBufferView>(file, header, BAKED_BUFFER_VIEWS);
+    const BakedMaterial *materials = table<BakedMaterial>(file, header, BAKED_MATERIALS);
+    const BakedImage *images = table<BakedImage>(file, header, BAKED_IMAGES);
+    const BakedSkin *skins = table<BakedSkin>(file, header, BAKED_SKINS);
+    const int32_t *joints = table<int32_t>(file, header, BAKED_SKIN_JOINTS);
+    const BakedAnimation *animations = table<BakedAnimation>(file, header, BAKED_ANIMATIONS);
+    const BakedChannel *channels = table<BakedChannel>(file, header, BAKED_CHANNELS);
+    const BakedSampler *samplers = table<BakedSampler>(file, header, BAKED_SAMPLERS);
+    const char *strings = table<char>(file, header, BAKED_STRINGS);
+    if (!nodes || !children || !roots || !meshes || !primitives || !accessors || !views || !materials
+        || !images || !skins || !joints || !animations || !channels || !samplers || !strings) {
+        return false;
+    }
+    for (uint32_t i = 0; i < header.tables[BAKED_BUFFER_VIEWS].count; i++) {
+        if ((size_t)views[i].byteOffset + views[i].byteLength > file.size()) {
+            return false;
+        }
+    }
+
+    // Buffer 0 is the mapping itself, see ModelResource::buffer_bytes
+    model.buffers.resize(1);
+    model.bufferViews.resize(header.tables[BAKED_BUFFER_VIEWS].count);
+    for (size_t i = 0; i < model.bufferViews.size(); i++) {
+        tinygltf::BufferView &view = model.bufferViews[i];
+        view.buffer = 0;
+        view.byteOffset = views[i].byteOffset;
+        view.byteLength = views[i].byteLength;
+        view.byteStride = views[i].byteStride;
+        view.target = views[i].target;
+    }
+    model.accessors.resize(header.tables[BAKED_ACCESSORS].count);
+    for (size_t i = 0; i < model.accessors.size(); i++) {
+        tinygltf::Accessor &accessor = model.accessors[i];
+        accessor.bufferView = accessors[i].bufferView;
+        accessor.byteOffset = accessors[i].byteOffset;
+        accessor.componentType = accessors[i].componentType;
+        accessor.normalized = accessors[i].normalized != 0;
+        accessor.count = accessors[i].count;
+        accessor.type = accessors[i].type;
+    }
+
+    model.meshes.resize(header.tables[BAKED_MESHES].count);
+    for (size_t i = 0; i < model.meshes.size(); i++) {
+        tinygltf::Mesh &mesh = model.meshes[i];
+        mesh.primitives.resize(meshes[i].primitiveCount);
+        for (uint32_t p = 0; p < meshes[i].primitiveCount; p++) {
+            const BakedPrimitive &baked = primitives[meshes[i].firstPrimitive + p];
+            tinygltf::Primitive &primitive = mesh.primitives[p];
+            for (int a = 0; a < BAKED_ATTRIBUTE_COUNT; a++) {
+                if (baked.attributes[a] >= 0) {
+                    primitive.attributes[ATTRIBUTE_NAMES[a]] = baked.attributes[a];
+                }
+            }
+            primitive.indices = baked.indices;
+            primitive.material = baked.material;
+            primitive.mode = baked.mode;
+        }
+    }
+
+    model.nodes.resize(header.tables[BAKED_NODES].count);
+    for (size_t i = 0; i < model.nodes.size(); i++) {
+        const BakedNode &baked = nodes[i];
+        tinygltf::Node &node = model.nodes[i];
+        if (baked.flags & BAKED_NODE_TRANSLATION) node.translation.assign(baked.translation, baked.translation + 3);
+        if (baked.flags & BAKED_NODE_ROTATION) node.rotation.assign(baked.rotation, baked.rotation + 4);
+        if (baked.flags & BAKED_NODE_SCALE) node.scale.assign(baked.scale, baked.scale + 3);
+        if (baked.flags & BAKED_NODE_MATRIX) node.matrix.assign(baked.matrix, baked.matrix + 16);
+        node.mesh = baked.mesh;
+        node.skin = baked.skin;
+        node.children.assign(children + baked.firstChild, children + baked.firstChild + baked.childCount);
+    }
+    model.scenes.resize(1);
+    model.scenes[0].nodes.assign(roots, roots + header.tables[BAKED_ROOTS].count);
+    model.defaultScene = 0;
+
+    model.materials.resize(header.tables[BAKED_MATERIALS].count);
+    for (size_t i = 0; i < model.materials.size(); i++) {
+        tinygltf::Material &material = model.materials[i];
+        material.pbrMetallicRoughness.baseColorFactor.assign(materials[i].baseColorFactor, materials[i].baseColorFactor + 4);
+        material.pbrMetallicRoughness.baseColorTexture.index = materials[i].baseColorTexture;
+        material.normalTexture.index = materials[i].normalTexture;
+    }
+    model.images.resize(header.tables[BAKED_IMAGES].count);
+    model.textures.resize(model.images.size());
+    pixelOffsets.resize(model.images.size());
+    for (size_t i = 0; i < model.images.size(); i++) {
+        tinygltf::Image &image = model.images[i];
+        if ((size_t)images[i].pixelOffset + images[i].pixelBytes > file.size()
+            || images[i].uriOffset + images[i].uriLength > header.tables[BAKED_STRINGS].count) {
+            return false;
+        }
+        image.width = images[i].width;
+        image.height = images[i].height;
+        image.component = images[i].component;
+        image.bits = images[i].bits;
+        image.uri.assign(strings + images[i].uriOffset, images[i].uriLength);
+        pixelOffsets[i] = images[i].pixelBytes ? images[i].pixelOffset : 0;
+        model.textures[i].source = i;
+    }
+
+    model.skins.resize(header.tables[BAKED_SKINS].count);
+    for (size_t i = 0; i < model.skins.size(); i++) {
+        model.skins[i].inverseBindMatrices = skins[i].inverseBindMatrices;
+        model.skins[i].joints.assign(joints + skins[i].firstJoint, joints + skins[i].firstJoint + skins[i].jointCount);
+    }
+
+    model.animations.resize(header.tables[BAKED_ANIMATIONS].count);
+    for (size_t i = 0; i < model.animations.size(); i++) {
+        tinygltf::Animation &animation = model.animations[i];
+        animation.channels.resize(animations[i].channelCount);
+        for (uint32_t c = 0; c < animations[i].channelCount; c++) {
+            const BakedChannel &baked = channels[animations[i].firstChannel + c];
+            animation.channels[c].sampler = baked.sampler;
+            animation.channels[c].target_node = baked.targetNode;
+            animation.channels[c].target_path = PATH_NAMES[baked.path & 3];
+        }
+        animation.samplers.resize(animations[i].samplerCount);
+        for (uint32_t s = 0; s < animations[i].samplerCount; s++) {
+            const BakedSampler &baked = samplers[animations[i].firstSampler + s];
+            animation.samplers[s].input = baked.input;
+            animation.samplers[s].output = baked.output;
+            animation.samplers[s].interpolation = INTERPOLATION_NAMES[std::min(baked.interpolation, 2)];
+        }
+    }
+
+    for (int c = 0; c < 3; c++) {
+        positionScale[c] = header.positionScale[c];
+        positionOffset[c] = header.positionOffset[c];
+    }
+    return true;
+}
@@ -0,0 +1,184 @@
+#ifndef BAKED_MODEL_H
+#define BAKED_MODEL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include <tiny_gltf.h>
+#include "mapped_file.h"
+
+// Bump whenever the baker or the layout changes so old blobs are rebaked
+// instead of misread
+const uint32_t BAKED_MODEL_VERSION = 1;
+
+// A baked model is one little-endian file: the header, fixed-size record
+// tables and then the data the records point at, every block 16-byte
+// aligned. Vertex streams are interleaved and quantized, so each primitive's
+// vertices are one GL buffer; indices, inverse bind matrices, animation
+// tracks and RGBA pixels are stored exactly as GL and Entity read them, and
+// are used straight from the file mapping.
+enum BakedTable {
+    BAKED_NODES,
+    BAKED_CHILDREN,         // int32 node indices
+    BAKED_ROOTS,            // int32 node indices of the default scene
+    BAKED_MESHES,
+    BAKED_PRIMITIVES,
+    BAKED_ACCESSORS,
+    BAKED_BUFFER_VIEWS,
+    BAKED_MATERIALS,
+    BAKED_IMAGES,
+    BAKED_SKINS,
+    BAKED_SKIN_JOINTS,      // int32 node indices
+    BAKED_ANIMATIONS,
+    BAKED_CHANNELS,
+    BAKED_SAMPLERS,
+    BAKED_STRINGS,          // chars of image URIs
+    BAKED_TABLE_COUNT
+};
+
+struct BakedTableEntry {
+    uint32_t offset;
+    uint32_t count;
+};
+
+struct BakedHeader {
+    char magic[4];
+    uint32_t version;
+    // Size and modification time of the source, to spot stale blobs
+    uint64_t sourceSize;
+    int64_t sourceTime;
+    // Positions are normalized shorts: position = offset + scale * value
+    float positionScale[3];
+    float positionOffset[3];
+    BakedTableEntry tables[BAKED_TABLE_COUNT];
+};
+
+enum BakedNodeFlags {
+    BAKED_NODE_TRANSLATION = 1,
+    BAKED_NODE_ROTATION = 2,
+    BAKED_NODE_SCALE = 4,
+    BAKED_NODE_MATRIX = 8
+};
+
+struct BakedNode {
+    float translation[3];
+    float rotation[4];
+    float scale[3];
+    float matrix[16];
+    uint32_t flags;
+    int32_t mesh;
+    int32_t skin;
+    uint32_t firstChild;
+    uint32_t childCount;
+};
+
+struct BakedMesh {
+    uint32_t firstPrimitive;
+    uint32_t primitiveCount;
+};
+
+// Accessor per attribute slot, -1 when absent
+enum BakedAttribute {
+    BAKED_POSITION,
+    BAKED_NORMAL,
+    BAKED_TEXCOORD,
+    BAKED_JOINTS,
+    BAKED_WEIGHTS,
+    BAKED_ATTRIBUTE_COUNT
+};
+
+struct BakedPrimitive {
+    int32_t attributes[BAKED_ATTRIBUTE_COUNT];
+    int32_t indices;
+    int32_t material;
+    int32_t mode;
+};
+
+struct BakedAccessor {
+    int32_t bufferView;
+    uint32_t byteOffset;
+    int32_t componentType;
+    int32_t normalized;
+    uint32_t count;
+    int32_t type;
+};
+
+// byteOffset is from the start of the file
+struct BakedBufferView {
+    uint32_t byteOffset;
+    uint32_t byteLength;
+    uint32_t byteStride;
+    uint32_t target;
+};
+
+// Texture indices are image indices
+struct BakedMaterial {
+    float baseColorFactor[4];
+    int32_t baseColorTexture;
+    int32_t normalTexture;
+};
+
+struct BakedImage {
+    uint32_t width;
+    uint32_t height;
+    uint32_t component;
+    uint32_t bits;
+    uint32_t pixelOffset;
+    uint32_t pixelBytes;
+    uint32_t uriOffset;     // Into the string table, relative to the model
+    uint32_t uriLength;
+};
+
+struct BakedSkin {
+    int32_t inverseBindMatrices;
+    uint32_t firstJoint;
+    uint32_t jointCount;
+};
+
+struct BakedAnimation {
+    uint32_t firstChannel;
+    uint32_t channelCount;
+    uint32_t firstSampler;
+    uint32_t samplerCount;
+};
+
+enum BakedPath {
+    BAKED_PATH_TRANSLATION,
+    BAKED_PATH_ROTATION,
+    BAKED_PATH_SCALE,
+    BAKED_PATH_WEIGHTS
+};
+
+struct BakedChannel {
+    int32_t sampler;
+    int32_t targetNode;
+    int32_t path;
+};
+
+struct BakedSampler {
+    int32_t input;
+    int32_t output;
+    int32_t interpolation;  // 0 linear, 1 step, 2 cubic spline
+};
+
+// Where the build puts the blob of a model, relative to the working
+// directory: assets/<file name without extension>.bake
+std::string baked_model_path(const std::string &source);
+
+// Components of one accessor element as floats, normalized integers mapped
+// to [0, 1] or [-1, 1]. buffers[i] is where buffer i starts.
+void read_accessor(const tinygltf::Model &model, const std::vector<const unsigned char *> &buffers,
+                   int accessor, size_t index, float *out);
+
+// Converts a loaded glTF model. Returns false with err set when the model
+// uses something the layout cannot express.
+bool bake_model(const tinygltf::Model &model, const std::string &source, const std::string &destination, std::string &err);
+
+// Fills model from a mapped blob, with buffer 0 standing for the mapping
+// itself. Pixels of image i are at file->data() + pixelOffsets[i].
+bool read_baked_model(const MappedFile &file, const std::string &source, tinygltf::Model &model,
+                      float positionScale[3], float positionOffset[3], std::vector<uint32_t> &pixelOffsets);
+
+#endif
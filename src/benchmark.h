@@ -0,0 +1,9 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+// Microbenchmarks and reference checks, run with `project_scene --bench`.
+// Called after the GL context is created so GPU paths can be measured too.
+// Returns the number of failed checks.
+int run_benchmarks();
+
+#endif
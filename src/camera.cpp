@@ -29,6 +29,30 @@ Frustum Camera::createFrustumFromCamera(float aspect, float zNear, float zFar){
 	return frustum;
 }
 
+static Plane planeFromRow(const glm::vec4 &row)
+{
+	Plane plane;
+	float length = glm::length(glm::vec3(row));
+	plane.normal = glm::vec3(row) / length;
+	plane.distance = -row.w / length;
+	return plane;
+}
+
+// Gribb-Hartmann: each clip plane is the last row of the matrix plus or
+// minus one of the others
+Frustum Camera::createFrustumFromMatrix(const glm::mat4 &viewProjection)
+{
+	glm::mat4 m = glm::transpose(viewProjection);
+	Frustum frustum;
+	frustum.leftFace = planeFromRow(m[3] + m[0]);
+	frustum.rightFace = planeFromRow(m[3] - m[0]);
+	frustum.bottomFace = planeFromRow(m[3] + m[1]);
+	frustum.topFace = planeFromRow(m[3] - m[1]);
+	frustum.nearFace = planeFromRow(m[3] + m[2]);
+	frustum.farFace = planeFromRow(m[3] - m[2]);
+	return frustum;
+}
+
 // processes input received from any keyboard-like input system. Accepts input parameter in the form of camera defined ENUM (to abstract it from windowing systems)
 void Camera::ProcessKeyboard(Camera_Movement direction, float deltaTime)
 {
@@ -58,6 +58,9 @@ public:
 
     Frustum createFrustumFromCamera(float aspect, float zNear, float zFar);
 
+    // Planes of any view-projection matrix, e.g. the light's ortho projection
+    static Frustum createFrustumFromMatrix(const glm::mat4 &viewProjection);
+
     void updateCameraVectors();
 
     glm::mat4 GetViewMatrix();
@@ -0,0 +1,280 @@
+#include "chunk_cache.h"
+#include "terrain.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <thread>
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+// File layout: header, treeCount tree records, payload
+struct ChunkFileHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t keyHash;
+    int32_t x;
+    int32_t y;
+    uint32_t codec;
+    uint32_t vertexCount;
+    uint32_t rowLength;
+    uint32_t payloadSize;
+    uint32_t treeCount;
+    float minHeight;
+    float maxHeight;
+    uint32_t pad;
+};
+
+struct ChunkFileTree {
+    float xpos;
+    float ypos;
+    float zpos;
+    int32_t xOffset;
+    int32_t yOffset;
+};
+
+static const char CHUNK_FILE_MAGIC[4] = { 'T', 'C', 'H', 'K' };
+static const size_t MAX_CODEC_ROW = 255;     // Zero runs must fit a byte
+
+
+// FNV-1a over the key fields, floats by bit pattern
+uint64_t ChunkCacheKey::hash() const {
+    uint64_t h = 1469598103934665603ull;
+    const uint32_t fields[] = { CHUNK_CACHE_VERSION, seed, (uint32_t)octaves, 0, 0, 0, 0, 0, (uint32_t)chunkWidth, (uint32_t)chunkHeight };
+    uint32_t words[10];
+    std::memcpy(words, fields, sizeof(words));
+    std::memcpy(&words[3], &persistence, 4);
+    std::memcpy(&words[4], &lacunarity, 4);
+    std::memcpy(&words[5], &noiseScale, 4);
+    std::memcpy(&words[6], &meshHeight, 4);
+    std::memcpy(&words[7], &waterHeight, 4);
+    const unsigned char *bytes = (const unsigned char *)words;
+    for (size_t i = 0; i < sizeof(words); i++) {
+        h = (h ^ bytes[i]) * 1099511628211ull;
+    }
+    return h;
+}
+
+
+bool CachedChunk::decode(TerrainVertex *dst) const {
+    if (codec == CHUNK_CODEC_RAW) {
+        if (payloadSize != vertexCount * sizeof(TerrainVertex)) {
+            return false;
+        }
+        std::memcpy(dst, payload, payloadSize);
+        return true;
+    }
+    return ChunkCache::decode(payload, payloadSize, dst, vertexCount, rowLength);
+}
+
+
+ChunkCache::ChunkCache() : hits(0), misses(0) {
+}
+
+static bool make_directory(const std::string &path) {
+#ifdef _WIN32
+    return _mkdir(path.c_str()) == 0 || errno == EEXIST;
+#else
+    return mkdir(path.c_str(), 0755) == 0 || errno == EEXIST;
+#endif
+}
+
+void ChunkCache::open(const std::string &directory, const ChunkCacheKey &cacheKey) {
+    key = cacheKey;
+    keyHash = key.hash();
+    char name[17];
+    snprintf(name, sizeof(name), "%016llx", (unsigned long long)keyHash);
+    path = directory + "/" + name;
+    enabled = make_directory(directory) && make_directory(path);
+    if (!enabled) {
+        std::cout << "Terrain chunk cache disabled: cannot create " << path << std::endl;
+    }
+}
+
+std::string ChunkCache::chunk_path(int x, int y) const {
+    std::ostringstream name;
+    name << path << "/chunk_" << x << "_" << y << ".bin";
+    return name.str();
+}
+
+bool ChunkCache::load(int x, int y, ChunkData &chunk) {
+    if (!enabled) {
+        return false;
+    }
+    std::unique_ptr<MappedFile> file(new MappedFile());
+    const ChunkFileHeader *header = NULL;
+    if (file->open(chunk_path(x, y)) && file->size() >= sizeof(ChunkFileHeader)) {
+        header = (const ChunkFileHeader *)file->data();
+    }
+    size_t treeBytes = header ? (size_t)header->treeCount * sizeof(ChunkFileTree) : 0;
+    if (header == NULL || std::memcmp(header->magic, CHUNK_FILE_MAGIC, 4) != 0 || header->version != CHUNK_CACHE_VERSION
+        || header->keyHash != keyHash || header->x != x || header->y != y
+        || header->vertexCount != (uint32_t)(key.chunkWidth * key.chunkHeight)
+        || file->size() != sizeof(ChunkFileHeader) + treeBytes + header->payloadSize
+        || (header->codec == CHUNK_CODEC_RAW && header->payloadSize != header->vertexCount * sizeof(TerrainVertex))
+        || (header->codec != CHUNK_CODEC_RAW && header->codec != CHUNK_CODEC_PLANES)) {
+        misses++;
+        return false;
+    }
+
+    const ChunkFileTree *trees = (const ChunkFileTree *)(file->data() + sizeof(ChunkFileHeader));
+    chunk.treeCoords.clear();
+    for (uint32_t i = 0; i < header->treeCount; i++) {
+        chunk.treeCoords.push_back(treeCoord(trees[i].xpos, trees[i].ypos, trees[i].zpos, trees[i].xOffset, trees[i].yOffset));
+    }
+    chunk.minHeight = header->minHeight;
+    chunk.maxHeight = header->maxHeight;
+    chunk.cached.payload = file->data() + sizeof(ChunkFileHeader) + treeBytes;
+    chunk.cached.payloadSize = header->payloadSize;
+    chunk.cached.codec = header->codec;
+    chunk.cached.vertexCount = header->vertexCount;
+    chunk.cached.rowLength = header->rowLength;
+    chunk.cached.file = std::move(file);
+    hits++;
+    return true;
+}
+
+void ChunkCache::store(int x, int y, const ChunkData &chunk) {
+    if (!enabled) {
+        return;
+    }
+    ChunkFileHeader header;
+    std::memcpy(header.magic, CHUNK_FILE_MAGIC, 4);
+    header.version = CHUNK_CACHE_VERSION;
+    header.keyHash = keyHash;
+    header.x = x;
+    header.y = y;
+    header.vertexCount = chunk.vertices.size();
+    header.rowLength = key.chunkWidth;
+    header.treeCount = chunk.treeCoords.size();
+    header.minHeight = chunk.minHeight;
+    header.maxHeight = chunk.maxHeight;
+    header.pad = 0;
+
+    // Keep the raw layout unless compression saves enough to give up the
+    // zero-copy upload
+    size_t rawSize = chunk.vertices.size() * sizeof(TerrainVertex);
+    std::vector<unsigned char> encoded = encode(&chunk.vertices[0], chunk.vertices.size(), key.chunkWidth);
+    const unsigned char *payload = (const unsigned char *)&chunk.vertices[0];
+    header.codec = CHUNK_CODEC_RAW;
+    header.payloadSize = rawSize;
+    if (!encoded.empty() && encoded.size() <= rawSize * compressBelow) {
+        payload = &encoded[0];
+        header.codec = CHUNK_CODEC_PLANES;
+        header.payloadSize = encoded.size();
+    }
+
+    std::vector<ChunkFileTree> trees;
+    for (const treeCoord &tree : chunk.treeCoords) {
+        ChunkFileTree record = { tree.xpos, tree.ypos, tree.zpos, tree.xOffset, tree.yOffset };
+        trees.push_back(record);
+    }
+
+    // Write beside the final name and rename, so a reader never maps a
+    // half-written file
+    std::ostringstream tmpName;
+    tmpName << chunk_path(x, y) << ".tmp" << std::hash<std::thread::id>()(std::this_thread::get_id());
+    {
+        std::ofstream out(tmpName.str().c_str(), std::ios::binary | std::ios::trunc);
+        out.write((const char *)&header, sizeof(header));
+        if (!trees.empty()) {
+            out.write((const char *)&trees[0], trees.size() * sizeof(ChunkFileTree));
+        }
+        out.write((const char *)payload, header.payloadSize);
+        if (!out) {
+            std::remove(tmpName.str().c_str());
+            return;
+        }
+    }
+#ifdef _WIN32
+    std::remove(chunk_path(x, y).c_str());
+#endif
+    std::rename(tmpName.str().c_str(), chunk_path(x, y).c_str());
+}
+
+
+// Rows of rowLength vertices are coded independently. Inside a row each of
+// the 8 bytes of TerrainVertex is a plane of deltas to the previous vertex;
+// a zero delta byte is followed by the length of its zero run. Heights and
+// normals change slowly and the biome and padding planes are nearly all
+// zeros, which roughly halves the payload.
+std::vector<unsigned char> ChunkCache::encode(const TerrainVertex *vertices, size_t count, size_t rowLength) {
+    std::vector<unsigned char> out;
+    if (rowLength == 0 || rowLength > MAX_CODEC_ROW) {
+        return out;
+    }
+    const unsigned char *bytes = (const unsigned char *)vertices;
+    out.reserve(count * sizeof(TerrainVertex) / 2);
+    for (size_t row = 0; row < count; row += rowLength) {
+        size_t n = std::min(rowLength, count - row);
+        for (size_t plane = 0; plane < sizeof(TerrainVertex); plane++) {
+            unsigned char previous = 0;
+            size_t zeros = 0;
+            for (size_t i = 0; i < n; i++) {
+                unsigned char value = bytes[(row + i) * sizeof(TerrainVertex) + plane];
+                unsigned char delta = value - previous;
+                previous = value;
+                if (delta == 0) {
+                    zeros++;
+                    continue;
+                }
+                if (zeros > 0) {
+                    out.push_back(0);
+                    out.push_back((unsigned char)zeros);
+                    zeros = 0;
+                }
+                out.push_back(delta);
+            }
+            if (zeros > 0) {
+                out.push_back(0);
+                out.push_back((unsigned char)zeros);
+            }
+        }
+    }
+    return out;
+}
+
+bool ChunkCache::decode(const unsigned char *src, size_t size, TerrainVertex *dst, size_t count, size_t rowLength) {
+    if (rowLength == 0 || rowLength > MAX_CODEC_ROW) {
+        return false;
+    }
+    // Each row is rebuilt in a small local block and then copied out in
+    // order, so dst can be write-combined GL memory
+    unsigned char block[MAX_CODEC_ROW * sizeof(TerrainVertex)];
+    size_t pos = 0;
+    for (size_t row = 0; row < count; row += rowLength) {
+        size_t n = std::min(rowLength, count - row);
+        for (size_t plane = 0; plane < sizeof(TerrainVertex); plane++) {
+            unsigned char value = 0;
+            size_t i = 0;
+            while (i < n) {
+                if (pos >= size) {
+                    return false;
+                }
+                unsigned char delta = src[pos++];
+                if (delta != 0) {
+                    value += delta;
+                    block[i++ * sizeof(TerrainVertex) + plane] = value;
+                    continue;
+                }
+                if (pos >= size || src[pos] == 0 || i + src[pos] > n) {
+                    return false;
+                }
+                for (size_t end = i + src[pos++]; i < end; i++) {
+                    block[i * sizeof(TerrainVertex) + plane] = value;
+                }
+            }
+        }
+        std::memcpy(dst + row, block, n * sizeof(TerrainVertex));
+    }
+    return pos == size;
+}
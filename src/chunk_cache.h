@@ -0,0 +1,82 @@
+#ifndef CHUNK_CACHE_H
+#define CHUNK_CACHE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include "mapped_file.h"
+
+struct TerrainVertex;
+struct ChunkData;
+
+// Bump whenever the generator or the file layout changes so old caches are
+// ignored instead of misread
+const uint32_t CHUNK_CACHE_VERSION = 2;
+
+enum ChunkCodec {
+    CHUNK_CODEC_RAW = 0,        // TerrainVertex array as-is, uploaded straight from the mapping
+    CHUNK_CODEC_PLANES = 1      // Per-row byte planes, delta coded, zero runs collapsed
+};
+
+// Everything that changes the generated chunks
+struct ChunkCacheKey {
+    uint32_t seed;
+    int32_t octaves;
+    float persistence;
+    float lacunarity;
+    float noiseScale;
+    float meshHeight;
+    float waterHeight;
+    int32_t chunkWidth;
+    int32_t chunkHeight;
+
+    uint64_t hash() const;
+};
+
+// Chunk read from the cache: the payload stays in the mapping until upload
+struct CachedChunk {
+    std::unique_ptr<MappedFile> file;
+    const unsigned char *payload = NULL;
+    uint32_t payloadSize = 0;
+    uint32_t codec = CHUNK_CODEC_RAW;
+    uint32_t vertexCount = 0;
+    uint32_t rowLength = 0;
+
+    // Writes the decoded vertices to dst, e.g. a mapped GL buffer
+    bool decode(TerrainVertex *dst) const;
+};
+
+// On-disk cache of generated chunks, one file per chunk under a directory
+// named after the key. load/store are safe to call from worker threads.
+class ChunkCache
+{
+public:
+    bool enabled = false;
+    std::atomic<int> hits;
+    std::atomic<int> misses;
+    // A payload is stored planes-coded only when that takes at most this
+    // fraction of the raw size. Raw payloads skip the decode and upload
+    // straight from the mapping, worth more than halving the file.
+    float compressBelow = 0.25f;
+
+    ChunkCache();
+
+    void open(const std::string &directory, const ChunkCacheKey &key);
+    bool load(int x, int y, ChunkData &chunk);
+    void store(int x, int y, const ChunkData &chunk);
+
+    static std::vector<unsigned char> encode(const TerrainVertex *vertices, size_t count, size_t rowLength);
+    static bool decode(const unsigned char *src, size_t size, TerrainVertex *dst, size_t count, size_t rowLength);
+
+private:
+    std::string path;
+    ChunkCacheKey key;
+    uint64_t keyHash = 0;
+
+    std::string chunk_path(int x, int y) const;
+};
+
+#endif
@@ -0,0 +1,199 @@
+#include "clipmap.h"
+#include <render/shader.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+
+static int wrap(int value, int size) {
+    return ((value % size) + size) % size;
+}
+
+static int floor_div(float value, int divisor) {
+    return (int)std::floor(value / divisor);
+}
+
+// Two triangles per cell, always split along the (i, j)-(i + 1, j + 1)
+// diagonal: clipmap.vert morphs odd vertices onto that same diagonal
+static void append_cells(std::vector<GLushort> &indices, int gridSize, int holeX, int holeY, int holeSize) {
+    int row = gridSize + 1;
+    for (int j = 0; j < gridSize; j++)
+        for (int i = 0; i < gridSize; i++) {
+            if (i >= holeX && i < holeX + holeSize && j >= holeY && j < holeY + holeSize) {
+                continue;
+            }
+            GLushort corner = i + j * row;
+            indices.push_back(corner);
+            indices.push_back(corner + 1);
+            indices.push_back(corner + row + 1);
+            indices.push_back(corner);
+            indices.push_back(corner + row + 1);
+            indices.push_back(corner + row);
+        }
+}
+
+Clipmap::Clipmap(const PerlinNoise &noise, const FbmParams &params, float meshHeight, float waterHeight,
+                 glm::vec2 worldOffset, int levels, int gridSize)
+: levels(levels), gridSize(gridSize), textureSize(gridSize + 4), worldOffset(worldOffset),
+  noise(noise), params(params), meshHeight(meshHeight), waterHeight(waterHeight),
+  levelBase(levels), holeShift(levels), levelValid(levels, false) {
+    maxPossibleHeight = 0;
+    float amp = 1;
+    for (int i = 0; i < params.octaves; i++) {
+        maxPossibleHeight += amp;
+        amp *= params.persistence;
+    }
+
+    // The finer level covers half of each ring, starting a quarter in
+    std::vector<GLushort> indices;
+    append_cells(indices, gridSize, 0, 0, 0);
+    fullCount = indices.size();
+    for (int variant = 0; variant < 4; variant++) {
+        ringOffset[variant] = indices.size() * sizeof(GLushort);
+        append_cells(indices, gridSize, gridSize / 4 + (variant & 1), gridSize / 4 + (variant >> 1), gridSize / 2);
+    }
+    ringCount = (indices.size() - fullCount) / 4;
+
+    // Grid positions come from gl_VertexID, so the VAO only holds the indices
+    glGenVertexArrays(1, &vao);
+    glBindVertexArray(vao);
+    glGenBuffers(1, &indexBuffer);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLushort), &indices[0], GL_STATIC_DRAW);
+    glBindVertexArray(0);
+
+    glGenTextures(1, &heightmap);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, heightmap);
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_R32F, textureSize, textureSize, levels, 0, GL_RED, GL_FLOAT, NULL);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+    depthProgramID = LoadShadersFromFile("../src/shader/depthClipmap.vert", "../src/shader/depth.frag");
+
+    std::cout << "Terrain clipmap: " << levels << " levels of " << gridSize << "x" << gridSize << " cells, "
+              << triangles_per_frame() << " triangles per frame, " << heightmap_bytes() / (1024.0 * 1024.0)
+              << " MB heightmap" << std::endl;
+}
+
+Clipmap::~Clipmap() {
+    glDeleteVertexArrays(1, &vao);
+    glDeleteBuffers(1, &indexBuffer);
+    glDeleteTextures(1, &heightmap);
+    glDeleteProgram(depthProgramID);
+}
+
+int Clipmap::triangles_per_frame() const {
+    return (fullCount + (levels - 1) * ringCount) / 3;
+}
+
+size_t Clipmap::heightmap_bytes() const {
+    return (size_t)textureSize * textureSize * levels * sizeof(float);
+}
+
+void Clipmap::update(glm::vec3 cameraPosition) {
+    glm::vec2 camera = glm::vec2(cameraPosition.x, cameraPosition.z) - worldOffset;
+    // Window of a level: its grid plus one sample of border for the normals
+    int window = gridSize + 3;
+    glBindTexture(GL_TEXTURE_2D_ARRAY, heightmap);
+    for (int level = 0; level < levels; level++) {
+        int scale = 1 << level;
+        // Centred on a multiple of two cells so the grid starts on an even
+        // sample and its border lines up with the next coarser level
+        glm::ivec2 base(2 * floor_div(camera.x, 2 * scale) - gridSize / 2, 2 * floor_div(camera.y, 2 * scale) - gridSize / 2);
+        // Offset of the finer level's centre from this one's, in cells: 0 or 1
+        holeShift[level] = glm::ivec2(floor_div(camera.x, scale), floor_div(camera.y, scale))
+                         - 2 * glm::ivec2(floor_div(camera.x, 2 * scale), floor_div(camera.y, 2 * scale));
+
+        glm::ivec2 old = levelBase[level];
+        glm::ivec2 delta = base - old;
+        levelBase[level] = base;
+        if (!levelValid[level] || std::abs(delta.x) >= window || std::abs(delta.y) >= window) {
+            write_region(level, base.x - 1, base.y - 1, window, window);
+            levelValid[level] = true;
+            continue;
+        }
+        // Columns entering the window, over its full new height
+        if (delta.x > 0) {
+            write_region(level, old.x - 1 + window, base.y - 1, delta.x, window);
+        } else if (delta.x < 0) {
+            write_region(level, base.x - 1, base.y - 1, -delta.x, window);
+        }
+        // Rows entering the window, over the columns it kept
+        int keptX = std::max(old.x, base.x) - 1;
+        int keptWidth = window - std::abs(delta.x);
+        if (delta.y > 0) {
+            write_region(level, keptX, old.y - 1 + window, keptWidth, delta.y);
+        } else if (delta.y < 0) {
+            write_region(level, keptX, base.y - 1, keptWidth, -delta.y);
+        }
+    }
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+}
+
+// Generates samples (x0 + i, y0 + j) of a level, eased exactly like
+// Terrain::generate_heights, and stores them at their toroidal texels
+void Clipmap::write_region(int level, int x0, int y0, int width, int height) {
+    scratch.resize(width * height);
+    // Level samples are 2^level grid points apart: divide the scale instead
+    // of the coordinates, exact for power of two steps
+    FbmParams levelParams = params;
+    levelParams.scale = params.scale / (1 << level);
+    noise.fbm_tile(&scratch[0], x0, y0, width, height, levelParams);
+    for (float &value : scratch) {
+        float easedNoise = std::pow((value + 1) / maxPossibleHeight * 1.1, 3);
+        value = std::fmax(easedNoise * meshHeight, waterHeight * 0.5 * meshHeight);
+    }
+    samplesWritten += width * height;
+
+    // A region wraps around the layer edge at most once per axis
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, width);
+    int tx = wrap(x0, textureSize), ty = wrap(y0, textureSize);
+    int firstWidth = std::min(width, textureSize - tx);
+    int firstHeight = std::min(height, textureSize - ty);
+    for (int part = 0; part < 4; part++) {
+        int px = part & 1 ? firstWidth : 0;
+        int py = part & 2 ? firstHeight : 0;
+        int pw = part & 1 ? width - firstWidth : firstWidth;
+        int ph = part & 2 ? height - firstHeight : firstHeight;
+        if (pw == 0 || ph == 0) {
+            continue;
+        }
+        glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, (tx + px) % textureSize, (ty + py) % textureSize, level,
+                        pw, ph, 1, GL_RED, GL_FLOAT, &scratch[px + py * width]);
+    }
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+}
+
+int Clipmap::draw(GLuint program) {
+    glBindVertexArray(vao);
+    glActiveTexture(GL_TEXTURE0+3);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, heightmap);
+    glUniform1i(glGetUniformLocation(program, "heightmap"), 3);
+    glUniform1i(glGetUniformLocation(program, "gridSize"), gridSize);
+    glUniform1i(glGetUniformLocation(program, "textureSize"), textureSize);
+    glUniform2fv(glGetUniformLocation(program, "worldOffset"), 1, &worldOffset[0]);
+    glUniform1f(glGetUniformLocation(program, "meshHeight"), meshHeight);
+    GLint levelID = glGetUniformLocation(program, "level");
+    GLint levelBaseID = glGetUniformLocation(program, "levelBase");
+    GLint texelBaseID = glGetUniformLocation(program, "texelBase");
+    GLint morphID = glGetUniformLocation(program, "morph");
+
+    for (int level = 0; level < levels; level++) {
+        glm::ivec2 base = levelBase[level];
+        glUniform1i(levelID, level);
+        glUniform2i(levelBaseID, base.x, base.y);
+        glUniform2i(texelBaseID, wrap(base.x, textureSize), wrap(base.y, textureSize));
+        // The outermost level has nothing coarser to blend into
+        glUniform1i(morphID, level + 1 < levels);
+        if (level == 0) {
+            glDrawElements(GL_TRIANGLES, fullCount, GL_UNSIGNED_SHORT, 0);
+        } else {
+            int variant = holeShift[level].x + 2 * holeShift[level].y;
+            glDrawElements(GL_TRIANGLES, ringCount, GL_UNSIGNED_SHORT, (void *)ringOffset[variant]);
+        }
+    }
+    glBindVertexArray(0);
+    return triangles_per_frame();
+}
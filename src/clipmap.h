@@ -0,0 +1,68 @@
+#ifndef CLIPMAP_H
+#define CLIPMAP_H
+
+#include <glad/gl.h>
+#include <glm/glm.hpp>
+#include <vector>
+#include "noise.h"
+
+// Geometry clipmap: nested square rings of one shared grid centred on the
+// camera, level l spacing 2^l. Heights live in a toroidally addressed
+// GL_R32F texture array, one layer per level, and only the rows and columns
+// that scroll into a level's window are regenerated. GPU memory and the
+// per-frame vertex count depend only on the level count and grid size.
+class Clipmap
+{
+public:
+    int levels;
+    int gridSize;           // Cells per level side, a multiple of 4
+    int textureSize;        // Texels per layer side: the grid plus a normal border
+    glm::vec2 worldOffset;  // World xz of noise grid point (0, 0)
+    GLuint vao = 0;
+    GLuint indexBuffer = 0;
+    GLuint heightmap = 0;
+    GLuint depthProgramID = 0;
+
+    // Index ranges: the full grid for level 0, then rings whose hole is
+    // shifted by (0|1, 0|1) cells to follow the finer level's snapping
+    int fullCount;
+    int ringCount;
+    GLsizeiptr ringOffset[4];
+
+    // Samples regenerated since the caller last reset the counter
+    int samplesWritten = 0;
+
+    Clipmap(const PerlinNoise &noise, const FbmParams &params, float meshHeight, float waterHeight,
+            glm::vec2 worldOffset, int levels = 6, int gridSize = 128);
+    ~Clipmap();
+
+    // Recentres every level on the camera and writes the exposed strips
+    void update(glm::vec3 cameraPosition);
+    // Draws every level with the bound program, returns the triangle count
+    int draw(GLuint program);
+
+    int triangles_per_frame() const;
+    size_t heightmap_bytes() const;
+    // Window origin of a level in its own grid units, e.g. for readback
+    glm::ivec2 level_base(int level) const { return levelBase[level]; }
+    // Cells the level's hole is shifted by, i.e. the index variant drawn
+    glm::ivec2 hole_shift(int level) const { return holeShift[level]; }
+
+private:
+    const PerlinNoise &noise;
+    FbmParams params;
+    float meshHeight;
+    float waterHeight;
+    float maxPossibleHeight;
+    std::vector<glm::ivec2> levelBase;
+    std::vector<glm::ivec2> holeShift;
+    std::vector<bool> levelValid;
+    std::vector<float> scratch;
+
+    void write_region(int level, int x0, int y0, int width, int height);
+
+    Clipmap(const Clipmap&) = delete;
+    Clipmap& operator=(const Clipmap&) = delete;
+};
+
+#endif
@@ -45,4 +45,20 @@ struct Frustum
 
 	Plane farFace;
 	Plane nearFace;
+
+	// Conservative box test: false only when the box is fully outside one plane
+	bool isOnFrustum(const glm::vec3& boxMin, const glm::vec3& boxMax) const
+	{
+		const Plane* planes[6] = { &topFace, &bottomFace, &rightFace, &leftFace, &farFace, &nearFace };
+		for (const Plane* plane : planes) {
+			// Corner furthest along the plane normal
+			glm::vec3 corner(plane->normal.x >= 0 ? boxMax.x : boxMin.x,
+			                 plane->normal.y >= 0 ? boxMax.y : boxMin.y,
+			                 plane->normal.z >= 0 ? boxMax.z : boxMin.z);
+			if (plane->getSignedDistanceToPlane(corner) < 0) {
+				return false;
+			}
+		}
+		return true;
+	}
 };
\ No newline at end of file
@@ -1,4 +1,5 @@
 #include "entity.h"
+#include "baked_model.h"
 
 
 
@@ -65,9 +66,8 @@ glm::mat4 getNodeTransform(const tinygltf::Node& node) {
 			const tinygltf::Accessor &accessor = model.accessors[skin.inverseBindMatrices];
 			assert(accessor.type == TINYGLTF_TYPE_MAT4);
 			const tinygltf::BufferView &bufferView = model.bufferViews[accessor.bufferView];
-			const tinygltf::Buffer &buffer = model.buffers[bufferView.buffer];
 			const float *ptr = reinterpret_cast<const float *>(
-				buffer.data.data() + accessor.byteOffset + bufferView.byteOffset);
+				resource->buffer_bytes(bufferView.buffer) + accessor.byteOffset + bufferView.byteOffset);
 			
 			skinObject.inverseBindMatrices.resize(accessor.count);
 			for (size_t j = 0; j < accessor.count; j++) {
@@ -131,6 +131,21 @@ glm::mat4 getNodeTransform(const tinygltf::Node& node) {
 		return times.size() - 2;
 	}
 
+	// Same keyframe as findKeyframeIndex, but tries the cursor's keyframe and
+	// the one after it first, which is where playback almost always is
+	int findKeyframeIndex(const std::vector<float>& times, float animationTime, int &cursor)
+	{
+		int last = times.size() - 2;
+		for (int i = cursor; i <= cursor + 1 && i <= last; i++) {
+			if (times[i] <= animationTime && animationTime < times[i + 1]) {
+				cursor = i;
+				return i;
+			}
+		}
+		cursor = findKeyframeIndex(times, animationTime);
+		return cursor;
+	}
+
 	std::vector<AnimationObject> Entity::prepareAnimation(const tinygltf::Model &model) 
 	{
 		std::vector<AnimationObject> animationObjects;
@@ -142,7 +157,6 @@ glm::mat4 getNodeTransform(const tinygltf::Node& node) {
 
 				const tinygltf::Accessor &inputAccessor = model.accessors[sampler.input];
 				const tinygltf::BufferView &inputBufferView = model.bufferViews[inputAccessor.bufferView];
-				const tinygltf::Buffer &inputBuffer = model.buffers[inputBufferView.buffer];
 
 				assert(inputAccessor.componentType == TINYGLTF_COMPONENT_TYPE_FLOAT);
 				assert(inputAccessor.type == TINYGLTF_TYPE_SCALAR);
@@ -150,8 +164,7 @@ glm::mat4 getNodeTransform(const tinygltf::Node& node) {
 				// Input (time) values
 				samplerObject.input.resize(inputAccessor.count);
 
-				const unsigned char *inputPtr = &inputBuffer.data[inputBufferView.byteOffset + inputAccessor.byteOffset];
-				const float *inputBuf = reinterpret_cast<const float*>(inputPtr);
+				const unsigned char *inputPtr = resource->buffer_bytes(inputBufferView.buffer) + inputBufferView.byteOffset + inputAccessor.byteOffset;
 
 				// Read input (time) values
 				int stride = inputAccessor.ByteStride(inputBufferView);
@@ -161,14 +174,10 @@ glm::mat4 getNodeTransform(const tinygltf::Node& node) {
 				
 				const tinygltf::Accessor &outputAccessor = model.accessors[sampler.output];
 				const tinygltf::BufferView &outputBufferView = model.bufferViews[outputAccessor.bufferView];
-				const tinygltf::Buffer &outputBuffer = model.buffers[outputBufferView.buffer];
 
 				assert(outputAccessor.componentType == TINYGLTF_COMPONENT_TYPE_FLOAT);
 
-				const unsigned char *outputPtr = &outputBuffer.data[outputBufferView.byteOffset + outputAccessor.byteOffset];
-				const float *outputBuf = reinterpret_cast<const float*>(outputPtr);
-
-				int outputStride = outputAccessor.ByteStride(outputBufferView);
+				const unsigned char *outputPtr = resource->buffer_bytes(outputBufferView.buffer) + outputBufferView.byteOffset + outputAccessor.byteOffset;
 				
 				// Output values
 				samplerObject.output.resize(outputAccessor.count);
@@ -188,69 +197,476 @@ glm::mat4 getNodeTransform(const tinygltf::Node& node) {
 				animationObject.samplers.push_back(samplerObject);			
 			}
 
+			for (const auto &channel : anim.channels) {
+				ChannelObject channelObject;
+				channelObject.sampler = channel.sampler;
+				channelObject.targetNode = channel.target_node;
+				channelObject.cursor = 0;
+				if (channel.target_path == "translation") {
+					channelObject.path = PATH_TRANSLATION;
+				} else if (channel.target_path == "rotation") {
+					channelObject.path = PATH_ROTATION;
+				} else if (channel.target_path == "scale") {
+					channelObject.path = PATH_SCALE;
+				} else {
+					channelObject.path = PATH_WEIGHTS;
+				}
+				animationObject.channels.push_back(channelObject);
+			}
+
 			animationObjects.push_back(animationObject);
 		}
 		return animationObjects;
 	}
 
-	void updateAnimation(
-		const tinygltf::Model &model, 
-		const tinygltf::Animation &anim, 
-		const AnimationObject &animationObject, 
-		float time,
-		std::vector<glm::mat4> &nodeTransforms) 
+	void Entity::compressAnimations(const AnimationCompression &settings)
+	{
+		size_t bytes = 0, keyframes = 0, compressedKeyframes = 0;
+		for (AnimationObject &animationObject : animationObjects) {
+			bytes += animationBytes(animationObject);
+			for (const SamplerObject &sampler : animationObject.samplers) {
+				keyframes += sampler.input.size();
+			}
+			compressAnimation(animationObject, settings);
+			for (const SamplerObject &sampler : animationObject.samplers) {
+				compressedKeyframes += sampler.input.size();
+			}
+		}
+		size_t compressedBytes = 0;
+		for (const AnimationObject &animationObject : animationObjects) {
+			compressedBytes += animationBytes(animationObject);
+		}
+		if (keyframes > 0) {
+			std::cout << "Animation tracks of " << resource->path << ": " << keyframes << " -> " << compressedKeyframes
+					  << " keyframes, " << bytes / 1024 << " KB -> " << compressedBytes / 1024 << " KB" << std::endl;
+		}
+	}
+
+	static void flattenNode(const tinygltf::Model &model, int nodeIndex, int parent,
+		std::vector<int> &order, std::vector<int> &parents)
+	{
+		parents[nodeIndex] = parent;
+		order.push_back(nodeIndex);
+		for (int childIndex : model.nodes[nodeIndex].children) {
+			flattenNode(model, childIndex, nodeIndex, order, parents);
+		}
+	}
+
+	// Needs animationObjects from prepareAnimation to know what moves
+	NodeHierarchy Entity::prepareHierarchy(const tinygltf::Model &model)
+	{
+		NodeHierarchy hierarchy;
+		hierarchy.parents.assign(model.nodes.size(), -1);
+		hierarchy.localTransforms.assign(model.nodes.size(), glm::mat4(1.0f));
+		hierarchy.globalTransforms.assign(model.nodes.size(), glm::mat4(1.0f));
+		if (model.scenes.empty()) {
+			return hierarchy;
+		}
+
+		// Depth first from the scene roots, so parents come before children
+		std::vector<int> order;
+		const tinygltf::Scene &scene = model.scenes[model.defaultScene];
+		for (size_t i = 0; i < scene.nodes.size(); ++i) {
+			flattenNode(model, scene.nodes[i], -1, order, hierarchy.parents);
+		}
+
+		// Only the animations Entity::update plays, one per skin
+		std::vector<bool> animated(model.nodes.size(), false);
+		for (size_t i = 0; i < model.skins.size() && i < animationObjects.size(); ++i) {
+			for (const ChannelObject &channel : animationObjects[i].channels) {
+				if (!animated[channel.targetNode]) {
+					animated[channel.targetNode] = true;
+					hierarchy.animatedNodes.push_back(channel.targetNode);
+				}
+			}
+		}
+
+		// Everything else keeps the identity global transform it starts with
+		std::vector<bool> dirty(model.nodes.size(), false);
+		for (int nodeIndex : order) {
+			int parent = hierarchy.parents[nodeIndex];
+			dirty[nodeIndex] = animated[nodeIndex] || (parent >= 0 && dirty[parent]);
+			if (dirty[nodeIndex]) {
+				hierarchy.dirtyOrder.push_back(nodeIndex);
+			}
+		}
+		return hierarchy;
+	}
+
+	// Static models are bounded by their vertices. Skinned ones by the
+	// positions their skin 0 joints reach over every clip, sampled at 10 Hz,
+	// grown by the furthest any vertex sits from its heaviest joint in the
+	// rest pose prepareSkinning leaves.
+	void Entity::prepareBounds() {
+		const tinygltf::Model &model = resource->model;
+		std::vector<const unsigned char *> buffers;
+		for (size_t b = 0; b < model.buffers.size(); b++) {
+			buffers.push_back(resource->buffer_bytes(b));
+		}
+		glm::vec3 boxMin(1e30f), boxMax(-1e30f);
+		float margin = 0.0f;
+		bool skinnedAny = false;
+		for (const tinygltf::Mesh &mesh : model.meshes) {
+			for (const tinygltf::Primitive &primitive : mesh.primitives) {
+				std::map<std::string, int>::const_iterator position = primitive.attributes.find("POSITION");
+				if (position == primitive.attributes.end()) {
+					continue;
+				}
+				bool skinned = isSkinning && !skinObjects.empty() && primitive.attributes.count("JOINTS_0")
+					&& primitive.attributes.count("WEIGHTS_0");
+				skinnedAny = skinnedAny || skinned;
+				for (size_t v = 0; v < model.accessors[position->second].count; v++) {
+					float value[4];
+					read_accessor(model, buffers, position->second, v, value);
+					glm::vec3 local(resource->positionOffset[0] + resource->positionScale[0] * value[0],
+									resource->positionOffset[1] + resource->positionScale[1] * value[1],
+									resource->positionOffset[2] + resource->positionScale[2] * value[2]);
+					if (skinned) {
+						float joints[4], weights[4];
+						read_accessor(model, buffers, primitive.attributes.at("JOINTS_0"), v, joints);
+						read_accessor(model, buffers, primitive.attributes.at("WEIGHTS_0"), v, weights);
+						glm::mat4 skinMat(0.0f);
+						int heaviest = 0;
+						for (int i = 0; i < 4; i++) {
+							skinMat += weights[i] * skinObjects[0].jointMatrices[(int)joints[i]];
+							heaviest = weights[i] > weights[heaviest] ? i : heaviest;
+						}
+						local = glm::vec3(skinMat * glm::vec4(local, 1.0f));
+						glm::vec3 joint(skinObjects[0].globalJointTransforms[(int)joints[heaviest]][3]);
+						margin = std::max(margin, glm::length(local - joint));
+					}
+					boxMin = glm::min(boxMin, local);
+					boxMax = glm::max(boxMax, local);
+				}
+			}
+		}
+		if (boxMin.x > boxMax.x) {
+			return;
+		}
+		if (skinnedAny) {
+			const tinygltf::Skin &skin = model.skins[0];
+			boxMin = glm::vec3(1e30f);
+			boxMax = glm::vec3(-1e30f);
+			for (const glm::mat4 &joint : skinObjects[0].globalJointTransforms) {
+				boxMin = glm::min(boxMin, glm::vec3(joint[3]));
+				boxMax = glm::max(boxMax, glm::vec3(joint[3]));
+			}
+			NodeHierarchy hierarchy = nodeHierarchy;
+			for (AnimationObject &animationObject : animationObjects) {
+				float duration = 0.0f;
+				for (const SamplerObject &sampler : animationObject.samplers) {
+					if (!sampler.input.empty()) {
+						duration = std::max(duration, sampler.input.back());
+					}
+				}
+				int samples = std::max(1, (int)std::ceil(duration * 10.0f));
+				for (int f = 0; f <= samples; f++) {
+					for (int nodeIndex : hierarchy.animatedNodes) {
+						hierarchy.localTransforms[nodeIndex] = glm::mat4(1.0f);
+					}
+					updateAnimation(animationObject, f < samples ? duration * f / samples : std::nextafter(duration, 0.0f),
+									hierarchy.localTransforms);
+					updateGlobalTransforms(hierarchy);
+					for (size_t j = 0; j < skin.joints.size(); j++) {
+						glm::vec3 joint(hierarchy.globalTransforms[skin.joints[j]][3]);
+						boxMin = glm::min(boxMin, joint);
+						boxMax = glm::max(boxMax, joint);
+					}
+				}
+			}
+		}
+		boundsCenter = 0.5f * (boxMin + boxMax);
+		boundsRadius = 0.5f * glm::length(boxMax - boxMin) + margin;
+	}
+
+	// Level of the nearest instance in the camera frustum, by its screen
+	// height as a fraction of the viewport: below lodSizes[i] it drops past
+	// level i. Instances only casting shadows get the coarsest level, and -1
+	// means no instance is in either frustum.
+	int Entity::animationLod(const std::vector<glm::mat4> &instances, const glm::mat4 &viewProjection,
+							 const Frustum &cameraFrustum, const Frustum &shadowFrustum, const float *lodSizes) const {
+		float scale = std::max(glm::length(glm::vec3(transform[0])),
+							   std::max(glm::length(glm::vec3(transform[1])), glm::length(glm::vec3(transform[2]))));
+		float radius = boundsRadius * scale;
+		// The clip-space y row is the view's up axis scaled by the focal length
+		float focal = glm::length(glm::vec3(viewProjection[0][1], viewProjection[1][1], viewProjection[2][1]));
+		int level = -1;
+		for (const glm::mat4 &instance : instances) {
+			glm::vec3 center = glm::vec3(instance * transform * glm::vec4(boundsCenter, 1.0f));
+			glm::vec3 extent(radius);
+			bool onCamera = cameraFrustum.isOnFrustum(center - extent, center + extent);
+			if (!onCamera && !shadowFrustum.isOnFrustum(center - extent, center + extent)) {
+				continue;
+			}
+			int instanceLevel = ANIMATION_LOD_LEVELS - 1;
+			if (onCamera) {
+				float w = (viewProjection * glm::vec4(center, 1.0f)).w;
+				float size = w > radius ? radius * focal / w : 1.0f;
+				instanceLevel = 0;
+				while (instanceLevel < ANIMATION_LOD_LEVELS - 1 && size < lodSizes[instanceLevel]) {
+					instanceLevel++;
+				}
+			}
+			if (level < 0 || instanceLevel < level) {
+				level = instanceLevel;
+			}
+			if (level == 0) {
+				break;
+			}
+		}
+		return level;
+	}
+
+	// Runs update() once the level's interval has passed, so far entities
+	// reuse their last pose and a level of -1 keeps it. Palette entities
+	// step their playback time the same way. Returns whether a pose was
+	// computed on the CPU, which palette entities never do.
+	bool Entity::updateLod(float time, int lodLevel) {
+		if (lodLevel < 0) {
+			framesSinceUpdate = ANIMATION_LOD_INTERVALS[ANIMATION_LOD_LEVELS - 1];
+			return false;
+		}
+		if (++framesSinceUpdate < ANIMATION_LOD_INTERVALS[lodLevel]) {
+			return false;
+		}
+		framesSinceUpdate = 0;
+		update(time);
+		return !usePalette;
+	}
+
+	void updateGlobalTransforms(NodeHierarchy &hierarchy)
+	{
+		// One pass in parent-first order over the nodes that can move
+		for (int nodeIndex : hierarchy.dirtyOrder) {
+			int parent = hierarchy.parents[nodeIndex];
+			if (parent >= 0) {
+				hierarchy.globalTransforms[nodeIndex] = hierarchy.globalTransforms[parent] * hierarchy.localTransforms[nodeIndex];
+			} else {
+				hierarchy.globalTransforms[nodeIndex] = hierarchy.localTransforms[nodeIndex];
+			}
+		}
+	}
+
+	// Keyframe of a sampler, unpacked if compressAnimation packed it
+	static glm::vec4 samplerKeyframe(const SamplerObject &sampler, int index)
+	{
+		if (sampler.packed.empty()) {
+			return sampler.output[index];
+		}
+		const uint16_t *words = &sampler.packed[index * 3];
+		if (!sampler.packedRotation) {
+			return glm::vec4(sampler.rangeMin + sampler.rangeStep * glm::vec3(words[0], words[1], words[2]), 0.0f);
+		}
+		// The top bits of the first two words name the dropped component,
+		// the low 15 bits of each word hold one of the others
+		int largest = (words[0] >> 15) | ((words[1] >> 15) << 1);
+		glm::vec4 rotation;
+		float sum = 0.0f;
+		for (int i = 0, word = 0; i < 4; i++) {
+			if (i != largest) {
+				rotation[i] = ((words[word++] & 0x7fff) * (2.0f / 32767.0f) - 1.0f) * 0.70710678f;
+				sum += rotation[i] * rotation[i];
+			}
+		}
+		rotation[largest] = std::sqrt(std::max(0.0f, 1.0f - sum));
+		return rotation;
+	}
+
+	static glm::vec4 interpolateKeyframes(AnimationPath path, const glm::vec4 &previous, const glm::vec4 &next, float t)
+	{
+		if (path == PATH_ROTATION) {
+			// Stored as x, y, z, w like glTF
+			glm::quat previousRotation(previous.w, previous.x, previous.y, previous.z);
+			glm::quat nextRotation(next.w, next.x, next.y, next.z);
+			glm::quat rotation = glm::slerp(previousRotation, nextRotation, t);
+			return glm::vec4(rotation.x, rotation.y, rotation.z, rotation.w);
+		}
+		return glm::mix(previous, next, t);
+	}
+
+	glm::vec4 sampleChannel(const SamplerObject &sampler, AnimationPath path, float time, int &cursor)
+	{
+		const std::vector<float> &times = sampler.input;
+		// A single keyframe holds its value for the whole animation, and
+		// before the first keyframe the first value holds
+		float animationTime = times.size() > 1 ? fmod(time, times.back()) : 0.0f;
+		if (times.size() < 2 || animationTime < times[0]) {
+			return samplerKeyframe(sampler, 0);
+		}
+		int keyframeIndex = findKeyframeIndex(times, animationTime, cursor);
+		float interpolationValue = (animationTime - times[keyframeIndex]) / (times[keyframeIndex + 1] - times[keyframeIndex]);
+		return interpolateKeyframes(path, samplerKeyframe(sampler, keyframeIndex),
+									samplerKeyframe(sampler, keyframeIndex + 1), interpolationValue);
+	}
+
+	void updateAnimation(AnimationObject &animationObject, float time, std::vector<glm::mat4> &nodeTransforms)
 	{
 		// There are many channels so we have to accumulate the transforms 
-		for (const auto &channel : anim.channels) {
-			
-			int targetNodeIndex = channel.target_node;
-			const auto &sampler = anim.samplers[channel.sampler];
-			
-			// Access output (value) data for the channel
-			const tinygltf::Accessor &outputAccessor = model.accessors[sampler.output];
-			const tinygltf::BufferView &outputBufferView = model.bufferViews[outputAccessor.bufferView];
-			const tinygltf::Buffer &outputBuffer = model.buffers[outputBufferView.buffer];
-
-			// Calculate current animation time (wrap if necessary)
-			const std::vector<float> &times = animationObject.samplers[channel.sampler].input;
-			float animationTime = fmod(time, times.back());
-			
-			// Find a keyframe for getting animation data 
-			int keyframeIndex = findKeyframeIndex(times, animationTime);
-
-			const unsigned char *outputPtr = &outputBuffer.data[outputBufferView.byteOffset + outputAccessor.byteOffset];
-			const float *outputBuf = reinterpret_cast<const float*>(outputPtr);
-
-			// Add interpolation for smooth interpolation
-			float previousTime = times[keyframeIndex];
-			float nextTime = times[keyframeIndex + 1];
-			float interpolationValue = (animationTime - previousTime) / (nextTime - previousTime);
-
-			if (channel.target_path == "translation") {
-				glm::vec3 previousTranslation, nextTranslation;
-				memcpy(&previousTranslation, outputPtr + keyframeIndex * 3 * sizeof(float), 3 * sizeof(float));
-				memcpy(&nextTranslation, outputPtr + (keyframeIndex + 1) * 3 * sizeof(float), 3 * sizeof(float));
-
-				glm::vec3 currentTranslation = glm::mix(previousTranslation, nextTranslation, interpolationValue);
-				nodeTransforms[targetNodeIndex] = glm::translate(nodeTransforms[targetNodeIndex], currentTranslation);
-			} else if (channel.target_path == "rotation") {
-				glm::quat previousRotation, nextRotation;
-				memcpy(&previousRotation, outputPtr + keyframeIndex * 4 * sizeof(float), 4 * sizeof(float));
-				memcpy(&nextRotation, outputPtr + (keyframeIndex + 1) * 4 * sizeof(float), 4 * sizeof(float));
-
-				glm::quat currentRotation = glm::slerp(previousRotation, nextRotation, interpolationValue);
-				nodeTransforms[targetNodeIndex] *= glm::mat4_cast(currentRotation);
-			} else if (channel.target_path == "scale") {
-				glm::vec3 previousScale, nextScale;
-				memcpy(&previousScale, outputPtr + keyframeIndex * 3 * sizeof(float), 3 * sizeof(float));
-				memcpy(&nextScale, outputPtr + (keyframeIndex + 1) * 3 * sizeof(float), 3 * sizeof(float));
-				
-				glm::vec3 currentScale =  glm::mix(previousScale, nextScale, interpolationValue);
-				nodeTransforms[targetNodeIndex] = glm::scale(nodeTransforms[targetNodeIndex], currentScale);
+		for (ChannelObject &channel : animationObject.channels) {
+			const SamplerObject &sampler = animationObject.samplers[channel.sampler];
+			if (sampler.input.empty() || channel.path == PATH_WEIGHTS) {
+				continue;
+			}
+			glm::mat4 &nodeTransform = nodeTransforms[channel.targetNode];
+			glm::vec4 value = sampleChannel(sampler, channel.path, time, channel.cursor);
+			if (channel.path == PATH_TRANSLATION) {
+				nodeTransform = glm::translate(nodeTransform, glm::vec3(value));
+			} else if (channel.path == PATH_ROTATION) {
+				nodeTransform *= glm::mat4_cast(glm::quat(value.w, value.x, value.y, value.z));
+			} else if (channel.path == PATH_SCALE) {
+				nodeTransform = glm::scale(nodeTransform, glm::vec3(value));
 			}
 		}
 	}
 
+	static float keyframeError(AnimationPath path, const glm::vec4 &a, const glm::vec4 &b)
+	{
+		if (path == PATH_ROTATION) {
+			// |a - b| is 2 sin(angle / 4), which unlike the dot product keeps
+			// its precision for small angles
+			float distance = glm::dot(a, b) < 0.0f ? glm::length(a + b) : glm::length(a - b);
+			return 4.0f * std::asin(std::min(1.0f, 0.5f * distance));
+		}
+		return glm::length(glm::vec3(a) - glm::vec3(b));
+	}
+
+	static void packRotation(glm::vec4 rotation, uint16_t *words)
+	{
+		rotation = glm::normalize(rotation);
+		int largest = 0;
+		for (int i = 1; i < 4; i++) {
+			if (std::abs(rotation[i]) > std::abs(rotation[largest])) {
+				largest = i;
+			}
+		}
+		// q and -q are the same rotation, so the dropped component can be
+		// made positive and the others are within +-1/sqrt(2)
+		if (rotation[largest] < 0.0f) {
+			rotation = -rotation;
+		}
+		for (int i = 0, word = 0; i < 4; i++) {
+			if (i != largest) {
+				float unit = glm::clamp((rotation[i] * 1.41421356f + 1.0f) * 0.5f, 0.0f, 1.0f);
+				words[word++] = (uint16_t)std::lround(unit * 32767.0f);
+			}
+		}
+		words[0] |= (largest & 1) << 15;
+		words[1] |= (largest >> 1) << 15;
+	}
+
+	float compressionTolerance(const AnimationObject &animationObject, AnimationPath path, const AnimationCompression &settings)
+	{
+		if (path == PATH_ROTATION) {
+			return settings.rotationTolerance;
+		} else if (path == PATH_SCALE) {
+			return settings.scaleTolerance;
+		}
+		float largest = 0.0f;
+		for (const ChannelObject &channel : animationObject.channels) {
+			const SamplerObject &sampler = animationObject.samplers[channel.sampler];
+			for (size_t i = 0; channel.path == PATH_TRANSLATION && i < sampler.input.size(); i++) {
+				largest = std::max(largest, glm::length(glm::vec3(samplerKeyframe(sampler, i))));
+			}
+		}
+		return settings.translationTolerance * std::max(largest, 1e-6f);
+	}
+
+	// Packs every keyframe first, then walks the track keeping a keyframe
+	// only where interpolating the packed ends of a longer span would leave
+	// the exported track, at its keyframes or halfway between them, by more
+	// than tolerance. So the bound covers quantization as well.
+	static void compressSampler(SamplerObject &sampler, AnimationPath path, float tolerance)
+	{
+		const std::vector<float> &times = sampler.input;
+		size_t count = times.size();
+		if (!sampler.packed.empty() || path == PATH_WEIGHTS || count == 0 || sampler.output.size() != count) {
+			return;
+		}
+		sampler.packedRotation = path == PATH_ROTATION;
+		sampler.packed.resize(count * 3);
+		if (sampler.packedRotation) {
+			for (size_t i = 0; i < count; i++) {
+				packRotation(sampler.output[i], &sampler.packed[i * 3]);
+			}
+		} else {
+			glm::vec3 rangeMax(-1e30f);
+			sampler.rangeMin = glm::vec3(1e30f);
+			for (const glm::vec4 &value : sampler.output) {
+				sampler.rangeMin = glm::min(sampler.rangeMin, glm::vec3(value));
+				rangeMax = glm::max(rangeMax, glm::vec3(value));
+			}
+			sampler.rangeStep = (rangeMax - sampler.rangeMin) / 65535.0f;
+			for (size_t i = 0; i < count; i++) {
+				for (int c = 0; c < 3; c++) {
+					float steps = sampler.rangeStep[c] > 0.0f ? (sampler.output[i][c] - sampler.rangeMin[c]) / sampler.rangeStep[c] : 0.0f;
+					sampler.packed[i * 3 + c] = (uint16_t)std::lround(glm::clamp(steps, 0.0f, 65535.0f));
+				}
+			}
+		}
+
+		std::vector<int> kept(1, 0);
+		int anchor = 0;
+		for (int end = 2; end < (int)count; end++) {
+			glm::vec4 first = samplerKeyframe(sampler, anchor);
+			glm::vec4 last = samplerKeyframe(sampler, end);
+			float span = times[end] - times[anchor];
+			bool fits = true;
+			for (int k = anchor; k < end && fits; k++) {
+				float halfway = 0.5f * (times[k] + times[k + 1]);
+				glm::vec4 exported = interpolateKeyframes(path, sampler.output[k], sampler.output[k + 1], 0.5f);
+				fits = keyframeError(path, exported, interpolateKeyframes(path, first, last, (halfway - times[anchor]) / span)) <= tolerance;
+				if (fits && k + 1 < end) {
+					glm::vec4 approximation = interpolateKeyframes(path, first, last, (times[k + 1] - times[anchor]) / span);
+					fits = keyframeError(path, sampler.output[k + 1], approximation) <= tolerance;
+				}
+			}
+			if (!fits) {
+				anchor = end - 1;
+				kept.push_back(anchor);
+			}
+		}
+		if (count > 1) {
+			kept.push_back(count - 1);
+		}
+
+		std::vector<float> input(kept.size());
+		std::vector<uint16_t> packed(kept.size() * 3);
+		for (size_t i = 0; i < kept.size(); i++) {
+			input[i] = times[kept[i]];
+			memcpy(&packed[i * 3], &sampler.packed[kept[i] * 3], 3 * sizeof(uint16_t));
+		}
+		sampler.input.swap(input);
+		sampler.packed.swap(packed);
+		std::vector<glm::vec4>().swap(sampler.output);
+	}
+
+	void compressAnimation(AnimationObject &animationObject, const AnimationCompression &settings)
+	{
+		float tolerances[3];
+		for (int path = PATH_TRANSLATION; path <= PATH_SCALE; path++) {
+			tolerances[path] = compressionTolerance(animationObject, (AnimationPath)path, settings);
+		}
+		for (ChannelObject &channel : animationObject.channels) {
+			if (channel.path != PATH_WEIGHTS) {
+				compressSampler(animationObject.samplers[channel.sampler], channel.path, tolerances[channel.path]);
+			}
+			channel.cursor = 0;
+		}
+	}
+
+	size_t animationBytes(const AnimationObject &animationObject)
+	{
+		size_t bytes = 0;
+		for (const SamplerObject &sampler : animationObject.samplers) {
+			bytes += sampler.input.size() * sizeof(float) + sampler.output.size() * sizeof(glm::vec4)
+				+ sampler.packed.size() * sizeof(uint16_t);
+			if (!sampler.packed.empty() && !sampler.packedRotation) {
+				bytes += 2 * sizeof(glm::vec3);
+			}
+		}
+		return bytes;
+	}
+
 	void updateSkinning(const std::vector<glm::mat4> &nodeTransforms, const tinygltf::Skin &skin, SkinObject &skinObject) {
 		// -------------------------------------------------
 		// TODO: Recompute joint matrices 
@@ -263,83 +679,313 @@ glm::mat4 getNodeTransform(const tinygltf::Node& node) {
 	}
 
 	void Entity::update(float time) {
+		animationTime = time;
+		if (usePalette) {
+			return;
+		}
+		tinygltf::Model &model = resource->model;
 		if (model.animations.size() > 0) {
+			NodeHierarchy &hierarchy = nodeHierarchy;
 			for (size_t i = 0; i < model.skins.size(); i++) {
-				const tinygltf::Animation &animation = model.animations[i];
-				const AnimationObject &animationObject = animationObjects[i];
+				AnimationObject &animationObject = animationObjects[i];
 
 				const tinygltf::Skin &skin = model.skins[i];
-				std::vector<glm::mat4> nodeTransforms(model.nodes.size(), glm::mat4(1.0f));
+				for (int nodeIndex : hierarchy.animatedNodes) {
+					hierarchy.localTransforms[nodeIndex] = glm::mat4(1.0f);
+				}
 
-				updateAnimation(model, animation, animationObject, time, nodeTransforms);
+				updateAnimation(animationObject, time, hierarchy.localTransforms);
 
-				std::vector<glm::mat4> globalNodeTransforms(model.nodes.size(), glm::mat4(1.0f));
-				for (size_t j = 0; j < model.scenes[model.defaultScene].nodes.size(); ++j) {
-					int rootNodeIndex = model.scenes[model.defaultScene].nodes[j];
-					computeGlobalNodeTransform(model, nodeTransforms, rootNodeIndex, glm::mat4(1.0f), globalNodeTransforms);
-				}
-				// glm::mat4 parentTransform(1.0f);
-				// int rootNodeIndex = model.scenes[model.defaultScene].nodes[0];
-				// std::vector<glm::mat4> globalNodeTransforms(skin.joints.size());
-				// computeGlobalNodeTransform(model, nodeTransforms, rootNodeIndex, parentTransform, globalNodeTransforms);
+				updateGlobalTransforms(hierarchy);
 
+				updateSkinning(hierarchy.globalTransforms, skin, skinObjects[i]);
+			}
+			packJointRows();
+			skinnedDirty = true;
+		}
+	}
 
+	// Rows of skin 0's joint matrices, clip after clip, and the clip table the
+	// shaders index. Each clip gets a whole number of frames over its length
+	// plus a closing row just before the loop point, so the last frame blends
+	// into the clip's end pose rather than its start.
+	std::vector<glm::mat4> Entity::bakeAnimationPalette(float sampleRate) {
+		std::vector<glm::mat4> rows;
+		paletteClipStart.clear();
+		paletteClipFrames.clear();
+		paletteClipDuration.clear();
+		tinygltf::Model &model = resource->model;
+		if (model.skins.empty() || skinObjects.empty() || model.scenes.empty()) {
+			return rows;
+		}
+		const tinygltf::Skin &skin = model.skins[0];
+		const SkinObject &skinObject = skinObjects[0];
+		std::vector<glm::mat4> localTransforms(model.nodes.size());
+		std::vector<glm::mat4> globalTransforms(model.nodes.size());
+		size_t clips = std::min(animationObjects.size(), (size_t)MAX_PALETTE_CLIPS);
+		for (size_t c = 0; c < clips; c++) {
+			float duration = 0.0f;
+			for (const SamplerObject &sampler : animationObjects[c].samplers) {
+				if (!sampler.input.empty()) {
+					duration = std::max(duration, sampler.input.back());
+				}
+			}
+			int frames = std::max(1, (int)std::ceil(duration * sampleRate));
+			paletteClipStart.push_back(rows.size() / skin.joints.size());
+			paletteClipFrames.push_back(frames);
+			paletteClipDuration.push_back(duration > 0.0f ? duration : 1.0f);
+
+			for (int f = 0; f <= frames; f++) {
+				float time = f < frames ? duration * f / frames : std::nextafter(duration, 0.0f);
+				std::fill(localTransforms.begin(), localTransforms.end(), glm::mat4(1.0f));
+				std::fill(globalTransforms.begin(), globalTransforms.end(), glm::mat4(1.0f));
+				updateAnimation(animationObjects[c], time, localTransforms);
+				const tinygltf::Scene &scene = model.scenes[model.defaultScene];
+				for (size_t i = 0; i < scene.nodes.size(); ++i) {
+					computeGlobalNodeTransform(model, localTransforms, scene.nodes[i], glm::mat4(1.0f), globalTransforms);
+				}
+				for (size_t j = 0; j < skin.joints.size(); ++j) {
+					rows.push_back(globalTransforms[skin.joints[j]] * skinObject.inverseBindMatrices[j]);
+				}
+			}
+		}
+		return rows;
+	}
 
-				updateSkinning(globalNodeTransforms, skin, skinObjects[i]);
+	void Entity::enableAnimationPalette(float sampleRate) {
+		if (!isSkinning || animationObjects.empty() || skinObjects.empty()) {
+			return;
+		}
+		std::vector<glm::mat4> rows = bakeAnimationPalette(sampleRate);
+		if (rows.empty()) {
+			return;
+		}
+		int joints = skinObjects[0].jointMatrices.size();
+		int frames = rows.size() / joints;
+		GLint maxSize = 0;
+		glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxSize);
+		if (joints * 4 > maxSize || frames > maxSize) {
+			std::cout << "Animation palette of " << frames << " frames does not fit a texture" << std::endl;
+			return;
+		}
+
+		// Four texels per joint hold the matrix columns
+		glGenTextures(1, &paletteTexture);
+		glBindTexture(GL_TEXTURE_2D, paletteTexture);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, joints * 4, frames, 0, GL_RGBA, GL_FLOAT, glm::value_ptr(rows[0]));
+		glBindTexture(GL_TEXTURE_2D, 0);
+
+		// Clip and time offset per instance, next to the instance matrices
+		if (instances != 1) {
+			glGenBuffers(1, &instanceAnimationVBO);
+			glBindBuffer(GL_ARRAY_BUFFER, instanceAnimationVBO);
+			glBufferData(GL_ARRAY_BUFFER, instances * sizeof(glm::vec2), NULL, GL_DYNAMIC_DRAW);
+			for (const PrimitiveObject &primitiveObject : primitiveObjects) {
+				glBindVertexArray(primitiveObject.vao);
+				glEnableVertexAttribArray(9);
+				glVertexAttribPointer(9, 2, GL_FLOAT, GL_FALSE, sizeof(glm::vec2), (void*)0);
+				glVertexAttribDivisor(9, 1);
 			}
+			glBindVertexArray(0);
+			glBindBuffer(GL_ARRAY_BUFFER, 0);
 		}
+		usePalette = true;
+		std::cout << "Animation palette: " << paletteClipFrames.size() << " clips, " << frames << " frames of "
+				  << joints << " joints, " << rows.size() * sizeof(glm::mat4) / 1024 << " KB" << std::endl;
 	}
 
-	bool Entity::loadModel(tinygltf::Model &model, const char *filename) {
-		tinygltf::TinyGLTF loader;
-		std::string err;
-		std::string warn;
+	// Clip and time offset picked from the instance's position, so they stay
+	// with the instance however the visible list is filtered
+	glm::vec2 Entity::instanceAnimation(const glm::mat4 &instanceMatrix) const {
+		uint32_t hash = (uint32_t)(int32_t)std::floor(instanceMatrix[3].x) * 73856093u
+			^ (uint32_t)(int32_t)std::floor(instanceMatrix[3].z) * 19349663u;
+		hash ^= hash >> 13;
+		hash *= 0x5bd1e995u;
+		hash ^= hash >> 15;
+		int clip = hash % paletteClipFrames.size();
+		float phase = (hash >> 16) / 65536.0f;
+		return glm::vec2(clip, phase * paletteClipDuration[clip]);
+	}
 
-		bool res = loader.LoadASCIIFromFile(&model, &err, &warn, filename);
-		if (!warn.empty()) {
-			std::cout << "WARN: " << warn << std::endl;
+	void Entity::uploadInstanceAnimations() {
+		if (instanceAnimationVBO == 0 || instancesInFrustum.empty()) {
+			return;
+		}
+		instanceAnimations.resize(instancesInFrustum.size());
+		for (size_t i = 0; i < instancesInFrustum.size(); i++) {
+			instanceAnimations[i] = instanceAnimation(instancesInFrustum[i]);
 		}
+		glBindBuffer(GL_ARRAY_BUFFER, instanceAnimationVBO);
+		glBufferSubData(GL_ARRAY_BUFFER, 0, instanceAnimations.size() * sizeof(glm::vec2), instanceAnimations.data());
+	}
 
-		if (!err.empty()) {
-			std::cout << "ERR: " << err << std::endl;
+	void Entity::setPaletteUniforms(GLuint programID) {
+		glUniform1i(glGetUniformLocation(programID, "usePalette"), usePalette);
+		if (!usePalette) {
+			return;
 		}
+		glActiveTexture(GL_TEXTURE0 + 3);
+		glBindTexture(GL_TEXTURE_2D, paletteTexture);
+		glUniform1i(glGetUniformLocation(programID, "animationPalette"), 3);
+		glUniform1f(glGetUniformLocation(programID, "animationTime"), animationTime);
+		glUniform1iv(glGetUniformLocation(programID, "paletteClipStart"), paletteClipStart.size(), paletteClipStart.data());
+		glUniform1iv(glGetUniformLocation(programID, "paletteClipFrames"), paletteClipFrames.size(), paletteClipFrames.data());
+		glUniform1fv(glGetUniformLocation(programID, "paletteClipDuration"), paletteClipDuration.size(), paletteClipDuration.data());
+	}
 
-		if (!res)
-			std::cout << "Failed to load glTF: " << filename << std::endl;
-		else
-			std::cout << "Loaded glTF: " << filename << std::endl;
+	void Entity::prepareJointPalette() {
+		if (skinObjects.empty() || skinObjects[0].jointMatrices.empty()) {
+			return;
+		}
+		packJointRows();
+		glGenBuffers(1, &jointBuffer);
+		glBindBuffer(GL_TEXTURE_BUFFER, jointBuffer);
+		glBufferData(GL_TEXTURE_BUFFER, jointRows.size() * sizeof(glm::vec4), jointRows.data(), GL_DYNAMIC_DRAW);
+		glGenTextures(1, &jointTexture);
+		glBindTexture(GL_TEXTURE_BUFFER, jointTexture);
+		glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, jointBuffer);
+		glBindTexture(GL_TEXTURE_BUFFER, 0);
+		glBindBuffer(GL_TEXTURE_BUFFER, 0);
+		jointRowsDirty = false;
+	}
 
-		return res;
+	// The bottom row of a joint matrix is always 0, 0, 0, 1
+	void Entity::packJointRows() {
+		if (skinObjects.empty()) {
+			return;
+		}
+		const std::vector<glm::mat4> &jointMatrices = skinObjects[0].jointMatrices;
+		jointRows.resize(jointMatrices.size() * 3);
+		for (size_t j = 0; j < jointMatrices.size(); j++) {
+			const glm::mat4 &m = jointMatrices[j];
+			for (int row = 0; row < 3; row++) {
+				jointRows[j * 3 + row] = glm::vec4(m[0][row], m[1][row], m[2][row], m[3][row]);
+			}
+		}
+		jointRowsDirty = true;
 	}
 
-	
+	// Uploads the palette if update() changed it since the last pass. The
+	// sampler is set even without skinning so it never shares a unit with a
+	// 2D sampler.
+	void Entity::bindJointPalette(GLuint programID) {
+		glUniform1i(glGetUniformLocation(programID, "jointPalette"), 4);
+		if (!isSkinning || usePalette || jointTexture == 0) {
+			return;
+		}
+		if (jointRowsDirty) {
+			glBindBuffer(GL_TEXTURE_BUFFER, jointBuffer);
+			glBufferSubData(GL_TEXTURE_BUFFER, 0, jointRows.size() * sizeof(glm::vec4), jointRows.data());
+			glBindBuffer(GL_TEXTURE_BUFFER, 0);
+			jointRowsDirty = false;
+		}
+		glActiveTexture(GL_TEXTURE0 + 4);
+		glBindTexture(GL_TEXTURE_BUFFER, jointTexture);
+	}
 
-	void Entity::bindMesh(std::vector<PrimitiveObject> &primitiveObjects,
-				tinygltf::Model &model, tinygltf::Mesh &mesh) {
+	// Instance matrices from the bound array buffer, one mat4 per instance
+	// over attributes 5 to 8
+	static void bindInstanceAttributes() {
+		for (int column = 0; column < 4; column++) {
+			glEnableVertexAttribArray(5 + column);
+			glVertexAttribPointer(5 + column, 4, GL_FLOAT, GL_FALSE, sizeof(glm::mat4), (void*)(column * sizeof(glm::vec4)));
+			glVertexAttribDivisor(5 + column, 1);
+		}
+	}
 
-		std::map<int, GLuint> vbos;
-		for (size_t i = 0; i < model.bufferViews.size(); ++i) {
-			const tinygltf::BufferView &bufferView = model.bufferViews[i];
+	void Entity::enablePreskinning(const char *skinningPath) {
+		if (!isSkinning || usePalette || jointTexture == 0) {
+			return;
+		}
+		std::vector<const char *> varyings;
+		varyings.push_back("skinnedPosition");
+		varyings.push_back("skinnedNormal");
+		skinningProgram = ResourceCache::instance().feedbackProgram(skinningPath, varyings);
+		if (skinningProgram->id == 0) {
+			skinningProgram.reset();
+			return;
+		}
 
-			int target = bufferView.target;
-			
-			if (bufferView.target == 0) { 
-				// The bufferView with target == 0 in our model refers to 
-				// the skinning weights, for 25 joints, each 4x4 matrix (16 floats), totaling to 400 floats or 1600 bytes. 
-				// So it is considered safe to skip the warning.
-				//std::cout << "WARN: bufferView.target is zero" << std::endl;
-				continue;
+		tinygltf::Model &model = resource->model;
+		for (PrimitiveObject &primitiveObject : primitiveObjects) {
+			const tinygltf::Primitive &primitive = model.meshes[primitiveObject.mesh].primitives[primitiveObject.primitive];
+			const tinygltf::Accessor &positionAccessor = model.accessors[primitive.attributes.at("POSITION")];
+			glGenBuffers(1, &primitiveObject.skinnedVBO);
+			glBindBuffer(GL_ARRAY_BUFFER, primitiveObject.skinnedVBO);
+			glBufferData(GL_ARRAY_BUFFER, positionAccessor.count * 2 * sizeof(glm::vec3), NULL, GL_DYNAMIC_COPY);
+
+			glGenVertexArrays(1, &primitiveObject.skinnedVAO);
+			glBindVertexArray(primitiveObject.skinnedVAO);
+			glEnableVertexAttribArray(0);
+			glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 2 * sizeof(glm::vec3), (void*)0);
+			glEnableVertexAttribArray(1);
+			glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 2 * sizeof(glm::vec3), (void*)sizeof(glm::vec3));
+			std::map<std::string, int>::const_iterator texcoord = primitive.attributes.find("TEXCOORD_0");
+			if (texcoord != primitive.attributes.end()) {
+				const tinygltf::Accessor &accessor = model.accessors[texcoord->second];
+				glBindBuffer(GL_ARRAY_BUFFER, primitiveObject.vbos[accessor.bufferView]);
+				glEnableVertexAttribArray(2);
+				glVertexAttribPointer(2, accessor.type, accessor.componentType, accessor.normalized ? GL_TRUE : GL_FALSE,
+									accessor.ByteStride(model.bufferViews[accessor.bufferView]), BUFFER_OFFSET(accessor.byteOffset));
+			}
+			if (primitiveObject.instanceVBO != 0) {
+				glBindBuffer(GL_ARRAY_BUFFER, primitiveObject.instanceVBO);
+				bindInstanceAttributes();
 			}
+			glBindVertexArray(0);
+		}
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		usePreskinning = true;
+		skinnedDirty = true;
+	}
 
-			const tinygltf::Buffer &buffer = model.buffers[bufferView.buffer];
-			GLuint vbo;
-			glGenBuffers(1, &vbo);
-			glBindBuffer(target, vbo);
-			glBufferData(target, bufferView.byteLength,
-						&buffer.data.at(0) + bufferView.byteOffset, GL_STATIC_DRAW);
-			
-			vbos[i] = vbo;
+	// Skins every primitive into its skinnedVBO, once per update()
+	void Entity::preskin() {
+		if (!skinnedDirty) {
+			return;
+		}
+		glUseProgram(skinningProgram->id);
+		glUniform3fv(glGetUniformLocation(skinningProgram->id, "positionScale"), 1, resource->positionScale);
+		glUniform3fv(glGetUniformLocation(skinningProgram->id, "positionOffset"), 1, resource->positionOffset);
+		bindJointPalette(skinningProgram->id);
+		glEnable(GL_RASTERIZER_DISCARD);
+		tinygltf::Model &model = resource->model;
+		for (const PrimitiveObject &primitiveObject : primitiveObjects) {
+			const tinygltf::Primitive &primitive = model.meshes[primitiveObject.mesh].primitives[primitiveObject.primitive];
+			const tinygltf::Accessor &positionAccessor = model.accessors[primitive.attributes.at("POSITION")];
+			glBindVertexArray(primitiveObject.vao);
+			glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, primitiveObject.skinnedVBO);
+			glBeginTransformFeedback(GL_POINTS);
+			glDrawArrays(GL_POINTS, 0, positionAccessor.count);
+			glEndTransformFeedback();
 		}
+		glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, 0);
+		glBindVertexArray(0);
+		glDisable(GL_RASTERIZER_DISCARD);
+		skinnedDirty = false;
+	}
+
+	// Pre-skinned vertices are decoded floats already
+	const float *Entity::decodeScale() const {
+		static const float unitScale[3] = { 1, 1, 1 };
+		return usePreskinning ? unitScale : resource->positionScale;
+	}
+
+	const float *Entity::decodeOffset() const {
+		static const float zeroOffset[3] = { 0, 0, 0 };
+		return usePreskinning ? zeroOffset : resource->positionOffset;
+	}
+
+	void Entity::bindMesh(std::vector<PrimitiveObject> &primitiveObjects,
+				tinygltf::Model &model, tinygltf::Mesh &mesh) {
+
+		// Vertex and index buffers belong to the shared model resource, only
+		// the VAOs and the instance buffer are this entity's own
+		std::map<int, GLuint> vbos = resource->bufferObjects;
 
 		// Each mesh can contain several primitives (or parts), each we need to 
 		// bind to an OpenGL vertex array object
@@ -391,70 +1037,14 @@ glm::mat4 getNodeTransform(const tinygltf::Node& node) {
 					int texidx = material.pbrMetallicRoughness.baseColorTexture.index;
 					const tinygltf::Texture& tex = model.textures[texidx];
 						if (tex.source > -1) {
-							GLuint texid;
-							glGenTextures(1, &texid);
-
-							const tinygltf::Image& image = model.images[tex.source];
-
-							glBindTexture(GL_TEXTURE_2D, texid);
-							glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-							glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-							glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-							glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-							glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-
-							GLenum format = GL_RGBA;
-							if (image.component == 1) {
-								format = GL_RED;
-							} else if (image.component == 2) {
-								format = GL_RG;
-							} else if (image.component == 3) {
-								format = GL_RGB;
-							}
-
-							GLenum type = GL_UNSIGNED_BYTE;
-							if (image.bits == 16) {
-								type = GL_UNSIGNED_SHORT;
-							}
-
-							glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, image.width, image.height, 0,
-										format, type, &image.image.at(0));
-							textures.push_back(texid);
+							textures.push_back(resource->images[tex.source]->id);
 					}
 				}
 					if(material.normalTexture.index > -1) {
 					int texidx = material.normalTexture.index;
 					const tinygltf::Texture& tex = model.textures[texidx];
 						if (tex.source > -1) {
-							GLuint texid;
-							glGenTextures(1, &texid);
-
-							const tinygltf::Image& image = model.images[tex.source];
-
-							glBindTexture(GL_TEXTURE_2D, texid);
-							glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-							glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-							glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-							glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-							glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-
-							GLenum format = GL_RGBA;
-							if (image.component == 1) {
-								format = GL_RED;
-							} else if (image.component == 2) {
-								format = GL_RG;
-							} else if (image.component == 3) {
-								format = GL_RGB;
-							}
-
-							GLenum type = GL_UNSIGNED_BYTE;
-							if (image.bits == 16) {
-								type = GL_UNSIGNED_SHORT;
-							}
-
-							glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, image.width, image.height, 0,
-										format, type, &image.image.at(0));
-							textures.push_back(texid);
+							textures.push_back(resource->images[tex.source]->id);
 							std::cout << "normal texure" << std::endl;
 					}
 				}
@@ -470,7 +1060,7 @@ glm::mat4 getNodeTransform(const tinygltf::Node& node) {
 				baseColorFactors.push_back(baseColorFactor);
 				
 			}
-			GLuint instanceMatricesID;
+			GLuint instanceMatricesID = 0;
 			if(instances != 1) {
 				std::cout << "instances: " << instances << std::endl;
 				std::cout << "matrix size: " << instanceMatrices.size() << std::endl;
@@ -479,21 +1069,7 @@ glm::mat4 getNodeTransform(const tinygltf::Node& node) {
 				glGenBuffers(1, &instanceMatricesID);
 				glBindBuffer(GL_ARRAY_BUFFER, instanceMatricesID);
 				glBufferData(GL_ARRAY_BUFFER, instances * sizeof(glm::mat4), glm::value_ptr(instanceMatrices[0]), GL_STATIC_DRAW);
-			
-				glEnableVertexAttribArray(5);
-				glVertexAttribPointer(5, 4, GL_FLOAT, GL_FALSE, sizeof(glm::mat4), (void*)0);
-				glEnableVertexAttribArray(6);
-				glVertexAttribPointer(6, 4, GL_FLOAT, GL_FALSE, sizeof(glm::mat4), (void*)(sizeof(glm::vec4)));
-				glEnableVertexAttribArray(7);
-				glVertexAttribPointer(7, 4, GL_FLOAT, GL_FALSE, sizeof(glm::mat4), (void*)(2 * sizeof(glm::vec4)));
-				glEnableVertexAttribArray(8);
-				glVertexAttribPointer(8, 4, GL_FLOAT, GL_FALSE, sizeof(glm::mat4), (void*)(3 * sizeof(glm::vec4)));
-				
-				glVertexAttribDivisor(5, 1);
-				glVertexAttribDivisor(6, 1);
-				glVertexAttribDivisor(7, 1);
-				glVertexAttribDivisor(8, 1);
-				
+				bindInstanceAttributes();
 			}
 			glBindVertexArray(0);
 			// Record VAO for later use
@@ -501,6 +1077,8 @@ glm::mat4 getNodeTransform(const tinygltf::Node& node) {
 			primitiveObject.vao = vao;
             primitiveObject.vbos = vbos;
 			primitiveObject.instanceVBO = instanceMatricesID;
+			primitiveObject.mesh = &mesh - &model.meshes[0];
+			primitiveObject.primitive = i;
 			primitiveObjects.push_back(primitiveObject);
 		}
 		
@@ -532,18 +1110,6 @@ glm::mat4 getNodeTransform(const tinygltf::Node& node) {
 			assert((scene.nodes[i] >= 0) && (scene.nodes[i] < model.nodes.size()));
 			bindModelNodes(primitiveObjects, model, model.nodes[scene.nodes[i]]);
 		}
-		for(auto pr : primitiveObjects) {
-			for (auto it = pr.vbos.cbegin(); it != pr.vbos.cend();) {
-				tinygltf::BufferView bufferView = model.bufferViews[it->first];
-				if (bufferView.target != GL_ELEMENT_ARRAY_BUFFER) {
-				glDeleteBuffers(1, &pr.vbos[it->first]);
-				pr.vbos.erase(it++);
-				}
-				else {
-				++it;
-				}
-			}
-		}
 
 		return primitiveObjects;
 	}
@@ -552,11 +1118,22 @@ glm::mat4 getNodeTransform(const tinygltf::Node& node) {
 	void Entity::drawMesh(const std::vector<PrimitiveObject> &primitiveObjects,
 				tinygltf::Model &model, tinygltf::Mesh &mesh, int &j) {
 		
-		
+		// Material uniforms of the bound pass program, which is not always
+		// this entity's own
+		GLint baseColorFactorLocation = baseColorFactorID;
+		GLint diffuseTextureLocation = diffuseTextureSamplerID;
+		GLint normalTextureLocation = normalTextureSamplerID;
+		GLint isTextureLocation = isTextureID;
+		if (passProgramID != programID) {
+			baseColorFactorLocation = glGetUniformLocation(passProgramID, "baseColorFactor");
+			diffuseTextureLocation = glGetUniformLocation(passProgramID, "diffuseTexture");
+			normalTextureLocation = glGetUniformLocation(passProgramID, "normalMapTexture");
+			isTextureLocation = glGetUniformLocation(passProgramID, "isTexture");
+		}
 		for (size_t i = 0; i < mesh.primitives.size(); ++i) 
 		{
 			//std::cout << mesh.name << " " << " primitive " << i << " j " << j << std::endl; 
-			GLuint vao = primitiveObjects[j+i].vao;
+			GLuint vao = usePreskinning ? primitiveObjects[j+i].skinnedVAO : primitiveObjects[j+i].vao;
 			std::map<int, GLuint> vbos = primitiveObjects[j+i].vbos;
 
 			glBindVertexArray(vao);
@@ -565,7 +1142,7 @@ glm::mat4 getNodeTransform(const tinygltf::Node& node) {
 			tinygltf::Accessor indexAccessor = model.accessors[primitive.indices];
 
 			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, vbos.at(indexAccessor.bufferView));
-			glUniform4fv(baseColorFactorID, 1, glm::value_ptr(baseColorFactors[j+i]));
+			glUniform4fv(baseColorFactorLocation, 1, glm::value_ptr(baseColorFactors[j+i]));
 			int matID = mesh.primitives[i].material;
             if (matID >= 0) {
 				auto&& material = model.materials[matID];
@@ -573,15 +1150,15 @@ glm::mat4 getNodeTransform(const tinygltf::Node& node) {
                 if (texID >= 0) {
 					glActiveTexture(GL_TEXTURE0);
 					glBindTexture(GL_TEXTURE_2D,textures[j+i]);
-					glUniform1i(diffuseTextureSamplerID,0);
-					glUniform1i(isTextureID, true);
+					glUniform1i(diffuseTextureLocation,0);
+					glUniform1i(isTextureLocation, true);
 				}
 				texID = material.normalTexture.index;
                 if (texID >= 0) {
 					glActiveTexture(GL_TEXTURE0+1);
 					glBindTexture(GL_TEXTURE_2D,textures[j+i+1]);
-					glUniform1i(normalTextureSamplerID,1);
-					glUniform1i(isTextureID, true);
+					glUniform1i(normalTextureLocation,1);
+					glUniform1i(isTextureLocation, true);
 				}
 			}
             if(instances != 1) {
@@ -631,19 +1208,24 @@ glm::mat4 getNodeTransform(const tinygltf::Node& node) {
 		
 		
 		// Set camera
+		if (usePreskinning) {
+			preskin();
+		}
 		glUseProgram(programID);
+		passProgramID = programID;
 		glm::mat4 mvp = cameraMatrix;
 		glUniformMatrix4fv(mvpMatrixID, 1, GL_FALSE, &mvp[0][0]);
 		glUniformMatrix4fv(modelID, 1, GL_FALSE, &transform[0][0]);
+		glUniform3fv(positionScaleID, 1, decodeScale());
+		glUniform3fv(positionOffsetID, 1, decodeOffset());
 
 		// -----------------------------------------------------------------
 		// Set animation data for linear blend skinning in shader
 		// -----------------------------------------------------------------
 		
-		if(isSkinning) {
-			glUniformMatrix4fv(jointMatricesID, skinObjects[0].jointMatrices.size(), GL_FALSE, glm::value_ptr(skinObjects[0].jointMatrices[0]));
-		}
-		glUniform1i(isSkinningID, isSkinning);
+		glUniform1i(isSkinningID, isSkinning && !usePreskinning);
+		bindJointPalette(programID);
+		setPaletteUniforms(programID);
 		
 		// -----------------------------------------------------------------
 
@@ -659,21 +1241,26 @@ glm::mat4 getNodeTransform(const tinygltf::Node& node) {
 		glUniform1i(depthSamplerID,2);
 		glUniformMatrix4fv(lightSpaceMatrixID, 1, GL_FALSE, &shadow.lightSpaceView[0][0]);
 		// Draw the GLTF model
-		drawModel(primitiveObjects, model);
+		drawModel(primitiveObjects, resource->model);
 	}
 
 	void Entity::render(GLuint depthID, glm::mat4 vp) {
 		
+		if (usePreskinning) {
+			preskin();
+		}
 		glUseProgram(depthID);
+		passProgramID = depthID;
 		glUniformMatrix4fv(glGetUniformLocation(depthID, "lightSpaceMatrix"), 1, GL_FALSE, glm::value_ptr(vp));
 
 		glUniformMatrix4fv(glGetUniformLocation(depthID, "u_model"), 1, GL_FALSE, &transform[0][0]);
+		glUniform3fv(glGetUniformLocation(depthID, "positionScale"), 1, decodeScale());
+		glUniform3fv(glGetUniformLocation(depthID, "positionOffset"), 1, decodeOffset());
 
-		if(isSkinning) {
-			glUniformMatrix4fv(glGetUniformLocation(depthID, "jointMat"), skinObjects[0].jointMatrices.size(), GL_FALSE, glm::value_ptr(skinObjects[0].jointMatrices[0]));
-		}
-		glUniform1i(glGetUniformLocation(depthID, "isSkinning"), isSkinning);
-		drawModel(primitiveObjects, model);
+		glUniform1i(glGetUniformLocation(depthID, "isSkinning"), isSkinning && !usePreskinning);
+		bindJointPalette(depthID);
+		setPaletteUniforms(depthID);
+		drawModel(primitiveObjects, resource->model);
 	}
 
 
@@ -681,40 +1268,53 @@ glm::mat4 getNodeTransform(const tinygltf::Node& node) {
 		
 		
 		// Set camera
+		if (usePreskinning) {
+			preskin();
+		}
 		glUseProgram(deferredPrepass);
+		passProgramID = deferredPrepass;
 		glUniformMatrix4fv(glGetUniformLocation(deferredPrepass, "lightSpaceMatrix"), 1, GL_FALSE, glm::value_ptr(lightMat));
 
 		glUniformMatrix4fv(glGetUniformLocation(deferredPrepass, "u_model"), 1, GL_FALSE, &transform[0][0]);
+		glUniform3fv(glGetUniformLocation(deferredPrepass, "positionScale"), 1, decodeScale());
+		glUniform3fv(glGetUniformLocation(deferredPrepass, "positionOffset"), 1, decodeOffset());
 
 		glUniformMatrix4fv(glGetUniformLocation(deferredPrepass, "view"), 1, GL_FALSE, glm::value_ptr(view));
 
 		glUniformMatrix4fv(glGetUniformLocation(deferredPrepass, "projection"), 1, GL_FALSE, &projection[0][0]);
 
-		if(isSkinning) {
-			glUniformMatrix4fv(glGetUniformLocation(deferredPrepass, "jointMat"), skinObjects[0].jointMatrices.size(), GL_FALSE, glm::value_ptr(skinObjects[0].jointMatrices[0]));
-		}
-		glUniform1i(glGetUniformLocation(deferredPrepass, "isSkinning"), isSkinning);
-		drawModel(primitiveObjects, model);
+		glUniform1i(glGetUniformLocation(deferredPrepass, "isSkinning"), isSkinning && !usePreskinning);
+		bindJointPalette(deferredPrepass);
+		setPaletteUniforms(deferredPrepass);
+		drawModel(primitiveObjects, resource->model);
 	}
 
 
 	void Entity::render(glm::mat4 cameraMatrix, glm::vec3 cameraPosition, Shadow shadow, Light light, std::vector<glm::mat4> instancesInFrust) {
 		
 		instancesInFrustum = instancesInFrust;
+		if (usePalette) {
+			uploadInstanceAnimations();
+		}
 		// Set camera
+		if (usePreskinning) {
+			preskin();
+		}
 		glUseProgram(programID);
+		passProgramID = programID;
 		glm::mat4 mvp = cameraMatrix;
 		glUniformMatrix4fv(mvpMatrixID, 1, GL_FALSE, &mvp[0][0]);
 		glUniformMatrix4fv(modelID, 1, GL_FALSE, &transform[0][0]);
+		glUniform3fv(positionScaleID, 1, decodeScale());
+		glUniform3fv(positionOffsetID, 1, decodeOffset());
 
 		// -----------------------------------------------------------------
 		// Set animation data for linear blend skinning in shader
 		// -----------------------------------------------------------------
 		
-		if(isSkinning) {
-			glUniformMatrix4fv(jointMatricesID, skinObjects[0].jointMatrices.size(), GL_FALSE, glm::value_ptr(skinObjects[0].jointMatrices[0]));
-		}
-		glUniform1i(isSkinningID, isSkinning);
+		glUniform1i(isSkinningID, isSkinning && !usePreskinning);
+		bindJointPalette(programID);
+		setPaletteUniforms(programID);
 		
 		// -----------------------------------------------------------------
 
@@ -730,25 +1330,36 @@ glm::mat4 getNodeTransform(const tinygltf::Node& node) {
 		glUniform1i(depthSamplerID,2);
 		glUniformMatrix4fv(lightSpaceMatrixID, 1, GL_FALSE, &shadow.lightSpaceView[0][0]);
 		// Draw the GLTF model
-		drawModel(primitiveObjects, model);
+		drawModel(primitiveObjects, resource->model);
 	}
 	void Entity::render(GLuint depthID, glm::mat4 vp, std::vector<glm::mat4> instancesInFrust) {
 		
 		instancesInFrustum = instancesInFrust;
+		if (usePalette) {
+			uploadInstanceAnimations();
+		}
+		if (usePreskinning) {
+			preskin();
+		}
 		glUseProgram(depthID);
+		passProgramID = depthID;
 		glUniformMatrix4fv(glGetUniformLocation(depthID, "lightSpaceMatrix"), 1, GL_FALSE, glm::value_ptr(vp));
 
 		glUniformMatrix4fv(glGetUniformLocation(depthID, "u_model"), 1, GL_FALSE, &transform[0][0]);
+		glUniform3fv(glGetUniformLocation(depthID, "positionScale"), 1, decodeScale());
+		glUniform3fv(glGetUniformLocation(depthID, "positionOffset"), 1, decodeOffset());
 
-		if(isSkinning) {
-			glUniformMatrix4fv(glGetUniformLocation(depthID, "jointMat"), skinObjects[0].jointMatrices.size(), GL_FALSE, glm::value_ptr(skinObjects[0].jointMatrices[0]));
-		}
-		glUniform1i(glGetUniformLocation(depthID, "isSkinning"), isSkinning);
-		drawModel(primitiveObjects, model);
+		glUniform1i(glGetUniformLocation(depthID, "isSkinning"), isSkinning && !usePreskinning);
+		bindJointPalette(depthID);
+		setPaletteUniforms(depthID);
+		drawModel(primitiveObjects, resource->model);
 	}
 
 	void Entity::render() {
-		drawModel(primitiveObjects,model);
+		GLint currentProgram = 0;
+		glGetIntegerv(GL_CURRENT_PROGRAM, &currentProgram);
+		passProgramID = currentProgram;
+		drawModel(primitiveObjects, resource->model);
 	}
 
 	void Entity::setTransform(float time, float chunks, float chunkWidth, float origin, int xyz) {
@@ -770,5 +1381,25 @@ glm::mat4 getNodeTransform(const tinygltf::Node& node) {
 
 
 	void Entity::cleanup() {
-		glDeleteProgram(programID);
+		for (const PrimitiveObject &primitiveObject : primitiveObjects) {
+			glDeleteVertexArrays(1, &primitiveObject.vao);
+			glDeleteBuffers(1, &primitiveObject.instanceVBO);
+			glDeleteVertexArrays(1, &primitiveObject.skinnedVAO);
+			glDeleteBuffers(1, &primitiveObject.skinnedVBO);
+		}
+		primitiveObjects.clear();
+		glDeleteTextures(1, &paletteTexture);
+		glDeleteBuffers(1, &instanceAnimationVBO);
+		glDeleteTextures(1, &jointTexture);
+		glDeleteBuffers(1, &jointBuffer);
+		paletteTexture = 0;
+		instanceAnimationVBO = 0;
+		jointTexture = 0;
+		jointBuffer = 0;
+		usePalette = false;
+		usePreskinning = false;
+		skinningProgram.reset();
+		// Shared buffers, textures and the program go with their last user
+		program.reset();
+		resource.reset();
 	}
\ No newline at end of file
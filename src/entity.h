@@ -13,10 +13,24 @@
 #include <glm/gtc/type_ptr.hpp>
 #include <render/shader.h>
 #include "constants.h"
+#include "resource_cache.h"
+#include <memory>
+#include <cstdint>
 
 
 #define BUFFER_OFFSET(i) ((char *)NULL + (i))
 
+// Clips an animation palette holds, the size of the palette uniform arrays in
+// bot.vert, depthBot.vert and geometry-bot.vert
+const int MAX_PALETTE_CLIPS = 8;
+
+// Animation LOD: frames between pose updates at each level. The level of an
+// animated entity comes from the screen height of its nearest visible
+// instance, and entities with no instance in the camera or shadow frustum
+// keep their last pose.
+const int ANIMATION_LOD_LEVELS = 4;
+const int ANIMATION_LOD_INTERVALS[ANIMATION_LOD_LEVELS] = { 1, 2, 4, 8 };
+
 struct SkinObject {
 		// Transforms the geometry into the space of the respective joint
 		std::vector<glm::mat4> inverseBindMatrices;  
@@ -32,24 +46,85 @@ struct PrimitiveObject {
     GLuint vao;
     std::map<int, GLuint> vbos;
 	GLuint instanceVBO;
+	int mesh = -1;
+	int primitive = -1;
+	// Pre-skinned positions and normals, interleaved, and the VAO drawing
+	// them with the primitive's UVs and instance matrices
+	GLuint skinnedVBO = 0;
+	GLuint skinnedVAO = 0;
 };
 
 
+enum AnimationPath {
+    PATH_TRANSLATION,
+    PATH_ROTATION,
+    PATH_SCALE,
+    PATH_WEIGHTS
+};
+
+// Keyframe times and values as contiguous arrays, read from the buffers once.
+// compressAnimation() replaces output with packed: three 16-bit words per
+// keyframe, a smallest-three quaternion for rotations and a step count from
+// rangeMin for translations and scales.
 struct SamplerObject {
     std::vector<float> input;
     std::vector<glm::vec4> output;
     int interpolation;
+    std::vector<uint16_t> packed;
+    bool packedRotation = false;
+    glm::vec3 rangeMin = glm::vec3(0.0f);
+    glm::vec3 rangeStep = glm::vec3(0.0f);
 };
 
 struct ChannelObject {
     int sampler;
-    std::string targetPath;
+    AnimationPath path;
     int targetNode;
+    // Keyframe the last update landed on; playing forward only steps from
+    // here, seeks and loops fall back to a binary search
+    int cursor;
 }; 
 struct AnimationObject {
     std::vector<SamplerObject> samplers;	// Animation data
+    std::vector<ChannelObject> channels;
 };
 
+// How far compressAnimation() may move a track from the exported one, at
+// its keyframes and halfway between them. Translations are relative to the
+// clip's largest one, so models in any unit compress alike.
+struct AnimationCompression {
+    float rotationTolerance = 0.001f;      // Radians
+    float translationTolerance = 0.0005f;
+    float scaleTolerance = 0.0005f;
+};
+
+// The node tree flattened at load so global transforms are one linear pass
+// over storage that lives as long as the entity. Like before, a node's local
+// transform is whatever its animation channels build on the identity.
+struct NodeHierarchy {
+    std::vector<int> parents;           // -1 for scene roots
+    std::vector<int> animatedNodes;     // Targets of a channel
+    std::vector<int> dirtyOrder;        // Animated nodes and their descendants, parents first
+    std::vector<glm::mat4> localTransforms;
+    std::vector<glm::mat4> globalTransforms;
+};
+
+// Global transforms of every node under an animated one, from the local ones
+void updateGlobalTransforms(NodeHierarchy &hierarchy);
+
+// Value of a channel at time, wrapped to its sampler's last keyframe, as
+// x, y, z(, w) like glTF
+glm::vec4 sampleChannel(const SamplerObject &sampler, AnimationPath path, float time, int &cursor);
+
+// Samples every channel at time and applies it to the target node's transform
+void updateAnimation(AnimationObject &animationObject, float time, std::vector<glm::mat4> &nodeTransforms);
+
+// Drops the keyframes interpolation recovers and packs the rest, see
+// AnimationCompression. Morph weights and cubic spline tracks stay as they are.
+void compressAnimation(AnimationObject &animationObject, const AnimationCompression &settings);
+float compressionTolerance(const AnimationObject &animationObject, AnimationPath path, const AnimationCompression &settings);
+size_t animationBytes(const AnimationObject &animationObject);
+
 
 
 
@@ -58,13 +133,14 @@ class Entity
 public:
     //Shader variable IDs
 	GLuint mvpMatrixID;
-	GLuint jointMatricesID;
 	GLuint ambientID;
     GLuint diffuseID;
     GLuint specularID;
     GLuint directionID;
     GLuint viewPosID;
 	GLuint programID;
+	// Program of the pass being drawn, for the material uniforms
+	GLuint passProgramID = 0;
 	GLuint isSkinningID;
     //GLuint instanceMatricesID;
     GLuint modelID;
@@ -75,8 +151,13 @@ public:
 	GLuint normalTextureSamplerID;
 	GLuint depthSamplerID;
     GLuint lightSpaceMatrixID;
+    GLuint positionScaleID;
+    GLuint positionOffsetID;
 
-	tinygltf::Model model;
+	// Parsed model with its GPU buffers and textures, and the program; both
+	// shared with every other entity using the same files
+	std::shared_ptr<ModelResource> resource;
+	std::shared_ptr<GLProgram> program;
 
 	glm::mat4 transform;
 	glm::mat4 originPosition;
@@ -100,6 +181,43 @@ public:
 	// Animation 
 
 	std::vector<AnimationObject> animationObjects;
+	NodeHierarchy nodeHierarchy;
+
+	// Animation palette: the joint matrices of every clip sampled at a fixed
+	// rate into a float texture, one row per frame. The vertex shaders fetch
+	// and blend them by clip and frame, each instance with its own clip and
+	// time offset, so update() has nothing to compute.
+	bool usePalette = false;
+	GLuint paletteTexture = 0;
+	GLuint instanceAnimationVBO = 0;
+	float animationTime = 0.0f;
+	std::vector<int> paletteClipStart;
+	std::vector<int> paletteClipFrames;
+	std::vector<float> paletteClipDuration;
+	std::vector<glm::vec2> instanceAnimations;
+
+	// Joint palette: skin 0's joint matrices as the rows of their 3x4 affine
+	// part, three texels per joint in a texture buffer. update() packs them
+	// and the first pass of the frame uploads them, then every pass and
+	// skinned shader reads that one copy.
+	GLuint jointBuffer = 0;
+	GLuint jointTexture = 0;
+	std::vector<glm::vec4> jointRows;
+	bool jointRowsDirty = false;
+
+	// Pre-skinning: with usePreskinning, the first pass after update() skins
+	// every vertex once through transform feedback, and all passes draw the
+	// result as a static mesh. An entity with an animation palette skips it,
+	// as its instances each have their own pose.
+	bool usePreskinning = false;
+	bool skinnedDirty = false;
+	std::shared_ptr<GLProgram> skinningProgram;
+
+	// Bounding sphere in model space over every clip's poses, and the
+	// frames since the pose was last computed, for the animation LOD
+	glm::vec3 boundsCenter = glm::vec3(0.0f);
+	float boundsRadius = 0.0f;
+	int framesSinceUpdate = ANIMATION_LOD_INTERVALS[ANIMATION_LOD_LEVELS - 1];
 
     Entity(){}
 
@@ -107,21 +225,28 @@ public:
         bool isSkinning = false, int instances = 1, std::vector<glm::mat4> instanceMatrices = {}) 
         : transform(transform), isSkinning(isSkinning), instances(instances), instanceMatrices(instanceMatrices) {
 		// Modify your path if needed
-		if (!loadModel(model, modelPath)) {
+		resource = ResourceCache::instance().model(modelPath);
+		if (!resource) {
 			return;
 		}
 		originPosition = transform;
 
-		primitiveObjects = bindModel(model);
+		primitiveObjects = bindModel(resource->model);
 
 		// Prepare joint matrices
-		skinObjects = prepareSkinning(model);
+		skinObjects = prepareSkinning(resource->model);
 
 		// Prepare animation data 
-		animationObjects = prepareAnimation(model);
+		animationObjects = prepareAnimation(resource->model);
+		nodeHierarchy = prepareHierarchy(resource->model);
+		prepareBounds();
+		if (isSkinning) {
+			prepareJointPalette();
+		}
 
-		// Create and compile our GLSL program from the shaders
-		programID = LoadShadersFromFile(vertPath, fragPath);
+		// Create and compile our GLSL program from the shaders, or reuse it
+		program = ResourceCache::instance().program(vertPath, fragPath);
+		programID = program->id;
 		if (programID == 0)
 		{
 			std::cerr << "Failed to load shaders." << std::endl;
@@ -137,13 +262,13 @@ public:
         isTextureID = glGetUniformLocation(programID, "isTexture");
         baseColorFactorID = glGetUniformLocation(programID, "baseColorFactor");
 
-		// Get a handle for joint matrices
-		jointMatricesID = glGetUniformLocation(programID, "jointMat");
 		isSkinningID = glGetUniformLocation(programID, "isSkinning");
         depthSamplerID = glGetUniformLocation(programID, "shadowMap");
 		diffuseTextureSamplerID = glGetUniformLocation(programID, "diffuseTexture");
 		normalTextureSamplerID = glGetUniformLocation(programID, "normalMapTexture");
 		lightSpaceMatrixID = glGetUniformLocation(programID, "lightSpaceMatrix");
+		positionScaleID = glGetUniformLocation(programID, "positionScale");
+		positionOffsetID = glGetUniformLocation(programID, "positionOffset");
 	}
     void update(float time);
 	void setTransform(float time, float chunks, float chunkWidth, float origin, int xyz);
@@ -156,7 +281,24 @@ public:
     void cleanup();
 	std::vector<SkinObject> prepareSkinning(const tinygltf::Model &model);
 	std::vector<AnimationObject> prepareAnimation(const tinygltf::Model &model);
-	bool loadModel(tinygltf::Model &model, const char *filename);
+	void compressAnimations(const AnimationCompression &settings);
+	NodeHierarchy prepareHierarchy(const tinygltf::Model &model);
+	void prepareBounds();
+	int animationLod(const std::vector<glm::mat4> &instances, const glm::mat4 &viewProjection,
+					 const Frustum &cameraFrustum, const Frustum &shadowFrustum, const float *lodSizes) const;
+	bool updateLod(float time, int lodLevel);
+	std::vector<glm::mat4> bakeAnimationPalette(float sampleRate);
+	void enableAnimationPalette(float sampleRate);
+	glm::vec2 instanceAnimation(const glm::mat4 &instanceMatrix) const;
+	void uploadInstanceAnimations();
+	void setPaletteUniforms(GLuint programID);
+	void prepareJointPalette();
+	void packJointRows();
+	void bindJointPalette(GLuint programID);
+	void enablePreskinning(const char *skinningPath);
+	void preskin();
+	const float *decodeScale() const;
+	const float *decodeOffset() const;
 	std::vector<PrimitiveObject> bindModel(tinygltf::Model &model);
     void bindMesh(std::vector<PrimitiveObject> &primitiveObjects,
 				tinygltf::Model &model, tinygltf::Mesh &mesh);
@@ -0,0 +1,113 @@
+#include "gpu_heightfield.h"
+#include <render/shader.h>
+
+#include <iostream>
+#include <vector>
+
+GpuHeightfield::GpuHeightfield(int width, int height, int layers, const PerlinNoise &noise)
+: width(width), height(height), layers(layers) {
+    programID = LoadShadersFromFile("../src/shader/heightfield.vert", "../src/shader/heightfield.frag");
+    originID = glGetUniformLocation(programID, "origin");
+
+    // Only the first 256 entries: the shader wraps every index
+    std::vector<GLubyte> table(256);
+    for (int i = 0; i < 256; i++) {
+        table[i] = noise.permutation_table()[i];
+    }
+    glGenTextures(1, &permutationTexture);
+    glBindTexture(GL_TEXTURE_2D, permutationTexture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_R8UI, 256, 1, 0, GL_RED_INTEGER, GL_UNSIGNED_BYTE, &table[0]);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_R32F, width, height, layers, 0, GL_RED, GL_FLOAT, NULL);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+    glGenFramebuffers(1, &fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, texture, 0, 0);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        std::cout << "Heightfield framebuffer not complete!" << std::endl;
+        glDeleteFramebuffers(1, &fbo);
+        fbo = 0;
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    // Core profile needs a VAO bound even without attributes
+    glGenVertexArrays(1, &vao);
+}
+
+GpuHeightfield::~GpuHeightfield() {
+    glDeleteVertexArrays(1, &vao);
+    glDeleteFramebuffers(1, &fbo);
+    glDeleteTextures(1, &texture);
+    glDeleteTextures(1, &permutationTexture);
+    glDeleteProgram(programID);
+}
+
+int GpuHeightfield::max_layers() {
+    GLint maxLayers = 0;
+    glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &maxLayers);
+    return maxLayers;
+}
+
+void GpuHeightfield::begin(const FbmParams &params, float meshHeight, float waterHeight) {
+    float maxPossibleHeight = 0;
+    float amp = 1;
+    for (int i = 0; i < params.octaves; i++) {
+        maxPossibleHeight += amp;
+        amp *= params.persistence;
+    }
+
+    glGetIntegerv(GL_VIEWPORT, savedViewport);
+    savedDepthTest = glIsEnabled(GL_DEPTH_TEST);
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glViewport(0, 0, width, height);
+    glDisable(GL_DEPTH_TEST);
+    glDisable(GL_BLEND);
+
+    glUseProgram(programID);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, permutationTexture);
+    glUniform1i(glGetUniformLocation(programID, "permutation"), 0);
+    glUniform1i(glGetUniformLocation(programID, "octaves"), params.octaves);
+    glUniform1f(glGetUniformLocation(programID, "persistence"), params.persistence);
+    glUniform1f(glGetUniformLocation(programID, "lacunarity"), params.lacunarity);
+    glUniform1f(glGetUniformLocation(programID, "scale"), params.scale);
+    glUniform1f(glGetUniformLocation(programID, "maxPossibleHeight"), maxPossibleHeight);
+    glUniform1f(glGetUniformLocation(programID, "meshHeight"), meshHeight);
+    glUniform1f(glGetUniformLocation(programID, "waterHeight"), waterHeight);
+    glBindVertexArray(vao);
+}
+
+void GpuHeightfield::render_layer(int layer, int x0, int y0) {
+    glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, texture, 0, layer);
+    glUniform2i(originID, x0, y0);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+}
+
+void GpuHeightfield::end() {
+    glBindVertexArray(0);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glViewport(savedViewport[0], savedViewport[1], savedViewport[2], savedViewport[3]);
+    if (savedDepthTest) {
+        glEnable(GL_DEPTH_TEST);
+    }
+}
+
+void GpuHeightfield::read_layer(int layer, float *out) {
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+    glFramebufferTextureLayer(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, texture, 0, layer);
+    glReadBuffer(GL_COLOR_ATTACHMENT0);
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+    glReadPixels(0, 0, width, height, GL_RED, GL_FLOAT, out);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+}
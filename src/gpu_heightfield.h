@@ -0,0 +1,46 @@
+#ifndef GPU_HEIGHTFIELD_H
+#define GPU_HEIGHTFIELD_H
+
+#include <glad/gl.h>
+#include "noise.h"
+
+// Renders chunk heightmaps with a fragment shader fBm pass into the layers
+// of a GL_R32F texture array, which terrain.vert reads with texelFetch.
+// Layers match Terrain's chunk slots and include the one-sample border.
+class GpuHeightfield
+{
+public:
+    int width;
+    int height;
+    int layers;
+    GLuint texture = 0;
+    GLuint fbo = 0;
+    GLuint programID = 0;
+    GLuint permutationTexture = 0;
+    GLuint vao = 0;
+
+    GpuHeightfield(int width, int height, int layers, const PerlinNoise &noise);
+    ~GpuHeightfield();
+
+    static int max_layers();
+    bool valid() const { return programID != 0 && fbo != 0; }
+
+    // Binds the pass; render_layer may then be called for any number of layers
+    void begin(const FbmParams &params, float meshHeight, float waterHeight);
+    // Heights of grid points (x0 + i, y0 + j) into layer
+    void render_layer(int layer, int x0, int y0);
+    void end();
+
+    // CPU readback of one layer, width * height floats
+    void read_layer(int layer, float *out);
+
+private:
+    GLint savedViewport[4];
+    GLboolean savedDepthTest;
+    GLuint originID;
+
+    GpuHeightfield(const GpuHeightfield&) = delete;
+    GpuHeightfield& operator=(const GpuHeightfield&) = delete;
+};
+
+#endif
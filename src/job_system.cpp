@@ -0,0 +1,112 @@
+#include "job_system.h"
+
+// The job system and queue a worker thread belongs to, so jobs submitted
+// from a job stay on that worker
+static thread_local const JobSystem *currentSystem = nullptr;
+static thread_local int currentQueue = -1;
+
+JobSystem::JobSystem(unsigned int threads) : queued(0), pending(0), stealCount(0), nextQueue(0) {
+    if (threads == 0) {
+        threads = std::thread::hardware_concurrency();
+        threads = threads > 1 ? threads - 1 : 0;
+    }
+    for (unsigned int i = 0; i <= threads; i++) {
+        queues.push_back(std::unique_ptr<WorkQueue>(new WorkQueue()));
+    }
+    workers.reserve(threads);
+    for (unsigned int i = 0; i < threads; i++) {
+        workers.push_back(std::thread(&JobSystem::workerLoop, this, (int)i));
+    }
+}
+
+JobSystem::~JobSystem() {
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        stopping = true;
+    }
+    wakeup.notify_all();
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+}
+
+void JobSystem::submit(std::function<void()> job) {
+    int index = currentSystem == this ? currentQueue : (int)(nextQueue++ % queues.size());
+    // Counted before it can be taken, so a job stolen and finished at once
+    // never takes pending to 0 while its parent still runs
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        pending++;
+        queued++;
+    }
+    {
+        std::lock_guard<std::mutex> lock(queues[index]->mutex);
+        queues[index]->jobs.push_back(std::move(job));
+    }
+    wakeup.notify_one();
+}
+
+// Newest job of the own queue, else the oldest of the next non-empty one
+bool JobSystem::takeJob(int index, std::function<void()> &job) {
+    {
+        WorkQueue &own = *queues[index];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.jobs.empty()) {
+            job = std::move(own.jobs.back());
+            own.jobs.pop_back();
+            queued--;
+            return true;
+        }
+    }
+    for (size_t i = 1; i < queues.size(); i++) {
+        WorkQueue &victim = *queues[(index + i) % queues.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.jobs.empty()) {
+            job = std::move(victim.jobs.front());
+            victim.jobs.pop_front();
+            queued--;
+            stealCount++;
+            return true;
+        }
+    }
+    return false;
+}
+
+void JobSystem::finishJob() {
+    std::lock_guard<std::mutex> lock(sleepMutex);
+    if (--pending == 0) {
+        wakeup.notify_all();
+    }
+}
+
+void JobSystem::wait() {
+    int index = (int)queues.size() - 1;
+    std::function<void()> job;
+    while (pending > 0) {
+        if (takeJob(index, job)) {
+            job();
+            finishJob();
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(sleepMutex);
+        wakeup.wait(lock, [this]() { return pending == 0 || queued > 0; });
+    }
+}
+
+void JobSystem::workerLoop(int index) {
+    currentSystem = this;
+    currentQueue = index;
+    std::function<void()> job;
+    for (;;) {
+        if (takeJob(index, job)) {
+            job();
+            finishJob();
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(sleepMutex);
+        wakeup.wait(lock, [this]() { return stopping || queued > 0; });
+        if (stopping && queued == 0) {
+            return;
+        }
+    }
+}
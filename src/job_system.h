@@ -0,0 +1,62 @@
+#ifndef JOB_SYSTEM_H
+#define JOB_SYSTEM_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+// Work-stealing job system for the per-frame update. Every worker, and the
+// thread that waits, has its own queue: it runs its newest job first and,
+// when it runs dry, steals the oldest job of another queue. Jobs submitted
+// from outside are dealt round-robin, jobs submitted from a job go to that
+// worker's queue. wait() is the join: the calling thread runs jobs too
+// until none are left.
+// Like ThreadPool, jobs must not touch GL state.
+class JobSystem
+{
+public:
+    // threads == 0 uses one worker per hardware thread besides the caller
+    explicit JobSystem(unsigned int threads = 0);
+    ~JobSystem();
+
+    void submit(std::function<void()> job);
+
+    // Runs jobs until every submitted one has finished. Not from a job.
+    void wait();
+
+    unsigned int size() const { return (unsigned int)workers.size(); }
+    // Jobs taken from another thread's queue since construction
+    int steals() const { return stealCount.load(); }
+
+private:
+    struct WorkQueue {
+        std::mutex mutex;
+        std::deque<std::function<void()> > jobs;
+    };
+
+    void workerLoop(int index);
+    bool takeJob(int index, std::function<void()> &job);
+    void finishJob();
+
+    std::vector<std::thread> workers;
+    // One per worker, the last one for the waiting thread
+    std::vector<std::unique_ptr<WorkQueue> > queues;
+    std::atomic<int> queued;
+    std::atomic<int> pending;
+    std::atomic<int> stealCount;
+    std::atomic<unsigned int> nextQueue;
+    std::mutex sleepMutex;
+    std::condition_variable wakeup;
+    bool stopping = false;
+
+    JobSystem(const JobSystem&) = delete;
+    JobSystem& operator=(const JobSystem&) = delete;
+};
+
+#endif
@@ -23,6 +23,7 @@
 #include "entity.h"
 #include "terrain.h"
 #include "constants.h"
+#include "benchmark.h"
 
 
 
@@ -153,8 +154,23 @@ void renderQuad()
 }
 
  
-int main(void)
+int main(int argc, char **argv)
 {
+	// --bench runs the microbenchmarks in an offscreen context and exits,
+	// --stream streams terrain around the camera instead of the fixed grid,
+	// --gpu-terrain generates the terrain heights in a fragment shader pass,
+	// --clipmap draws the ground as a geometry clipmap around the camera
+	bool benchmark = false;
+	bool streamTerrain = false;
+	bool gpuTerrain = false;
+	bool clipmapTerrain = false;
+	for (int i = 1; i < argc; i++) {
+		benchmark = benchmark || std::string(argv[i]) == "--bench";
+		streamTerrain = streamTerrain || std::string(argv[i]) == "--stream";
+		gpuTerrain = gpuTerrain || std::string(argv[i]) == "--gpu-terrain";
+		clipmapTerrain = clipmapTerrain || std::string(argv[i]) == "--clipmap";
+	}
+
 	// Initialise GLFW
 	if (!glfwInit())
 	{
@@ -166,6 +182,9 @@ int main(void)
 	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
 	glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE); // For MacOS
 	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+	if (benchmark) {
+		glfwWindowHint(GLFW_VISIBLE, GL_FALSE);
+	}
 
 	// Open a window and create its OpenGL context
 	window = glfwCreateWindow(windowWidth, windowHeight, "Lab 4", NULL, NULL);
@@ -190,6 +209,12 @@ int main(void)
 		return -1;
 	}
 
+	if (benchmark) {
+		int failed = run_benchmarks();
+		glfwTerminate();
+		return failed == 0 ? 0 : 1;
+	}
+
 
 	// configure g-buffer framebuffer
     // ------------------------------
@@ -283,175 +308,189 @@ int main(void)
 
 	glEnable(GL_DEPTH_TEST);
 	glEnable(GL_CULL_FACE);
-	// Our 3D character
-	glm::mat4 modelMatrix = glm::mat4();
-	Entity quad("../src/model/quad/quad.gltf", "../src/shader/deferred.vert", "../src/shader/deferred.frag", modelMatrix, false);
-	Skybox skybox;
-	std::vector<std::string> faces = {
-		"../src/texture/day/right.bmp",
-		"../src/texture/day/left.bmp",
-		"../src/texture/day/top.bmp",
-		"../src/texture/day/bottom.bmp",
-		"../src/texture/day/front.bmp",
-		"../src/texture/day/back.bmp"
-	};
-	skybox.initialize(faces, "../src/shader/skybox.vert", "../src/shader/skybox.frag");
-	GLuint particleTex = LoadTextureTileBox("../src/texture/particles/particle.png");
-	GLuint particleShaderID =  LoadShadersFromFile("../src/shader/particle.vert", "../src/shader/particle.frag");
-	GLuint terrainTex = LoadTextureTileBox("../src/texture/terraintextures.png");
-	Terrain mountains(xMapChunks, yMapChunks, chunkWidth, chunkHeight, originX, originY);
-	mountains.setup_instancing(particleTex, particleShaderID);
-	// Time and frame rate tracking
-	static double lastTime = glfwGetTime();
-	float time = 0.0f;			// Animation time 
-	float fTime = 0.0f;			// Time for measuring fps
-	unsigned long frames = 0;
-	glm::mat4 viewMatrix, projectionMatrix, lightViewMatrix, vp;
-	projectionMatrix = glm::ortho(-1000.0f, 1000.0f, -1000.0f, 1000.0f, depthNear, depthFar);
-	//std::cout << "ortho " << glm::to_string(projectionMatrix) << std::endl;
-	lightViewMatrix = glm::lookAt(sunPos, glm::vec3(0.0f,0.0f,0.0f), lightUp);
-	//std::cout << "lookat " << glm::to_string(lightViewMatrix) << std::endl;
-	lightViewMatrix = projectionMatrix * lightViewMatrix;
-	//std::cout << "light mat " << glm::to_string(lightViewMatrix) << std::endl;
-	Light light = {
-		glm::vec3(0.2,0.2,0.2),
-		glm::vec3(0.3,0.3,0.3),
-		glm::vec3(1.0,1.0,1.0),
-		glm::vec3(-0.2f,-1.0f,-0.3f),
-	};
+	// Everything below owns GL objects, directly or through ResourceCache
+	// handles, so it goes out of scope while the context is still current
+	{
+		// Our 3D character
+		glm::mat4 modelMatrix = glm::mat4();
+		Entity quad("../src/model/quad/quad.gltf", "../src/shader/deferred.vert", "../src/shader/deferred.frag", modelMatrix, false);
+		Skybox skybox;
+		std::vector<std::string> faces = {
+			"../src/texture/day/right.bmp",
+			"../src/texture/day/left.bmp",
+			"../src/texture/day/top.bmp",
+			"../src/texture/day/bottom.bmp",
+			"../src/texture/day/front.bmp",
+			"../src/texture/day/back.bmp"
+		};
+		skybox.initialize(faces, "../src/shader/skybox.vert", "../src/shader/skybox.frag");
+		GLuint particleTex = LoadTextureTileBox("../src/texture/particles/particle.png");
+		ResourceCache &resources = ResourceCache::instance();
+		std::shared_ptr<GLProgram> particleShader = resources.program("../src/shader/particle.vert", "../src/shader/particle.frag");
+		GLuint particleShaderID = particleShader->id;
+		GLuint terrainTex = LoadTextureTileBox("../src/texture/terraintextures.png");
+		Terrain mountains(xMapChunks, yMapChunks, chunkWidth, chunkHeight, originX, originY, streamTerrain, gpuTerrain, clipmapTerrain);
+		mountains.setup_instancing(particleTex, particleShaderID);
+		// Time and frame rate tracking
+		static double lastTime = glfwGetTime();
+		float time = 0.0f;			// Animation time 
+		float fTime = 0.0f;			// Time for measuring fps
+		unsigned long frames = 0;
+		glm::mat4 viewMatrix, projectionMatrix, lightViewMatrix, vp;
+		projectionMatrix = glm::ortho(-1000.0f, 1000.0f, -1000.0f, 1000.0f, depthNear, depthFar);
+		//std::cout << "ortho " << glm::to_string(projectionMatrix) << std::endl;
+		lightViewMatrix = glm::lookAt(sunPos, glm::vec3(0.0f,0.0f,0.0f), lightUp);
+		//std::cout << "lookat " << glm::to_string(lightViewMatrix) << std::endl;
+		lightViewMatrix = projectionMatrix * lightViewMatrix;
+		//std::cout << "light mat " << glm::to_string(lightViewMatrix) << std::endl;
+		Light light = {
+			glm::vec3(0.2,0.2,0.2),
+			glm::vec3(0.3,0.3,0.3),
+			glm::vec3(1.0,1.0,1.0),
+			glm::vec3(-0.2f,-1.0f,-0.3f),
+		};
 	
-	Shadow shadow = {
-		lightViewMatrix,
-		depthMap,
-	};
-	GLuint botDepthID = LoadShadersFromFile("../src/shader/depthBot.vert", "../src/shader/depth.frag");
-	GLuint terrainDepthID = LoadShadersFromFile("../src/shader/depth.vert", "../src/shader/depth.frag");
-	GLuint treeDepthID = LoadShadersFromFile("../src/shader/depthTree.vert", "../src/shader/depth.frag");
-
-	GLuint botGeometryID = LoadShadersFromFile("../src/shader/geometry-bot.vert", "../src/shader/geometry.frag");
-	GLuint defferedPassID =  LoadShadersFromFile("../src/shader/deferred.vert", "../src/shader/deferred.frag");
+		Shadow shadow = {
+			lightViewMatrix,
+			depthMap,
+		};
+		std::shared_ptr<GLProgram> botDepth = resources.program("../src/shader/depthBot.vert", "../src/shader/depth.frag");
+		std::shared_ptr<GLProgram> terrainDepth = resources.program("../src/shader/depth.vert", "../src/shader/depth.frag");
+		std::shared_ptr<GLProgram> treeDepth = resources.program("../src/shader/depthTree.vert", "../src/shader/depth.frag");
+		GLuint botDepthID = botDepth->id;
+		GLuint terrainDepthID = terrainDepth->id;
+		GLuint treeDepthID = treeDepth->id;
+
+		std::shared_ptr<GLProgram> botGeometry = resources.program("../src/shader/geometry-bot.vert", "../src/shader/geometry.frag");
+		std::shared_ptr<GLProgram> defferedPass = resources.program("../src/shader/deferred.vert", "../src/shader/deferred.frag");
+		GLuint botGeometryID = botGeometry->id;
+		GLuint defferedPassID = defferedPass->id;
+		resources.log_stats();
 
 	
-	// Main loop
-	do
-	{
-		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
-		// Update states for animation
-        double currentTime = glfwGetTime();
-        deltaTime = float(currentTime - lastTime);
-		lastTime = currentTime;
-
-		if (playAnimation) {
-			time += deltaTime * playbackSpeed;
-			mountains.update(time, deltaTime,(float)xMapChunks,(float)chunkWidth,originX);
-		}
+		// Main loop
+		do
+		{
+			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+			// Update states for animation
+	        double currentTime = glfwGetTime();
+	        deltaTime = float(currentTime - lastTime);
+			lastTime = currentTime;
+
+			if (playAnimation) {
+				time += deltaTime * playbackSpeed;
+				mountains.update(time, deltaTime,(float)xMapChunks,(float)chunkWidth,originX);
+			}
 	
 
-		projectionMatrix = glm::perspective(glm::radians(camera.Zoom), (float)windowWidth / windowHeight, zNear, zFar);
-		viewMatrix = camera.GetViewMatrix();
-		//Rendering
-		// glBindFramebuffer(GL_FRAMEBUFFER, gBuffer);
-		// glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-		// bot1.render(viewMatrix, projectionMatrix, lightViewMatrix, botGeometryID);
-		// glBindFramebuffer(GL_FRAMEBUFFER, 0);
+			mountains.stream_chunks(camera.Position, camera.Front, deltaTime);
+
+			projectionMatrix = glm::perspective(glm::radians(camera.Zoom), (float)windowWidth / windowHeight, zNear, zFar);
+			viewMatrix = camera.GetViewMatrix();
+			//Rendering
+			// glBindFramebuffer(GL_FRAMEBUFFER, gBuffer);
+			// glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+			// bot1.render(viewMatrix, projectionMatrix, lightViewMatrix, botGeometryID);
+			// glBindFramebuffer(GL_FRAMEBUFFER, 0);
 		
 		
-		glViewport(0,0,shadowMapWidth,shadowMapHeight);
-		glBindFramebuffer(GL_FRAMEBUFFER, depthMapFBO);
-		glGetError();
-        glClear(GL_DEPTH_BUFFER_BIT);
-		glDisable(GL_CULL_FACE);
-		mountains.render(camera.Position, terrainDepthID, treeDepthID, lightViewMatrix, botDepthID);
-		glEnable(GL_CULL_FACE);
-		glBindFramebuffer(GL_FRAMEBUFFER, 0);
-		glViewport(0,0,windowWidth*4,windowHeight*4);
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);		
+			glViewport(0,0,shadowMapWidth,shadowMapHeight);
+			glBindFramebuffer(GL_FRAMEBUFFER, depthMapFBO);
+			glGetError();
+	        glClear(GL_DEPTH_BUFFER_BIT);
+			glDisable(GL_CULL_FACE);
+			mountains.render(camera.Position, terrainDepthID, treeDepthID, lightViewMatrix, botDepthID);
+			glEnable(GL_CULL_FACE);
+			glBindFramebuffer(GL_FRAMEBUFFER, 0);
+			glViewport(0,0,windowWidth*4,windowHeight*4);
+	        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);		
 		
 
-		vp = projectionMatrix * viewMatrix;
+			vp = projectionMatrix * viewMatrix;
 		
-		viewMatrix = glm::mat4(glm::mat3(camera.GetViewMatrix()));
-		glm::mat4 vpSkybox = projectionMatrix * viewMatrix;
+			viewMatrix = glm::mat4(glm::mat3(camera.GetViewMatrix()));
+			glm::mat4 vpSkybox = projectionMatrix * viewMatrix;
 		
 		
 	
 		
 
-		// glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-		// glUseProgram(defferedPassID);
-		// glActiveTexture(GL_TEXTURE0);
-        // glBindTexture(GL_TEXTURE_2D, gPosition);
-		// glUniform1i(glGetUniformLocation(defferedPassID, "gPosition"),0);
-        // glActiveTexture(GL_TEXTURE1);
-        // glBindTexture(GL_TEXTURE_2D, gNormal);
-		// glUniform1i(glGetUniformLocation(defferedPassID, "gNormal"),1);
-        // glActiveTexture(GL_TEXTURE2);
-        // glBindTexture(GL_TEXTURE_2D, gAlbedoSpec);
-		// glUniform1i(glGetUniformLocation(defferedPassID, "gAlbedoSpec"),2);
-		// glActiveTexture(GL_TEXTURE3);
-        // glBindTexture(GL_TEXTURE_2D, shadow.shadowMap);
-		// glUniform1i(glGetUniformLocation(defferedPassID, "shadowMap"),3);
-		// glActiveTexture(GL_TEXTURE4);
-        // glBindTexture(GL_TEXTURE_2D, gLightSpacePosition);
-		// glUniform1i(glGetUniformLocation(defferedPassID, "lightSpaceCoord"),4);
-		// glUniformMatrix4fv(glGetUniformLocation(defferedPassID, "lightSpaceMatrix"), 1, GL_FALSE, glm::value_ptr(lightViewMatrix));
-
-		// glUniform3fv(glGetUniformLocation(defferedPassID, "u_viewPos"), 1, glm::value_ptr(camera.Position));
-
-		// glUniform3fv(glGetUniformLocation(defferedPassID, "direction"), 1, glm::value_ptr(light.direction));
+			// glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+			// glUseProgram(defferedPassID);
+			// glActiveTexture(GL_TEXTURE0);
+	        // glBindTexture(GL_TEXTURE_2D, gPosition);
+			// glUniform1i(glGetUniformLocation(defferedPassID, "gPosition"),0);
+	        // glActiveTexture(GL_TEXTURE1);
+	        // glBindTexture(GL_TEXTURE_2D, gNormal);
+			// glUniform1i(glGetUniformLocation(defferedPassID, "gNormal"),1);
+	        // glActiveTexture(GL_TEXTURE2);
+	        // glBindTexture(GL_TEXTURE_2D, gAlbedoSpec);
+			// glUniform1i(glGetUniformLocation(defferedPassID, "gAlbedoSpec"),2);
+			// glActiveTexture(GL_TEXTURE3);
+	        // glBindTexture(GL_TEXTURE_2D, shadow.shadowMap);
+			// glUniform1i(glGetUniformLocation(defferedPassID, "shadowMap"),3);
+			// glActiveTexture(GL_TEXTURE4);
+	        // glBindTexture(GL_TEXTURE_2D, gLightSpacePosition);
+			// glUniform1i(glGetUniformLocation(defferedPassID, "lightSpaceCoord"),4);
+			// glUniformMatrix4fv(glGetUniformLocation(defferedPassID, "lightSpaceMatrix"), 1, GL_FALSE, glm::value_ptr(lightViewMatrix));
+
+			// glUniform3fv(glGetUniformLocation(defferedPassID, "u_viewPos"), 1, glm::value_ptr(camera.Position));
+
+			// glUniform3fv(glGetUniformLocation(defferedPassID, "direction"), 1, glm::value_ptr(light.direction));
 	
-        // quad.render();
+	        // quad.render();
 
 		
-		// // glBindFramebuffer(GL_FRAMEBUFFER, 0);
-		// // glViewport(0,0,windowWidth*4,windowHeight*4);
-        // // glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
-		// glBindFramebuffer(GL_READ_FRAMEBUFFER, gBuffer);
-        // glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0); // write to default framebuffer
-        // // blit to default framebuffer. Note that this may or may not work as the internal formats of both the FBO and default framebuffer have to match.
-        // // the internal formats are implementation defined. This works on all of my systems, but if it doesn't on yours you'll likely have to write to the 		
-        // // depth buffer in another shader stage (or somehow see to match the default framebuffer's internal format with the FBO's internal format).
-        // glBlitFramebuffer(0, 0, windowWidth, windowHeight, 0, 0, windowWidth, windowHeight, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
-        glBindFramebuffer(GL_FRAMEBUFFER, 0);
-
-		glDisable(GL_CULL_FACE);
-		mountains.render(vp, camera.Position, shadow, light, terrainTex);
-		glEnable(GL_CULL_FACE);
-		skybox.render(vpSkybox);
+			// // glBindFramebuffer(GL_FRAMEBUFFER, 0);
+			// // glViewport(0,0,windowWidth*4,windowHeight*4);
+	        // // glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+			// glBindFramebuffer(GL_READ_FRAMEBUFFER, gBuffer);
+	        // glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0); // write to default framebuffer
+	        // // blit to default framebuffer. Note that this may or may not work as the internal formats of both the FBO and default framebuffer have to match.
+	        // // the internal formats are implementation defined. This works on all of my systems, but if it doesn't on yours you'll likely have to write to the 		
+	        // // depth buffer in another shader stage (or somehow see to match the default framebuffer's internal format with the FBO's internal format).
+	        // glBlitFramebuffer(0, 0, windowWidth, windowHeight, 0, 0, windowWidth, windowHeight, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+	        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+			glDisable(GL_CULL_FACE);
+			mountains.render(vp, camera.Position, shadow, light, terrainTex);
+			glEnable(GL_CULL_FACE);
+			skybox.render(vpSkybox);
 
 		
 		
-		if (saveDepth) {
-            std::string filename = "depth_camera.png";
-            saveDepthTexture(0, filename);
-            std::cout << "Depth texture saved to " << filename << std::endl;
-            saveDepth = false;
-        }
+			if (saveDepth) {
+	            std::string filename = "depth_camera.png";
+	            saveDepthTexture(0, filename);
+	            std::cout << "Depth texture saved to " << filename << std::endl;
+	            saveDepth = false;
+	        }
 		
 		
 
-		// FPS tracking 
-		// Count number of frames over a few seconds and take average
-		frames++;
-		fTime += deltaTime;
-		if (fTime > 2.0f) {		
-			float fps = frames / fTime;
-			frames = 0;
-			fTime = 0;
+			// FPS tracking 
+			// Count number of frames over a few seconds and take average
+			frames++;
+			fTime += deltaTime;
+			if (fTime > 2.0f) {		
+				float fps = frames / fTime;
+				frames = 0;
+				fTime = 0;
 			
-			std::stringstream stream;
-			stream << std::fixed << std::setprecision(2) << "Lab 4 | Frames per second (FPS): " << fps;
-			glfwSetWindowTitle(window, stream.str().c_str());
-		}
+				std::stringstream stream;
+				stream << std::fixed << std::setprecision(2) << "Lab 4 | Frames per second (FPS): " << fps;
+				glfwSetWindowTitle(window, stream.str().c_str());
+			}
 
-		// Swap buffers
-		glfwSwapBuffers(window);
-		glfwPollEvents();
+			// Swap buffers
+			glfwSwapBuffers(window);
+			glfwPollEvents();
 
-	} // Check if the ESC key was pressed or the window was closed
-	while (!glfwWindowShouldClose(window));
+		} // Check if the ESC key was pressed or the window was closed
+		while (!glfwWindowShouldClose(window));
+	}
 
 
 	// Close OpenGL window and terminate GLFW
@@ -0,0 +1,59 @@
+#include "mapped_file.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::~MappedFile() {
+#ifdef _WIN32
+    if (bytes) UnmapViewOfFile(bytes);
+    if (mapping) CloseHandle(mapping);
+    if (file) CloseHandle(file);
+#else
+    if (bytes) munmap((void *)bytes, length);
+#endif
+}
+
+bool MappedFile::open(const std::string &path) {
+#ifdef _WIN32
+    file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        file = NULL;
+        return false;
+    }
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) {
+        return false;
+    }
+    mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping == NULL) {
+        return false;
+    }
+    bytes = (const unsigned char *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    length = (size_t)fileSize.QuadPart;
+    return bytes != NULL;
+#else
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return false;
+    }
+    void *address = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (address == MAP_FAILED) {
+        return false;
+    }
+    bytes = (const unsigned char *)address;
+    length = st.st_size;
+    return true;
+#endif
+}
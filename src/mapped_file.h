@@ -0,0 +1,30 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <cstddef>
+#include <string>
+
+// Read-only memory mapping of a whole file
+class MappedFile
+{
+public:
+    MappedFile() {}
+    ~MappedFile();
+
+    bool open(const std::string &path);
+    const unsigned char *data() const { return bytes; }
+    size_t size() const { return length; }
+
+private:
+    const unsigned char *bytes = NULL;
+    size_t length = 0;
+#ifdef _WIN32
+    void *file = NULL;
+    void *mapping = NULL;
+#endif
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+};
+
+#endif
@@ -0,0 +1,387 @@
+#include "noise.h"
+#include <algorithm>
+#include <cmath>
+#include <random>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define NOISE_HAS_SSE2 1
+#include <emmintrin.h>
+#endif
+
+// AVX2 is compiled per function and only selected after a runtime CPU check
+#if NOISE_HAS_SSE2 && defined(__GNUC__)
+#define NOISE_HAS_AVX2 1
+#define NOISE_TARGET_AVX2 __attribute__((target("avx2")))
+#define NOISE_INLINE_AVX2 __attribute__((target("avx2"), always_inline))
+#include <immintrin.h>
+#endif
+
+static const int permutation[256] = { 151,160,137,91,90,15,
+    131,13,201,95,96,53,194,233,7,225,140,36,103,30,69,142,8,99,37,240,21,10,23,
+    190, 6,148,247,120,234,75,0,26,197,62,94,252,219,203,117,35,11,32,57,177,33,
+    88,237,149,56,87,174,20,125,136,171,168, 68,175,74,165,71,134,139,48,27,166,
+    77,146,158,231,83,111,229,122,60,211,133,230,220,105,92,41,55,46,245,40,244,
+    102,143,54, 65,25,63,161, 1,216,80,73,209,76,132,187,208, 89,18,169,200,196,
+    135,130,116,188,159,86,164,100,109,198,173,186, 3,64,52,217,226,250,124,123,
+    5,202,38,147,118,126,255,82,85,212,207,206,59,227,47,16,58,17,182,189,28,42,
+    223,183,170,213,119,248,152, 2,44,154,163, 70,221,153,101,155,167, 43,172,9,
+    129,22,39,253, 19,98,108,110,79,113,224,232,178,185, 112,104,218,246,97,228,
+    251,34,242,193,238,210,144,12,191,179,162,241, 81,51,145,235,249,14,239,107,
+    49,192,214, 31,181,199,106,157,184, 84,204,176,115,121,50,45,127, 4,150,254,
+    138,236,205,93,222,114,67,29,24,72,243,141,128,195,78,66,215,61,156,180
+};
+
+PerlinNoise::PerlinNoise(unsigned int seed) {
+    int table[256];
+    std::copy(permutation, permutation + 256, table);
+    if (seed != 0) {
+        std::minstd_rand rng(seed);
+        for (int i = 255; i > 0; i--) {
+            std::swap(table[i], table[rng() % (i + 1)]);
+        }
+    }
+    for (int i = 0; i < 512; i++) {
+        p[i] = table[i & 255];
+    }
+    backend = best_backend();
+}
+
+NoiseBackend PerlinNoise::best_backend() {
+    if (backend_supported(NOISE_AVX2)) return NOISE_AVX2;
+    if (backend_supported(NOISE_SSE2)) return NOISE_SSE2;
+    return NOISE_SCALAR;
+}
+
+bool PerlinNoise::backend_supported(NoiseBackend backend) {
+    switch (backend) {
+    case NOISE_SCALAR:
+        return true;
+    case NOISE_SSE2:
+#if NOISE_HAS_SSE2
+        return true;
+#else
+        return false;
+#endif
+    case NOISE_AVX2:
+#if NOISE_HAS_AVX2
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2") != 0;
+#else
+        return false;
+#endif
+    }
+    return false;
+}
+
+const char *PerlinNoise::backend_name(NoiseBackend backend) {
+    switch (backend) {
+    case NOISE_SSE2: return "sse2";
+    case NOISE_AVX2: return "avx2";
+    default: return "scalar";
+    }
+}
+
+
+// ---------------------------------------------------------------------------
+// Scalar kernel
+// ---------------------------------------------------------------------------
+
+static inline float fade(float t) { return t * t * t * (t * (t * 6 - 15) + 10); }
+
+static inline float lerp(float t, float a, float b) { return a + t * (b - a); }
+
+// Gradient of the 3D reference noise with z fixed at 0
+static inline float grad(int hash, float x, float y) {
+    int h = hash & 15;
+    float u = h < 8 ? x : y,
+          v = h < 4 ? y : h == 12 || h == 14 ? x : 0.0f;
+    return ((h & 1) == 0 ? u : -u) + ((h & 2) == 0 ? v : -v);
+}
+
+float PerlinNoise::noise(float x, float y) const {
+    float fx = std::floor(x), fy = std::floor(y);
+    int X = (int)fx & 255,
+        Y = (int)fy & 255;
+    x -= fx;
+    y -= fy;
+    float u = fade(x),
+          v = fade(y);
+    int A = p[X] + Y,
+        B = p[X + 1] + Y;
+
+    return lerp(v, lerp(u, grad(p[p[A    ]], x    , y    ),
+                           grad(p[p[B    ]], x - 1, y    )),
+                   lerp(u, grad(p[p[A + 1]], x    , y - 1),
+                           grad(p[p[B + 1]], x - 1, y - 1)));
+}
+
+static void fbm_octave_scalar(const PerlinNoise &noise, float *out, int x0, int count,
+                              float scale, float freq, float ySample, float amp) {
+    for (int i = 0; i < count; i++) {
+        float xSample = (float)(x0 + i) / scale * freq;
+        out[i] += noise.noise(xSample, ySample) * amp;
+    }
+}
+
+
+// ---------------------------------------------------------------------------
+// SSE2 kernel: 4 samples per iteration, hash lookups done per lane
+// ---------------------------------------------------------------------------
+
+#if NOISE_HAS_SSE2
+static inline __m128 fade_sse2(__m128 t) {
+    __m128 r = _mm_sub_ps(_mm_mul_ps(t, _mm_set1_ps(6.0f)), _mm_set1_ps(15.0f));
+    r = _mm_add_ps(_mm_mul_ps(t, r), _mm_set1_ps(10.0f));
+    return _mm_mul_ps(_mm_mul_ps(_mm_mul_ps(t, t), t), r);
+}
+
+static inline __m128 lerp_sse2(__m128 t, __m128 a, __m128 b) {
+    return _mm_add_ps(a, _mm_mul_ps(t, _mm_sub_ps(b, a)));
+}
+
+static inline __m128 grad_sse2(__m128i hash, __m128 x, __m128 y) {
+    __m128i h = _mm_and_si128(hash, _mm_set1_epi32(15));
+    __m128 uIsX = _mm_castsi128_ps(_mm_cmplt_epi32(h, _mm_set1_epi32(8)));
+    __m128 vIsY = _mm_castsi128_ps(_mm_cmplt_epi32(h, _mm_set1_epi32(4)));
+    __m128 vIsX = _mm_castsi128_ps(_mm_or_si128(_mm_cmpeq_epi32(h, _mm_set1_epi32(12)),
+                                                _mm_cmpeq_epi32(h, _mm_set1_epi32(14))));
+    __m128 u = _mm_or_ps(_mm_and_ps(uIsX, x), _mm_andnot_ps(uIsX, y));
+    __m128 v = _mm_or_ps(_mm_and_ps(vIsY, y), _mm_andnot_ps(vIsY, _mm_and_ps(vIsX, x)));
+    // Bits 0 and 1 of the hash flip the sign of u and v
+    __m128 uSign = _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(h, _mm_set1_epi32(1)), 31));
+    __m128 vSign = _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(h, _mm_set1_epi32(2)), 30));
+    return _mm_add_ps(_mm_xor_ps(u, uSign), _mm_xor_ps(v, vSign));
+}
+
+static void fbm_octave_sse2(const PerlinNoise &noise, const int *p, float *out, int x0, int count,
+                            float scale, float freq, float ySample, float amp) {
+    // y is constant along a row
+    float fy = std::floor(ySample);
+    int Y = (int)fy & 255;
+    float yf = ySample - fy;
+    __m128 y = _mm_set1_ps(yf);
+    __m128 y1 = _mm_set1_ps(yf - 1.0f);
+    __m128 v = _mm_set1_ps(fade(yf));
+    __m128 vScale = _mm_set1_ps(scale);
+    __m128 vFreq = _mm_set1_ps(freq);
+    __m128 vAmp = _mm_set1_ps(amp);
+    __m128 one = _mm_set1_ps(1.0f);
+
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i xi = _mm_add_epi32(_mm_set1_epi32(x0 + i), _mm_set_epi32(3, 2, 1, 0));
+        __m128 xs = _mm_mul_ps(_mm_div_ps(_mm_cvtepi32_ps(xi), vScale), vFreq);
+
+        // floor() without SSE4.1: truncate, then step down where that rounded up
+        __m128i xt = _mm_cvttps_epi32(xs);
+        __m128 xtf = _mm_cvtepi32_ps(xt);
+        __m128 roundedUp = _mm_cmpgt_ps(xtf, xs);
+        xtf = _mm_sub_ps(xtf, _mm_and_ps(roundedUp, one));
+        xt = _mm_add_epi32(xt, _mm_castps_si128(roundedUp));
+        __m128 x = _mm_sub_ps(xs, xtf);
+        __m128 x1 = _mm_sub_ps(x, one);
+
+        int X[4], h00[4], h10[4], h01[4], h11[4];
+        _mm_storeu_si128((__m128i*)X, _mm_and_si128(xt, _mm_set1_epi32(255)));
+        for (int k = 0; k < 4; k++) {
+            int A = p[X[k]] + Y,
+                B = p[X[k] + 1] + Y;
+            h00[k] = p[p[A]];
+            h10[k] = p[p[B]];
+            h01[k] = p[p[A + 1]];
+            h11[k] = p[p[B + 1]];
+        }
+
+        __m128 u = fade_sse2(x);
+        __m128 n = lerp_sse2(v,
+            lerp_sse2(u, grad_sse2(_mm_loadu_si128((__m128i*)h00), x, y),
+                         grad_sse2(_mm_loadu_si128((__m128i*)h10), x1, y)),
+            lerp_sse2(u, grad_sse2(_mm_loadu_si128((__m128i*)h01), x, y1),
+                         grad_sse2(_mm_loadu_si128((__m128i*)h11), x1, y1)));
+        _mm_storeu_ps(out + i, _mm_add_ps(_mm_loadu_ps(out + i), _mm_mul_ps(n, vAmp)));
+    }
+    fbm_octave_scalar(noise, out + i, x0 + i, count - i, scale, freq, ySample, amp);
+}
+#endif
+
+
+// ---------------------------------------------------------------------------
+// AVX2 kernel: 8 samples per iteration
+// ---------------------------------------------------------------------------
+
+#if NOISE_HAS_AVX2
+NOISE_INLINE_AVX2 static inline __m256 fade_avx2(__m256 t) {
+    __m256 r = _mm256_sub_ps(_mm256_mul_ps(t, _mm256_set1_ps(6.0f)), _mm256_set1_ps(15.0f));
+    r = _mm256_add_ps(_mm256_mul_ps(t, r), _mm256_set1_ps(10.0f));
+    return _mm256_mul_ps(_mm256_mul_ps(_mm256_mul_ps(t, t), t), r);
+}
+
+NOISE_INLINE_AVX2 static inline __m256 lerp_avx2(__m256 t, __m256 a, __m256 b) {
+    return _mm256_add_ps(a, _mm256_mul_ps(t, _mm256_sub_ps(b, a)));
+}
+
+NOISE_INLINE_AVX2 static inline __m256 grad_avx2(__m256i hash, __m256 x, __m256 y) {
+    __m256i h = _mm256_and_si256(hash, _mm256_set1_epi32(15));
+    __m256 uIsX = _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32(8), h));
+    __m256 vIsY = _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32(4), h));
+    __m256 vIsX = _mm256_castsi256_ps(_mm256_or_si256(_mm256_cmpeq_epi32(h, _mm256_set1_epi32(12)),
+                                                      _mm256_cmpeq_epi32(h, _mm256_set1_epi32(14))));
+    __m256 u = _mm256_blendv_ps(y, x, uIsX);
+    __m256 v = _mm256_blendv_ps(_mm256_and_ps(vIsX, x), y, vIsY);
+    __m256 uSign = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_and_si256(h, _mm256_set1_epi32(1)), 31));
+    __m256 vSign = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_and_si256(h, _mm256_set1_epi32(2)), 30));
+    return _mm256_add_ps(_mm256_xor_ps(u, uSign), _mm256_xor_ps(v, vSign));
+}
+
+// The row tail is padded to a full vector instead of falling back to the
+// scalar kernel: calling non-VEX code with dirty upper lanes costs more than
+// the few wasted lanes.
+NOISE_TARGET_AVX2 static void fbm_octave_avx2(const int *p, float *out, int x0, int count,
+                                              float scale, float freq, float ySample, float amp) {
+    float fy = std::floor(ySample);
+    int Y = (int)fy & 255;
+    float yf = ySample - fy;
+    __m256 y = _mm256_set1_ps(yf);
+    __m256 y1 = _mm256_set1_ps(yf - 1.0f);
+    __m256 v = fade_avx2(y);
+    __m256 vScale = _mm256_set1_ps(scale);
+    __m256 vFreq = _mm256_set1_ps(freq);
+    __m256 vAmp = _mm256_set1_ps(amp);
+    __m256 one = _mm256_set1_ps(1.0f);
+
+    for (int i = 0; i < count; i += 8) {
+        __m256i xi = _mm256_add_epi32(_mm256_set1_epi32(x0 + i), _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+        __m256 xs = _mm256_mul_ps(_mm256_div_ps(_mm256_cvtepi32_ps(xi), vScale), vFreq);
+        __m256 xf = _mm256_floor_ps(xs);
+        __m256i X = _mm256_and_si256(_mm256_cvttps_epi32(xf), _mm256_set1_epi32(255));
+        __m256 x = _mm256_sub_ps(xs, xf);
+        __m256 x1 = _mm256_sub_ps(x, one);
+
+        // Scalar lookups: hardware gathers are slower than this on CPUs
+        // running with the gather data sampling microcode mitigation
+        int Xs[8], h[4][8];
+        _mm256_storeu_si256((__m256i*)Xs, X);
+        for (int k = 0; k < 8; k++) {
+            int A = p[Xs[k]] + Y,
+                B = p[Xs[k] + 1] + Y;
+            h[0][k] = p[p[A]];
+            h[1][k] = p[p[B]];
+            h[2][k] = p[p[A + 1]];
+            h[3][k] = p[p[B + 1]];
+        }
+        __m256i h00 = _mm256_loadu_si256((__m256i*)h[0]);
+        __m256i h10 = _mm256_loadu_si256((__m256i*)h[1]);
+        __m256i h01 = _mm256_loadu_si256((__m256i*)h[2]);
+        __m256i h11 = _mm256_loadu_si256((__m256i*)h[3]);
+
+        __m256 u = fade_avx2(x);
+        __m256 n = lerp_avx2(v,
+            lerp_avx2(u, grad_avx2(h00, x, y), grad_avx2(h10, x1, y)),
+            lerp_avx2(u, grad_avx2(h01, x, y1), grad_avx2(h11, x1, y1)));
+        if (i + 8 <= count) {
+            _mm256_storeu_ps(out + i, _mm256_add_ps(_mm256_loadu_ps(out + i), _mm256_mul_ps(n, vAmp)));
+        } else {
+            float tail[8];
+            _mm256_storeu_ps(tail, _mm256_mul_ps(n, vAmp));
+            for (int k = 0; i + k < count; k++) {
+                out[i + k] += tail[k];
+            }
+        }
+    }
+}
+#endif
+
+
+void PerlinNoise::fbm_row(float *out, int x0, int y, int count, const FbmParams &params) const {
+    std::fill(out, out + count, 0.0f);
+
+    float amp  = 1;
+    float freq = 1;
+    for (int o = 0; o < params.octaves; o++) {
+        float ySample = (float)y / params.scale * freq;
+        switch (backend) {
+#if NOISE_HAS_AVX2
+        case NOISE_AVX2:
+            fbm_octave_avx2(p, out, x0, count, params.scale, freq, ySample, amp);
+            break;
+#endif
+#if NOISE_HAS_SSE2
+        case NOISE_SSE2:
+            fbm_octave_sse2(*this, p, out, x0, count, params.scale, freq, ySample, amp);
+            break;
+#endif
+        default:
+            fbm_octave_scalar(*this, out, x0, count, params.scale, freq, ySample, amp);
+            break;
+        }
+        amp  *= params.persistence;
+        freq *= params.lacunarity;
+    }
+}
+
+void PerlinNoise::fbm_tile(float *out, int x0, int y0, int width, int height, const FbmParams &params) const {
+    for (int y = 0; y < height; y++) {
+        fbm_row(out + y * width, x0, y0 + y, width, params);
+    }
+}
+
+
+// ---------------------------------------------------------------------------
+// Reference implementation
+// ---------------------------------------------------------------------------
+
+static double fade_reference(double t) { return t * t * t * (t * (t * 6 - 15) + 10); }
+
+static double lerp_reference(double t, double a, double b) { return a + t * (b - a); }
+
+static double grad_reference(int hash, double x, double y, double z) {
+    int h = hash & 15;                      // CONVERT LO 4 BITS OF HASH CODE
+    double u = h<8 ? x : y,                 // INTO 12 GRADIENT DIRECTIONS.
+           v = h<4 ? y : h==12||h==14 ? x : z;
+    return ((h&1) == 0 ? u : -u) + ((h&2) == 0 ? v : -v);
+}
+
+double PerlinNoise::reference_noise(float x, float y) const {
+    int z = 0.5;
+
+    int X = (int)floor(x) & 255,                  // FIND UNIT CUBE THAT
+        Y = (int)floor(y) & 255,                  // CONTAINS POINT.
+        Z = (int)floor(z) & 255;
+    x -= floor(x);                                // FIND RELATIVE X,Y,Z
+    y -= floor(y);                                // OF POINT IN CUBE.
+    z -= floor(z);
+    double u = fade_reference(x),                 // COMPUTE FADE CURVES
+           v = fade_reference(y),                 // FOR EACH OF X,Y,Z.
+           w = fade_reference(z);
+    int A = p[X  ]+Y, AA = p[A]+Z, AB = p[A+1]+Z,      // HASH COORDINATES OF
+        B = p[X+1]+Y, BA = p[B]+Z, BB = p[B+1]+Z;      // THE 8 CUBE CORNERS,
+
+    return lerp_reference(w, lerp_reference(v, lerp_reference(u, grad_reference(p[AA  ], x  , y  , z   ),  // AND ADD
+                                                                 grad_reference(p[BA  ], x-1, y  , z   )), // BLENDED
+                                               lerp_reference(u, grad_reference(p[AB  ], x  , y-1, z   ),  // RESULTS
+                                                                 grad_reference(p[BB  ], x-1, y-1, z   ))),// FROM  8
+                             lerp_reference(v, lerp_reference(u, grad_reference(p[AA+1], x  , y  , z-1 ),  // CORNERS
+                                                                 grad_reference(p[BA+1], x-1, y  , z-1 )), // OF CUBE
+                                               lerp_reference(u, grad_reference(p[AB+1], x  , y-1, z-1 ),
+                                                                 grad_reference(p[BB+1], x-1, y-1, z-1 ))));
+}
+
+void PerlinNoise::reference_fbm_tile(float *out, int x0, int y0, int width, int height, const FbmParams &params) const {
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            float amp  = 1;
+            float freq = 1;
+            float noiseHeight = 0;
+            for (int i = 0; i < params.octaves; i++) {
+                float xSample = (x + x0) / params.scale * freq;
+                float ySample = (y + y0) / params.scale * freq;
+
+                float perlinValue = reference_noise(xSample, ySample);
+                noiseHeight += perlinValue * amp;
+                amp  *= params.persistence;
+                freq *= params.lacunarity;
+            }
+            out[x + y * width] = noiseHeight;
+        }
+    }
+}
@@ -0,0 +1,51 @@
+#ifndef NOISE_H
+#define NOISE_H
+
+enum NoiseBackend {
+    NOISE_SCALAR,
+    NOISE_SSE2,
+    NOISE_AVX2
+};
+
+struct FbmParams {
+    int octaves;
+    float persistence;
+    float lacunarity;
+    float scale;        // Sample coordinate = grid coordinate / scale * frequency
+};
+
+// Improved Perlin noise on the z = 0 slice, evaluated in batches.
+// The permutation table is built once per seed; seed 0 is Ken Perlin's
+// reference table which the terrain has always used.
+class PerlinNoise
+{
+public:
+    NoiseBackend backend;
+
+    explicit PerlinNoise(unsigned int seed = 0);
+
+    // Fastest kernel supported by the running CPU
+    static NoiseBackend best_backend();
+    static bool backend_supported(NoiseBackend backend);
+    static const char *backend_name(NoiseBackend backend);
+
+    float noise(float x, float y) const;
+
+    // Permutation table, e.g. for uploading to the GPU heightfield pass
+    const int *permutation_table() const { return p; }
+
+    // Raw fBm octave sum for the integer grid points (x0 + i, y), i < count
+    void fbm_row(float *out, int x0, int y, int count, const FbmParams &params) const;
+    // Row-major width x height tile starting at grid point (x0, y0)
+    void fbm_tile(float *out, int x0, int y0, int width, int height, const FbmParams &params) const;
+
+    // Original one-sample-at-a-time double precision implementation. Kept as
+    // ground truth for the tolerance check in the benchmarks.
+    double reference_noise(float x, float y) const;
+    void reference_fbm_tile(float *out, int x0, int y0, int width, int height, const FbmParams &params) const;
+
+private:
+    int p[512];         // Permutation repeated twice so lookups never wrap
+};
+
+#endif
@@ -0,0 +1,462 @@
+#include "particle_system.h"
+
+#include <glm/gtc/constants.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdlib>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define PARTICLES_HAVE_SSE2 1
+#include <emmintrin.h>
+#else
+#define PARTICLES_HAVE_SSE2 0
+#endif
+
+// One particle of the GPU state, as particle_simulate.vert captures it
+struct GpuParticle {
+    glm::vec4 positionScale;
+    float speed;
+    float life;
+    uint32_t respawns;
+    uint32_t emitter;
+};
+
+// Before glfwTerminate: main scopes the Terrain that owns the system. A
+// system that never reached init() made no GL objects and needs no context.
+ParticleSystem::~ParticleSystem() {
+    if (vao == 0 && !useGpu) {
+        return;
+    }
+    glDeleteVertexArrays(1, &vao);
+    glDeleteBuffers(1, &quadBuffer);
+    glDeleteBuffers(1, &instanceBuffer);
+    glDeleteVertexArrays(2, simulateArrays);
+    glDeleteVertexArrays(2, drawArrays);
+    glDeleteBuffers(2, stateBuffers);
+    glDeleteTextures(1, &emitterTexture);
+    glDeleteBuffers(1, &emitterBuffer);
+}
+
+// Integer hash with good avalanche, the same in particle_simulate.vert
+static uint32_t particle_hash(uint32_t x) {
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+// Uniform in [low, high), draw k of a respawn
+static float particle_random(uint32_t base, uint32_t k, float low, float high) {
+    return low + (particle_hash(base + k) >> 8) * (1.0f / 16777216.0f) * (high - low);
+}
+
+// Somewhere within 5 units of the emitter, up to a unit above it
+void ParticleSystem::respawn(int particle) {
+    const glm::vec3 &center = emitterCenter[particleEmitter[particle]];
+    uint32_t base = particle_hash(particle_hash((uint32_t)particle ^ seed) + ++respawns[particle]);
+    float angle = particle_random(base, 0, 0.0f, 2.0f * glm::pi<float>());
+    float radius = particle_random(base, 1, 0.0f, 5.0f);
+    posX[particle] = center.x + radius * std::cos(angle);
+    posZ[particle] = center.z + radius * std::sin(angle);
+    posY[particle] = particle_random(base, 2, center.y, center.y + 1.0f);
+    speed[particle] = particle_random(base, 3, 5.0f, 10.0f);
+    life[particle] = particle_random(base, 4, 0.0f, 1.0f);
+    scale[particle] = particle_random(base, 5, 0.1f, 1.1f);
+}
+
+int ParticleSystem::add_emitter(glm::vec3 center, int count) {
+    int emitter = (int)emitterCenter.size();
+    emitterCenter.push_back(center);
+    if (emitterStart.empty()) {
+        emitterStart.push_back(0);
+        seed = (uint32_t)rand();
+    }
+    int first = emitterStart.back();
+    int total = first + count;
+    emitterStart.push_back(total);
+    posX.resize(total);
+    posY.resize(total);
+    posZ.resize(total);
+    speed.resize(total);
+    life.resize(total);
+    scale.resize(total);
+    particleEmitter.resize(total, emitter);
+    respawns.resize(total, 0);
+    for (int i = first; i < total; i++) {
+        respawn(i);
+    }
+    return emitter;
+}
+
+void ParticleSystem::init(GLuint program, GLuint texture) {
+    programID = program;
+    textureID = texture;
+    glm::vec3 green = glm::vec3(95.0/255.0, 165.0/255.0, 30.0/255.0);
+    GLfloat particle_quad[] = {
+        // Positions         // Texture Coords
+        0.0f, 0.5f, 0.0f,    0.0f, 1.0f,  green.r, green.g, green.b, // Top-left
+        0.25f, 0.0f, 0.0f,    1.0f, 0.0f,  green.r, green.g, green.b,  // Bottom-right
+        0.0f, 0.0f, 0.0f,    0.0f, 0.0f,  green.r, green.g, green.b,  // Bottom-left
+
+        0.0f, 0.5f, 0.0f,    0.0f, 1.0f,  green.r, green.g, green.b,  // Top-left
+        0.25f, 0.5f, 0.0f,    1.0f, 1.0f,  green.r, green.g, green.b,  // Top-right
+        0.25f, 0.0f, 0.0f,    1.0f, 0.0f,  green.r, green.g, green.b,   // Bottom-right
+    };
+
+    glGenVertexArrays(1, &vao);
+    glGenBuffers(1, &quadBuffer);
+    glBindVertexArray(vao);
+    glBindBuffer(GL_ARRAY_BUFFER, quadBuffer);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(particle_quad), particle_quad, GL_STATIC_DRAW);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)0);
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)(3 * sizeof(float)));
+    glEnableVertexAttribArray(2);
+    glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)(5 * sizeof(float)));
+
+    // Position and scale of each particle drawn, refilled every frame
+    glGenBuffers(1, &instanceBuffer);
+    glBindBuffer(GL_ARRAY_BUFFER, instanceBuffer);
+    glBufferData(GL_ARRAY_BUFFER, particles() * sizeof(glm::vec4), NULL, GL_STREAM_DRAW);
+    glEnableVertexAttribArray(3);
+    glVertexAttribPointer(3, 4, GL_FLOAT, GL_FALSE, sizeof(glm::vec4), (void*)0);
+    glVertexAttribDivisor(3, 1);
+    glBindVertexArray(0);
+
+    textureSamplerID = glGetUniformLocation(programID, "tex");
+    viewPosID = glGetUniformLocation(programID, "u_viewPos");
+    mvpMatrixID = glGetUniformLocation(programID, "MVP");
+}
+
+void ParticleSystem::simulate(float time, glm::vec3 centerOffset, int begin, int end) {
+    for (int e = begin; e < end; e++) {
+        emitterCenter[e] += centerOffset;
+    }
+    if (begin >= end) {
+        return;
+    }
+    if (useSimd && PARTICLES_HAVE_SSE2) {
+        simulate_sse2(time, emitterStart[begin], emitterStart[end]);
+    } else {
+        simulate_scalar(time, emitterStart[begin], emitterStart[end]);
+    }
+}
+
+// Live particles rise at half their speed and drift back along z at it
+void ParticleSystem::simulate_scalar(float time, int begin, int end) {
+    for (int i = begin; i < end; i++) {
+        life[i] -= time;
+        if (life[i] > 0.0f) {
+            float step = speed[i] * time;
+            posY[i] += step * 0.5f;
+            posZ[i] -= step;
+        } else {
+            respawn(i);
+        }
+    }
+}
+
+// Same arithmetic as simulate_scalar, four particles at a time. Expired
+// lanes are moved by zero and then respawned one by one, in order, so the
+// random streams match.
+void ParticleSystem::simulate_sse2(float time, int begin, int end) {
+#if PARTICLES_HAVE_SSE2
+    __m128 dt = _mm_set1_ps(time);
+    __m128 half = _mm_set1_ps(0.5f);
+    __m128 zero = _mm_setzero_ps();
+    int i = begin;
+    for (; i + 4 <= end; i += 4) {
+        __m128 remaining = _mm_sub_ps(_mm_loadu_ps(&life[i]), dt);
+        __m128 alive = _mm_cmpgt_ps(remaining, zero);
+        __m128 step = _mm_and_ps(alive, _mm_mul_ps(_mm_loadu_ps(&speed[i]), dt));
+        _mm_storeu_ps(&life[i], remaining);
+        _mm_storeu_ps(&posY[i], _mm_add_ps(_mm_loadu_ps(&posY[i]), _mm_mul_ps(step, half)));
+        _mm_storeu_ps(&posZ[i], _mm_sub_ps(_mm_loadu_ps(&posZ[i]), step));
+        int expired = ~_mm_movemask_ps(alive) & 15;
+        for (int lane = 0; expired != 0; lane++, expired >>= 1) {
+            if (expired & 1) {
+                respawn(i + lane);
+            }
+        }
+    }
+    simulate_scalar(time, i, end);
+#else
+    simulate_scalar(time, begin, end);
+#endif
+}
+
+bool ParticleSystem::enable_gpu(const char *simulationPath) {
+    if (vao == 0 || particles() == 0) {
+        return false;
+    }
+    std::vector<const char *> varyings;
+    varyings.push_back("nextPositionScale");
+    varyings.push_back("nextSpeedLife");
+    varyings.push_back("nextRespawnsEmitter");
+    simulationProgram = ResourceCache::instance().feedbackProgram(simulationPath, varyings);
+    if (simulationProgram->id == 0) {
+        simulationProgram.reset();
+        return false;
+    }
+
+    std::vector<GpuParticle> state(particles());
+    for (int i = 0; i < particles(); i++) {
+        state[i].positionScale = glm::vec4(posX[i], posY[i], posZ[i], scale[i]);
+        state[i].speed = speed[i];
+        state[i].life = life[i];
+        state[i].respawns = respawns[i];
+        state[i].emitter = particleEmitter[i];
+    }
+    glGenBuffers(2, stateBuffers);
+    glGenVertexArrays(2, simulateArrays);
+    glGenVertexArrays(2, drawArrays);
+    for (int b = 0; b < 2; b++) {
+        glBindBuffer(GL_ARRAY_BUFFER, stateBuffers[b]);
+        glBufferData(GL_ARRAY_BUFFER, state.size() * sizeof(GpuParticle), state.data(), GL_DYNAMIC_COPY);
+
+        // Read by the simulation, one vertex per particle
+        glBindVertexArray(simulateArrays[b]);
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, sizeof(GpuParticle), (void*)0);
+        glEnableVertexAttribArray(1);
+        glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(GpuParticle), (void*)offsetof(GpuParticle, speed));
+        glEnableVertexAttribArray(2);
+        glVertexAttribIPointer(2, 2, GL_UNSIGNED_INT, sizeof(GpuParticle), (void*)offsetof(GpuParticle, respawns));
+
+        // Drawn as instances of the quad, like the packed records
+        glBindVertexArray(drawArrays[b]);
+        glBindBuffer(GL_ARRAY_BUFFER, quadBuffer);
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)0);
+        glEnableVertexAttribArray(1);
+        glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)(3 * sizeof(float)));
+        glEnableVertexAttribArray(2);
+        glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)(5 * sizeof(float)));
+        glBindBuffer(GL_ARRAY_BUFFER, stateBuffers[b]);
+        glEnableVertexAttribArray(3);
+        glVertexAttribPointer(3, 4, GL_FLOAT, GL_FALSE, sizeof(GpuParticle), (void*)0);
+        glVertexAttribDivisor(3, 1);
+        glEnableVertexAttribArray(4);
+        glVertexAttribIPointer(4, 1, GL_UNSIGNED_INT, sizeof(GpuParticle), (void*)offsetof(GpuParticle, emitter));
+        glVertexAttribDivisor(4, 1);
+    }
+    glBindVertexArray(0);
+
+    glGenBuffers(1, &emitterBuffer);
+    glGenTextures(1, &emitterTexture);
+    upload_emitters();
+    glBindTexture(GL_TEXTURE_BUFFER, emitterTexture);
+    glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, emitterBuffer);
+    glBindTexture(GL_TEXTURE_BUFFER, 0);
+    currentState = 0;
+    useGpu = true;
+    return true;
+}
+
+// Emitter centres as RGBA32F texels for the simulation and draw shaders
+void ParticleSystem::upload_emitters() {
+    std::vector<glm::vec4> centers(emitters());
+    for (int e = 0; e < emitters(); e++) {
+        centers[e] = glm::vec4(emitterCenter[e], 0.0f);
+    }
+    glBindBuffer(GL_TEXTURE_BUFFER, emitterBuffer);
+    glBufferData(GL_TEXTURE_BUFFER, centers.size() * sizeof(glm::vec4), centers.data(), GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_TEXTURE_BUFFER, 0);
+}
+
+void ParticleSystem::simulate_gpu(float time, glm::vec3 centerOffset) {
+    if (!useGpu) {
+        return;
+    }
+    if (centerOffset != glm::vec3(0.0f)) {
+        for (glm::vec3 &center : emitterCenter) {
+            center += centerOffset;
+        }
+        upload_emitters();
+    }
+    GLuint program = simulationProgram->id;
+    glUseProgram(program);
+    glUniform1f(glGetUniformLocation(program, "time"), time);
+    glUniform1ui(glGetUniformLocation(program, "seed"), seed);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_BUFFER, emitterTexture);
+    glUniform1i(glGetUniformLocation(program, "emitterCenters"), 0);
+    glEnable(GL_RASTERIZER_DISCARD);
+    glBindVertexArray(simulateArrays[currentState]);
+    glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, stateBuffers[1 - currentState]);
+    glBeginTransformFeedback(GL_POINTS);
+    glDrawArrays(GL_POINTS, 0, particles());
+    glEndTransformFeedback();
+    glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, 0);
+    glBindVertexArray(0);
+    glDisable(GL_RASTERIZER_DISCARD);
+    currentState = 1 - currentState;
+}
+
+void ParticleSystem::read_gpu_state() {
+    if (!useGpu) {
+        return;
+    }
+    std::vector<GpuParticle> state(particles());
+    glBindBuffer(GL_ARRAY_BUFFER, stateBuffers[currentState]);
+    glGetBufferSubData(GL_ARRAY_BUFFER, 0, state.size() * sizeof(GpuParticle), state.data());
+    for (int i = 0; i < particles(); i++) {
+        posX[i] = state[i].positionScale.x;
+        posY[i] = state[i].positionScale.y;
+        posZ[i] = state[i].positionScale.z;
+        scale[i] = state[i].positionScale.w;
+        speed[i] = state[i].speed;
+        life[i] = state[i].life;
+        respawns[i] = state[i].respawns;
+    }
+}
+
+int ParticleSystem::pack_instances(const glm::mat4 &mvp, glm::vec2 rangeCenter, glm::vec2 rangeExtent) {
+    inRange.assign(emitters(), 0);
+    for (int e = 0; e < emitters(); e++) {
+        const glm::vec3 &center = emitterCenter[e];
+        inRange[e] = std::abs(center.x - rangeCenter.x) <= rangeExtent.x && std::abs(center.z - rangeCenter.y) <= rangeExtent.y;
+    }
+    visible.clear();
+    if (!sortByDepth) {
+        for (int e = 0; e < emitters(); e++) {
+            for (int i = emitterStart[e]; inRange[e] && i < emitterStart[e + 1]; i++) {
+                visible.push_back(glm::vec4(posX[i], posY[i], posZ[i], scale[i]));
+            }
+        }
+        return (int)visible.size();
+    }
+
+    // Keys for every particle in range, in memory order. Clip z grows with
+    // the distance from the camera under both perspective and orthographic
+    // projections; keys are 16 bits over the depth range, 0 the farthest.
+    float zx = mvp[0][2], zy = mvp[1][2], zz = mvp[2][2];
+    particleDepth.resize(particles());
+    float nearest = 1e30f, farthest = -1e30f;
+    for (int e = 0; e < emitters(); e++) {
+        for (int i = emitterStart[e]; inRange[e] && i < emitterStart[e + 1]; i++) {
+            float z = zx * posX[i] + zy * posY[i] + zz * posZ[i];
+            particleDepth[i] = z;
+            nearest = std::min(nearest, z);
+            farthest = std::max(farthest, z);
+        }
+    }
+    float quantize = farthest > nearest ? 65535.0f / (farthest - nearest) : 0.0f;
+    order.clear();
+    keys.clear();
+    unsigned int bucketEnd[256] = {};
+    for (int e = 0; e < emitters(); e++) {
+        for (int i = emitterStart[e]; inRange[e] && i < emitterStart[e + 1]; i++) {
+            uint16_t key = (uint16_t)((farthest - particleDepth[i]) * quantize);
+            order.push_back((uint32_t)i);
+            keys.push_back(key);
+            bucketEnd[key >> 8]++;
+        }
+    }
+    size_t count = order.size();
+    visible.resize(count);
+    drawOrder.resize(count);
+
+    // Most significant byte first, into 256 buckets. Then each bucket,
+    // small enough to stay in cache, by its low byte into the draw order.
+    // Both passes are stable.
+    unsigned int bucketStart[256];
+    unsigned int offset = 0;
+    for (int b = 0; b < 256; b++) {
+        bucketStart[b] = offset;
+        offset += bucketEnd[b];
+        bucketEnd[b] = bucketStart[b];
+    }
+    sortedPairs.resize(count);
+    for (size_t n = 0; n < count; n++) {
+        sortedPairs[bucketEnd[keys[n] >> 8]++] = (uint64_t)keys[n] << 32 | order[n];
+    }
+    for (int b = 0; b < 256; b++) {
+        unsigned int low[256] = {};
+        for (unsigned int n = bucketStart[b]; n < bucketEnd[b]; n++) {
+            low[(sortedPairs[n] >> 32) & 255]++;
+        }
+        unsigned int slot = bucketStart[b];
+        for (int l = 0; l < 256; l++) {
+            unsigned int bucket = low[l];
+            low[l] = slot;
+            slot += bucket;
+        }
+        for (unsigned int n = bucketStart[b]; n < bucketEnd[b]; n++) {
+            drawOrder[low[(sortedPairs[n] >> 32) & 255]++] = (uint32_t)sortedPairs[n];
+        }
+    }
+    // The records in the sorted order, straight into the upload array
+    for (size_t n = 0; n < count; n++) {
+        uint32_t i = drawOrder[n];
+        visible[n] = glm::vec4(posX[i], posY[i], posZ[i], scale[i]);
+    }
+    return (int)count;
+}
+
+void ParticleSystem::render(const glm::mat4 &mvp, glm::vec3 cameraPosition, glm::vec2 rangeCenter, glm::vec2 rangeExtent) {
+    if (useGpu && !(sortByDepth && readBackToSort)) {
+        // Only the count is worked out here, the vertex shader culls
+        particlesDrawn = 0;
+        for (int e = 0; e < emitters(); e++) {
+            const glm::vec3 &center = emitterCenter[e];
+            if (std::abs(center.x - rangeCenter.x) <= rangeExtent.x && std::abs(center.z - rangeCenter.y) <= rangeExtent.y) {
+                particlesDrawn += emitterStart[e + 1] - emitterStart[e];
+            }
+        }
+        bytesUploaded = 0;
+        glEnable(GL_BLEND);
+        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+        glUseProgram(programID);
+        glBindVertexArray(drawArrays[currentState]);
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, textureID);
+        glUniform1i(textureSamplerID, 0);
+        glActiveTexture(GL_TEXTURE0 + 1);
+        glBindTexture(GL_TEXTURE_BUFFER, emitterTexture);
+        glUniform1i(glGetUniformLocation(programID, "emitterCenters"), 1);
+        glUniform1i(glGetUniformLocation(programID, "cullRange"), 1);
+        glUniform2fv(glGetUniformLocation(programID, "rangeCenter"), 1, &rangeCenter[0]);
+        glUniform2fv(glGetUniformLocation(programID, "rangeExtent"), 1, &rangeExtent[0]);
+        glUniformMatrix4fv(mvpMatrixID, 1, GL_FALSE, &mvp[0][0]);
+        glUniform3fv(viewPosID, 1, &cameraPosition[0]);
+        glDrawArraysInstanced(GL_TRIANGLES, 0, 6, particles());
+        glBindVertexArray(0);
+        glDisable(GL_BLEND);
+        return;
+    }
+
+    if (useGpu) {
+        // Sorting needs the positions on the CPU, which waits for the step
+        read_gpu_state();
+    }
+    particlesDrawn = pack_instances(mvp, rangeCenter, rangeExtent);
+    bytesUploaded = visible.size() * sizeof(glm::vec4);
+    if (visible.empty() || vao == 0) {
+        return;
+    }
+    // Respecified whole, so the driver can hand out fresh storage rather
+    // than wait for last frame's draw
+    glBindBuffer(GL_ARRAY_BUFFER, instanceBuffer);
+    glBufferData(GL_ARRAY_BUFFER, bytesUploaded, visible.data(), GL_STREAM_DRAW);
+
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    glUseProgram(programID);
+    glBindVertexArray(vao);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, textureID);
+    glUniform1i(textureSamplerID, 0);
+    // The unused buffer sampler still may not share unit 0 with tex
+    glUniform1i(glGetUniformLocation(programID, "emitterCenters"), 1);
+    glUniform1i(glGetUniformLocation(programID, "cullRange"), 0);
+    glUniformMatrix4fv(mvpMatrixID, 1, GL_FALSE, &mvp[0][0]);
+    glUniform3fv(viewPosID, 1, &cameraPosition[0]);
+    glDrawArraysInstanced(GL_TRIANGLES, 0, 6, particlesDrawn);
+    glBindVertexArray(0);
+    glDisable(GL_BLEND);
+}
@@ -0,0 +1,117 @@
+#ifndef PARTICLE_SYSTEM_H
+#define PARTICLE_SYSTEM_H
+
+#include <glad/gl.h>
+#include <glm/glm.hpp>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "resource_cache.h"
+
+// Every emitter's particles in one system. State is kept as parallel arrays
+// with each emitter's particles contiguous, the update runs four particles
+// per SSE2 step, and render() packs the particles of the emitters in range
+// into one instance buffer of (position, scale) records: one upload and one
+// instanced draw a frame, whatever the emitter count. The records are
+// ordered back to front for the alpha blending: a stable two-pass radix
+// sort on quantized depth, high byte then low byte within each bucket, that
+// writes the sorted records straight into the upload array.
+//
+// With enable_gpu() the state moves to two buffers instead, and
+// simulate_gpu() advances it from one into the other by transform feedback.
+// render() then draws straight from the newest buffer, unsorted, culling by
+// range in the vertex shader. Only with readBackToSort as well as
+// sortByDepth does render() read the newest buffer back and pack it sorted
+// as above, which waits for the step every frame. Respawns draw from a hash
+// of the particle, its respawn count and the system seed, so both paths
+// produce the same particles.
+class ParticleSystem
+{
+public:
+    // Particle state, particle i belonging to emitter particleEmitter[i]
+    std::vector<float> posX, posY, posZ;
+    std::vector<float> speed;
+    std::vector<float> life;
+    std::vector<float> scale;
+    std::vector<int> particleEmitter;
+    std::vector<uint32_t> respawns;
+    // Emitter e owns particles emitterStart[e] to emitterStart[e + 1]
+    std::vector<glm::vec3> emitterCenter;
+    std::vector<int> emitterStart;
+    uint32_t seed = 0;                  // From rand() at the first emitter
+    bool useSimd = true;
+    bool sortByDepth = true;
+
+    GLuint vao = 0;
+    GLuint quadBuffer = 0;
+    GLuint instanceBuffer = 0;
+    GLuint programID = 0;
+    GLuint textureID = 0;
+    GLuint textureSamplerID;
+    GLuint mvpMatrixID;
+    GLuint viewPosID;
+    // GPU simulation state: interleaved particles, see enable_gpu()
+    bool useGpu = false;
+    bool readBackToSort = false;        // Sort GPU particles too, see above
+    int currentState = 0;
+    GLuint stateBuffers[2] = { 0, 0 };
+    GLuint simulateArrays[2] = { 0, 0 };
+    GLuint drawArrays[2] = { 0, 0 };
+    GLuint emitterBuffer = 0;
+    GLuint emitterTexture = 0;
+    std::shared_ptr<GLProgram> simulationProgram;
+    // Last render(): particles drawn and bytes uploaded
+    int particlesDrawn = 0;
+    size_t bytesUploaded = 0;
+
+    ParticleSystem() {}
+    // Deletes the GL objects, so must run while the context is current
+    ~ParticleSystem();
+
+    // Spawns count particles around center, returns the emitter index. No GL.
+    int add_emitter(glm::vec3 center, int count);
+    int emitters() const { return (int)emitterCenter.size(); }
+    int particles() const { return (int)posX.size(); }
+    // Creates the quad and instance buffer once the emitters are added
+    void init(GLuint program, GLuint texture);
+    // Moves emitters [begin, end) by centerOffset and their particles by
+    // time, respawning the expired ones. CPU only.
+    void simulate(float time, glm::vec3 centerOffset, int begin, int end);
+    // Moves the state to the GPU, after init(). False if the simulation
+    // program does not build, leaving the CPU path in use.
+    bool enable_gpu(const char *simulationPath);
+    // Every emitter moved by centerOffset and every particle by time
+    void simulate_gpu(float time, glm::vec3 centerOffset);
+    // Copies the GPU state back into the arrays, for sorting and checks
+    void read_gpu_state();
+    // Draws the particles of emitters whose centre is within rangeExtent of
+    // rangeCenter on x and z
+    void render(const glm::mat4 &mvp, glm::vec3 cameraPosition, glm::vec2 rangeCenter, glm::vec2 rangeExtent);
+    // The CPU half of render(): fills instances() with the (position, scale)
+    // records of the particles in range, farthest first under mvp if
+    // sortByDepth. No GL.
+    int pack_instances(const glm::mat4 &mvp, glm::vec2 rangeCenter, glm::vec2 rangeExtent);
+    const std::vector<glm::vec4> &instances() const { return visible; }
+
+private:
+    std::vector<glm::vec4> visible;
+    // Sort scratch: which emitters are in range, depth by particle, the
+    // particles in range and their keys in memory order, (key, particle)
+    // pairs after the first pass, and the particles in draw order
+    std::vector<char> inRange;
+    std::vector<float> particleDepth;
+    std::vector<uint32_t> order;
+    std::vector<uint16_t> keys;
+    std::vector<uint64_t> sortedPairs;
+    std::vector<uint32_t> drawOrder;
+
+    void upload_emitters();
+    void respawn(int particle);
+    void simulate_scalar(float time, int begin, int end);
+    void simulate_sse2(float time, int begin, int end);
+
+    ParticleSystem(const ParticleSystem&) = delete;
+    ParticleSystem& operator=(const ParticleSystem&) = delete;
+};
+
+#endif
@@ -168,6 +168,75 @@ GLuint LoadShadersFromFile(const char *vertex_file_path, const char *fragment_fi
 	return ProgramID;
 }
 
+GLuint LoadTransformFeedbackShaderFromFile(const char *vertex_file_path, const char *const *varyings, int varying_count)
+{
+	GLuint VertexShaderID = glCreateShader(GL_VERTEX_SHADER);
+
+	// Read the Vertex Shader code from the file
+	std::string VertexShaderCode;
+	std::ifstream VertexShaderStream(vertex_file_path, std::ios::in);
+	if (VertexShaderStream.is_open())
+	{
+		std::stringstream sstr;
+		sstr << VertexShaderStream.rdbuf();
+		VertexShaderCode = sstr.str();
+		VertexShaderStream.close();
+	}
+	else
+	{
+		printf("Vertex shader not found %s.\n", vertex_file_path);
+		return 0;
+	}
+
+	GLint Result = GL_FALSE;
+	int InfoLogLength;
+
+	// Compile Vertex Shader
+	printf("Compiling vertex shader : %s\n", vertex_file_path);
+	char const *VertexSourcePointer = VertexShaderCode.c_str();
+	glShaderSource(VertexShaderID, 1, &VertexSourcePointer, NULL);
+	glCompileShader(VertexShaderID);
+
+	// Check Vertex Shader
+	glGetShaderiv(VertexShaderID, GL_COMPILE_STATUS, &Result);
+	if (!Result) {
+		printf("Error compiling vertex shader : %s\n", vertex_file_path);
+		glGetShaderiv(VertexShaderID, GL_INFO_LOG_LENGTH, &InfoLogLength);
+		if (InfoLogLength > 0) {
+			std::vector<char> VertexShaderErrorMessage(InfoLogLength + 1);
+			glGetShaderInfoLog(VertexShaderID, InfoLogLength, NULL, &VertexShaderErrorMessage[0]);
+			printf("%s\n", &VertexShaderErrorMessage[0]);
+		}
+		return 0;
+	}
+
+	// The captured outputs have to be named before linking
+	printf("Linking program\n");
+	GLuint ProgramID = glCreateProgram();
+	glAttachShader(ProgramID, VertexShaderID);
+	glTransformFeedbackVaryings(ProgramID, varying_count, varyings, GL_INTERLEAVED_ATTRIBS);
+	glLinkProgram(ProgramID);
+
+	// Check the program
+	glGetProgramiv(ProgramID, GL_LINK_STATUS, &Result);
+	if (!Result) {
+		printf("Error linking program\n");
+		glGetProgramiv(ProgramID, GL_INFO_LOG_LENGTH, &InfoLogLength);
+		if (InfoLogLength > 0)
+		{
+			std::vector<char> ProgramErrorMessage(InfoLogLength + 1);
+			glGetProgramInfoLog(ProgramID, InfoLogLength, NULL, &ProgramErrorMessage[0]);
+			printf("%s\n", &ProgramErrorMessage[0]);
+		}
+		return 0;
+	}
+
+	glDetachShader(ProgramID, VertexShaderID);
+	glDeleteShader(VertexShaderID);
+
+	return ProgramID;
+}
+
 GLuint LoadShadersFromString(std::string VertexShaderCode, std::string FragmentShaderCode)
 {
 	// Create the shaders
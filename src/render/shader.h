@@ -6,6 +6,10 @@
 
 GLuint LoadShadersFromFile(const char *vertex_file_path, const char *fragment_file_path,  const char *geometry_file_path = nullptr);
 
+// Vertex-only program whose outputs, named by varyings, are captured
+// interleaved by transform feedback
+GLuint LoadTransformFeedbackShaderFromFile(const char *vertex_file_path, const char *const *varyings, int varying_count);
+
 GLuint LoadShadersFromString(std::string VertexShaderCode, std::string FragmentShaderCode);
 
 #endif
@@ -0,0 +1,317 @@
+#include "resource_cache.h"
+#include "baked_model.h"
+#include <render/shader.h>
+#include <json.hpp>
+
+#include <cstring>
+#include <iostream>
+
+GLProgram::~GLProgram() {
+    glDeleteProgram(id);
+}
+
+GLTexture::~GLTexture() {
+    glDeleteTextures(1, &id);
+}
+
+ModelResource::~ModelResource() {
+    for (std::map<int, GLuint>::iterator it = bufferObjects.begin(); it != bufferObjects.end(); ++it) {
+        glDeleteBuffers(1, &it->second);
+    }
+}
+
+static std::string directory_of(const std::string &path) {
+    size_t slash = path.find_last_of("/\\");
+    return slash == std::string::npos ? "" : path.substr(0, slash);
+}
+
+// Loads .glb files through a read-only mapping. tinygltf would copy the
+// BIN chunk into model.buffers[0], so when the file has exactly one buffer,
+// the BIN chunk, the JSON is handed over without it. Buffer 0 is then added
+// back empty, as for baked models, and buffer_bytes(0) reads the mapping.
+// Any other layout takes tinygltf's copying path.
+bool ModelResource::load_binary(const std::string &filename, std::string &err, std::string &warn) {
+    std::shared_ptr<MappedFile> file(new MappedFile());
+    if (!file->open(filename) || file->size() < 28) {
+        err = "Cannot map " + filename;
+        return false;
+    }
+    const unsigned char *bytes = file->data();
+    uint32_t header[5];
+    std::memcpy(header, bytes, sizeof(header));
+    uint32_t jsonLength = header[3];
+    if (std::memcmp(bytes, "glTF", 4) != 0 || header[1] != 2 || header[2] > file->size()
+        || header[4] != 0x4E4F534A || 20 + (size_t)jsonLength + 8 > header[2]) {
+        err = "Invalid glTF binary header";
+        return false;
+    }
+    uint32_t binLength, binType;
+    std::memcpy(&binLength, bytes + 20 + jsonLength, 4);
+    std::memcpy(&binType, bytes + 24 + jsonLength, 4);
+    const unsigned char *bin = bytes + 28 + jsonLength;
+    if (binType != 0x004E4942 || 28 + (size_t)jsonLength + binLength > header[2]) {
+        err = "Invalid glTF binary BIN chunk";
+        return false;
+    }
+
+    // Images stored in buffer views are decoded while parsing and Draco
+    // meshes decode into new buffers, both need the real buffer
+    const char *json = (const char *)bytes + 20;
+    nlohmann::json document = nlohmann::json::parse(json, json + jsonLength, nullptr, false);
+    nlohmann::json::const_iterator buffers = document.is_object() ? document.find("buffers") : document.end();
+    bool mapBuffer = buffers != document.end() && buffers->is_array() && buffers->size() == 1
+        && (*buffers)[0].is_object() && (*buffers)[0].count("uri") == 0
+        && (*buffers)[0].count("byteLength") && (*buffers)[0]["byteLength"].is_number_unsigned()
+        && (*buffers)[0]["byteLength"].get<uint64_t>() <= binLength;
+    nlohmann::json::const_iterator images = mapBuffer ? document.find("images") : document.end();
+    if (images != document.end() && images->is_array()) {
+        for (const nlohmann::json &image : *images) {
+            mapBuffer = mapBuffer && !(image.is_object() && image.count("bufferView"));
+        }
+    }
+    nlohmann::json::const_iterator extensions = mapBuffer ? document.find("extensionsUsed") : document.end();
+    if (extensions != document.end() && extensions->is_array()) {
+        for (const nlohmann::json &extension : *extensions) {
+            mapBuffer = mapBuffer && extension != "KHR_draco_mesh_compression";
+        }
+    }
+
+    tinygltf::TinyGLTF loader;
+    bool res;
+    if (mapBuffer) {
+        std::string name = (*buffers)[0].count("name") && (*buffers)[0]["name"].is_string() ? (*buffers)[0]["name"].get<std::string>() : "";
+        document.erase("buffers");
+        std::string stripped = document.dump();
+        res = loader.LoadASCIIFromString(&model, &err, &warn, stripped.c_str(), stripped.size(), directory_of(filename));
+        if (res) {
+            model.buffers.resize(1);
+            model.buffers[0].name = name;
+            mappedFile = file;
+            mappedBuffer = bin;
+        }
+    } else {
+        res = loader.LoadBinaryFromMemory(&model, &err, &warn, bytes, file->size());
+    }
+    return res;
+}
+
+bool ModelResource::load_baked(const std::string &filename) {
+    std::string bakedPath = baked_model_path(filename);
+    std::shared_ptr<MappedFile> file(new MappedFile());
+    std::vector<uint32_t> pixelOffsets;
+    if (!file->open(bakedPath) || !read_baked_model(*file, filename, model, positionScale, positionOffset, pixelOffsets)) {
+        model = tinygltf::Model();
+        return false;
+    }
+    mappedFile = file;
+    mappedBuffer = file->data();
+    baked = true;
+    for (size_t i = 0; i < pixelOffsets.size(); i++) {
+        imagePixels.push_back(pixelOffsets[i] ? file->data() + pixelOffsets[i] : NULL);
+    }
+    std::cout << "Loaded baked model: " << bakedPath << std::endl;
+    return true;
+}
+
+bool ModelResource::load(const std::string &filename, bool allowBaked) {
+    path = filename;
+    if (allowBaked && load_baked(filename)) {
+        return true;
+    }
+    std::string err;
+    std::string warn;
+
+    bool res;
+    if (filename.size() > 4 && filename.compare(filename.size() - 4, 4, ".glb") == 0) {
+        res = load_binary(filename, err, warn);
+    } else {
+        tinygltf::TinyGLTF loader;
+        res = loader.LoadASCIIFromFile(&model, &err, &warn, filename);
+    }
+    if (!warn.empty()) {
+        std::cout << "WARN: " << warn << std::endl;
+    }
+    if (!err.empty()) {
+        std::cout << "ERR: " << err << std::endl;
+    }
+    if (!res)
+        std::cout << "Failed to load glTF: " << filename << std::endl;
+    else
+        std::cout << "Loaded glTF: " << filename << std::endl;
+    for (size_t i = 0; i < model.images.size(); i++) {
+        imagePixels.push_back(model.images[i].image.empty() ? NULL : &model.images[i].image[0]);
+    }
+    return res;
+}
+
+const unsigned char *ModelResource::buffer_bytes(int buffer) const {
+    if (buffer == 0 && mappedBuffer != NULL) {
+        return mappedBuffer;
+    }
+    return model.buffers[buffer].data.data();
+}
+
+
+ResourceCache &ResourceCache::instance() {
+    static ResourceCache cache;
+    return cache;
+}
+
+std::shared_ptr<ModelResource> ResourceCache::model(const std::string &path) {
+    std::shared_ptr<ModelResource> resource = models[path].lock();
+    if (resource) {
+        modelHits++;
+        return resource;
+    }
+    modelMisses++;
+    resource.reset(new ModelResource());
+    if (!resource->load(path, useBakedModels)) {
+        models.erase(path);
+        return std::shared_ptr<ModelResource>();
+    }
+    tinygltf::Model &model = resource->model;
+
+    // The bufferView with target == 0 in our models holds the inverse bind
+    // matrices, which are only read on the CPU
+    for (size_t i = 0; i < model.bufferViews.size(); ++i) {
+        const tinygltf::BufferView &bufferView = model.bufferViews[i];
+        if (bufferView.target == 0) {
+            continue;
+        }
+        // Straight from the file mapping for .glb and baked models
+        GLuint vbo;
+        glGenBuffers(1, &vbo);
+        glBindBuffer(bufferView.target, vbo);
+        glBufferData(bufferView.target, bufferView.byteLength,
+                     resource->buffer_bytes(bufferView.buffer) + bufferView.byteOffset, GL_STATIC_DRAW);
+        resource->bufferObjects[i] = vbo;
+        resource->bufferBytes += bufferView.byteLength;
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    // Embedded images are named after the model, external ones by file, so
+    // models pointing at the same file share the texture
+    std::string directory = directory_of(path);
+    for (size_t i = 0; i < model.images.size(); ++i) {
+        tinygltf::Image &image = model.images[i];
+        std::string source = image.uri.empty() || image.uri.compare(0, 5, "data:") == 0
+            ? path + "#image" + std::to_string(i)
+            : (directory.empty() ? image.uri : directory + "/" + image.uri);
+        resource->images.push_back(texture(source, image, resource->imagePixels[i]));
+        // The pixels live on the GPU from here on
+        std::vector<unsigned char>().swap(image.image);
+    }
+    resource->imagePixels.clear();
+
+    models[path] = resource;
+    return resource;
+}
+
+std::shared_ptr<GLProgram> ResourceCache::program(const char *vertexPath, const char *fragmentPath, const char *geometryPath) {
+    std::string key = std::string(vertexPath) + "|" + fragmentPath + "|" + (geometryPath ? geometryPath : "");
+    std::shared_ptr<GLProgram> program = programs[key].lock();
+    if (program) {
+        programHits++;
+        return program;
+    }
+    programMisses++;
+    program.reset(new GLProgram());
+    program->id = LoadShadersFromFile(vertexPath, fragmentPath, geometryPath);
+    if (program->id == 0) {
+        programs.erase(key);
+        return program;
+    }
+    programs[key] = program;
+    return program;
+}
+
+std::shared_ptr<GLProgram> ResourceCache::feedbackProgram(const char *vertexPath, const std::vector<const char *> &varyings) {
+    std::string key = std::string(vertexPath) + "|feedback";
+    for (const char *varying : varyings) {
+        key += std::string("|") + varying;
+    }
+    std::shared_ptr<GLProgram> program = programs[key].lock();
+    if (program) {
+        programHits++;
+        return program;
+    }
+    programMisses++;
+    program.reset(new GLProgram());
+    program->id = LoadTransformFeedbackShaderFromFile(vertexPath, varyings.data(), varyings.size());
+    if (program->id == 0) {
+        programs.erase(key);
+        return program;
+    }
+    programs[key] = program;
+    return program;
+}
+
+std::shared_ptr<GLTexture> ResourceCache::texture(const std::string &source, const tinygltf::Image &image, const unsigned char *pixels) {
+    std::shared_ptr<GLTexture> texture = textures[source].lock();
+    if (texture) {
+        textureHits++;
+        return texture;
+    }
+    textureMisses++;
+    texture.reset(new GLTexture());
+    textures[source] = texture;
+    if (pixels == NULL) {
+        return texture;
+    }
+
+    glGenTextures(1, &texture->id);
+    glBindTexture(GL_TEXTURE_2D, texture->id);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+
+    GLenum format = GL_RGBA;
+    if (image.component == 1) {
+        format = GL_RED;
+    } else if (image.component == 2) {
+        format = GL_RG;
+    } else if (image.component == 3) {
+        format = GL_RGB;
+    }
+
+    GLenum type = GL_UNSIGNED_BYTE;
+    if (image.bits == 16) {
+        type = GL_UNSIGNED_SHORT;
+    }
+
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, image.width, image.height, 0,
+                 format, type, pixels);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    texture->bytes = (size_t)image.width * image.height * 4;
+    return texture;
+}
+
+template <typename T>
+static int count_live(const std::map<std::string, std::weak_ptr<T> > &entries) {
+    int live = 0;
+    for (typename std::map<std::string, std::weak_ptr<T> >::const_iterator it = entries.begin(); it != entries.end(); ++it) {
+        live += !it->second.expired();
+    }
+    return live;
+}
+
+int ResourceCache::live_models() const {
+    return count_live(models);
+}
+
+int ResourceCache::live_programs() const {
+    return count_live(programs);
+}
+
+int ResourceCache::live_textures() const {
+    return count_live(textures);
+}
+
+void ResourceCache::log_stats() const {
+    std::cout << "Resource cache: models " << modelHits << " hits, " << modelMisses << " misses; programs "
+              << programHits << " hits, " << programMisses << " misses; textures " << textureHits << " hits, "
+              << textureMisses << " misses" << std::endl;
+}
@@ -0,0 +1,115 @@
+#ifndef RESOURCE_CACHE_H
+#define RESOURCE_CACHE_H
+
+#include <glad/gl.h>
+#include <tiny_gltf.h>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include "mapped_file.h"
+
+// Linked GL program, deleted with its last handle
+struct GLProgram {
+    GLuint id = 0;
+
+    GLProgram() {}
+    ~GLProgram();
+
+private:
+    GLProgram(const GLProgram&) = delete;
+    GLProgram& operator=(const GLProgram&) = delete;
+};
+
+// 2D texture, deleted with its last handle
+struct GLTexture {
+    GLuint id = 0;
+    size_t bytes = 0;
+
+    GLTexture() {}
+    ~GLTexture();
+
+private:
+    GLTexture(const GLTexture&) = delete;
+    GLTexture& operator=(const GLTexture&) = delete;
+};
+
+// A parsed glTF file and its GPU copies: one buffer object per buffer view
+// with a target and one texture per image. Entities of the same file share
+// it and only create their own VAOs and instance buffers.
+struct ModelResource {
+    std::string path;
+    tinygltf::Model model;
+    // BIN chunk of a .glb model, or the whole baked blob, read in place from
+    // the file mapping
+    std::shared_ptr<MappedFile> mappedFile;
+    const unsigned char *mappedBuffer = NULL;
+    bool baked = false;
+    // Baked positions are normalized shorts, the vertex shaders decode them
+    // as positionOffset + positionScale * position
+    float positionScale[3] = { 1, 1, 1 };
+    float positionOffset[3] = { 0, 0, 0 };
+    // RGBA pixels of each image until they are uploaded
+    std::vector<const unsigned char *> imagePixels;
+    std::map<int, GLuint> bufferObjects;
+    std::vector<std::shared_ptr<GLTexture> > images;
+    size_t bufferBytes = 0;
+
+    ModelResource() {}
+    ~ModelResource();
+
+    // Parses the file, .glb through a read-only mapping. With allowBaked an
+    // up to date blob from asset_baker is used instead. No GL calls.
+    bool load(const std::string &filename, bool allowBaked = true);
+    // Bytes of a glTF buffer, wherever they live. A mapped buffer 0 leaves
+    // model.buffers[0].data empty.
+    const unsigned char *buffer_bytes(int buffer) const;
+
+private:
+    bool load_binary(const std::string &filename, std::string &err, std::string &warn);
+    bool load_baked(const std::string &filename);
+
+    ModelResource(const ModelResource&) = delete;
+    ModelResource& operator=(const ModelResource&) = delete;
+};
+
+// Process-wide cache of models by path, programs by shader paths and
+// textures by image source. It only keeps weak references: callers hold the
+// shared_ptr handles, and GL objects go away with the last of them.
+// Not thread safe, like every other GL call in the scene.
+class ResourceCache
+{
+public:
+    int modelHits = 0, modelMisses = 0;
+    int programHits = 0, programMisses = 0;
+    int textureHits = 0, textureMisses = 0;
+    // Prefer asset_baker blobs over parsing glTF
+    bool useBakedModels = true;
+
+    static ResourceCache &instance();
+
+    std::shared_ptr<ModelResource> model(const std::string &path);
+    std::shared_ptr<GLProgram> program(const char *vertexPath, const char *fragmentPath, const char *geometryPath = nullptr);
+    // Vertex-only program capturing the named outputs by transform feedback
+    std::shared_ptr<GLProgram> feedbackProgram(const char *vertexPath, const std::vector<const char *> &varyings);
+    // source names the image, e.g. its resolved file path; pixels holds
+    // image.component channels of image.bits each
+    std::shared_ptr<GLTexture> texture(const std::string &source, const tinygltf::Image &image, const unsigned char *pixels);
+
+    // Resources that still have at least one handle
+    int live_models() const;
+    int live_programs() const;
+    int live_textures() const;
+    void log_stats() const;
+
+private:
+    std::map<std::string, std::weak_ptr<ModelResource> > models;
+    std::map<std::string, std::weak_ptr<GLProgram> > programs;
+    std::map<std::string, std::weak_ptr<GLTexture> > textures;
+
+    ResourceCache() {}
+    ResourceCache(const ResourceCache&) = delete;
+    ResourceCache& operator=(const ResourceCache&) = delete;
+};
+
+#endif
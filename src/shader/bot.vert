@@ -16,26 +16,86 @@ out vec4 lightSpaceView;
 
 uniform mat4 u_model;
 uniform mat4 MVP;
-uniform mat4 jointMat[100];
 uniform bool isSkinning;
 uniform mat4 lightSpaceMatrix;
+// Baked models store positions as normalized shorts
+uniform vec3 positionScale = vec3(1.0);
+uniform vec3 positionOffset = vec3(0.0);
+
+// Joint palette: the rows of each joint matrix's 3x4 affine part, three
+// texels per joint
+uniform samplerBuffer jointPalette;
+
+mat4 jointSkin(vec4 joints, vec4 weights) {
+    vec4 row0 = vec4(0.0);
+    vec4 row1 = vec4(0.0);
+    vec4 row2 = vec4(0.0);
+    for (int i = 0; i < 4; i++) {
+        int texel = int(joints[i]) * 3;
+        row0 += weights[i] * texelFetch(jointPalette, texel);
+        row1 += weights[i] * texelFetch(jointPalette, texel + 1);
+        row2 += weights[i] * texelFetch(jointPalette, texel + 2);
+    }
+    float weight = weights.x + weights.y + weights.z + weights.w;
+    return transpose(mat4(row0, row1, row2, vec4(0.0, 0.0, 0.0, weight)));
+}
+
+// Animation palette: joint matrices of every clip, one texture row per
+// frame and four texels per joint, and a closing row per clip. Each instance
+// plays its own clip from its own time offset.
+layout(location = 9) in vec2 instanceAnimation;
+uniform bool usePalette;
+uniform sampler2D animationPalette;
+uniform float animationTime;
+uniform int paletteClipStart[8];
+uniform int paletteClipFrames[8];
+uniform float paletteClipDuration[8];
+
+mat4 paletteJoint(int frame, int joint) {
+    return mat4(texelFetch(animationPalette, ivec2(joint * 4, frame), 0),
+                texelFetch(animationPalette, ivec2(joint * 4 + 1, frame), 0),
+                texelFetch(animationPalette, ivec2(joint * 4 + 2, frame), 0),
+                texelFetch(animationPalette, ivec2(joint * 4 + 3, frame), 0));
+}
+
+// Skin matrix blended between the two frames around the instance's time
+mat4 paletteSkin(vec4 joints, vec4 weights) {
+    int clip = int(instanceAnimation.x);
+    int frames = paletteClipFrames[clip];
+    float position = mod((animationTime + instanceAnimation.y) / paletteClipDuration[clip], 1.0) * float(frames);
+    int frame = min(int(position), frames - 1);
+    int row0 = paletteClipStart[clip] + frame;
+    int row1 = row0 + 1;
+    float t = position - float(frame);
+    mat4 skin = mat4(0.0);
+    for (int i = 0; i < 4; i++) {
+        int joint = int(joints[i]);
+        skin += weights[i] * ((1.0 - t) * paletteJoint(row0, joint) + t * paletteJoint(row1, joint));
+    }
+    return skin;
+}
 
 void main() {
+    vec3 localPosition = positionOffset + positionScale * vertexPosition;
     // Transform vertex
     mat4 skinMat = mat4(1.0);
     
-    if(isSkinning) {
-        skinMat = 
-        a_weight.x * jointMat[int(a_joint.x)] +
-        a_weight.y * jointMat[int(a_joint.y)] +
-        a_weight.z * jointMat[int(a_joint.z)] +
-        a_weight.w * jointMat[int(a_joint.w)];
+    if(isSkinning && usePalette) {
+        skinMat = paletteSkin(a_joint, a_weight);
+    } else if(isSkinning) {
+        skinMat = jointSkin(a_joint, a_weight);
     }
-    gl_Position =  MVP *  instanceMatrix * u_model * skinMat * vec4(vertexPosition, 1.0);
+    gl_Position =  MVP *  instanceMatrix * u_model * skinMat * vec4(localPosition, 1.0);
 
     // World-space geometry 
-    fragPos = vec3(instanceMatrix * u_model * skinMat * vec4(vertexPosition, 1.0));
-    vertexNorm = transpose(inverse(mat3(skinMat * instanceMatrix))) * vertexNormal;
+    fragPos = vec3(instanceMatrix * u_model * skinMat * vec4(localPosition, 1.0));
+    // Static and pre-skinned meshes only meet instance matrices, which are
+    // rigid up to a uniform scale, so they skip the inverse
+    if(isSkinning) {
+        vertexNorm = transpose(inverse(mat3(skinMat * instanceMatrix))) * vertexNormal;
+    } else {
+        vertexNorm = mat3(instanceMatrix) * vertexNormal;
+    }
     uv = vertexUV;
     lightSpaceView = lightSpaceMatrix * vec4(fragPos, 1);
 }
@@ -0,0 +1,52 @@
+#version 330 core
+
+out vec3 fragPos;
+out vec3 vertexNorm;
+out vec4 lightSpaceView;
+out vec2 uv;
+
+uniform mat4 MVP;
+uniform mat4 lightSpaceMatrix;
+uniform float meshHeight;
+// Toroidal heightmap, one layer per level; see Clipmap
+uniform sampler2DArray heightmap;
+uniform int gridSize;
+uniform int textureSize;
+uniform vec2 worldOffset;
+uniform int level;
+uniform ivec2 levelBase;        // Grid point of vertex (0, 0), in level units
+uniform ivec2 texelBase;        // Its texel, levelBase wrapped to the layer
+uniform bool morph;
+
+// Biome index -> texture atlas uv, must match Terrain::generate_biome
+const vec2 biomeUV[4] = vec2[](vec2(0.375, 0.5), vec2(0.625, 0.5), vec2(0.95, 0.5), vec2(0.0));
+
+float height(ivec2 cell) {
+    ivec2 texel = (texelBase + cell + textureSize) % textureSize;
+    return texelFetch(heightmap, ivec3(texel, level), 0).r;
+}
+
+void main() {
+    ivec2 cell = ivec2(gl_VertexID % (gridSize + 1), gl_VertexID / (gridSize + 1));
+    int scale = 1 << level;
+    float h = height(cell);
+    if (morph) {
+        // Towards the outer edge, odd vertices slide onto the coarser level's
+        // edges so the border matches it exactly: no cracks and no popping
+        int edge = min(min(cell.x, cell.y), min(gridSize - cell.x, gridSize - cell.y));
+        float alpha = clamp(1.0 - float(edge) / float(gridSize / 8), 0.0, 1.0);
+        ivec2 odd = cell & 1;
+        h = mix(h, 0.5 * (height(cell - odd) + height(cell + odd)), alpha);
+    }
+    fragPos = vec3(worldOffset.x + float((levelBase.x + cell.x) * scale), h, worldOffset.y + float((levelBase.y + cell.y) * scale));
+
+    // Same central differences and biome bands as the chunked terrain
+    float l = height(cell - ivec2(1, 0));
+    float r = height(cell + ivec2(1, 0));
+    float d = height(cell - ivec2(0, 1));
+    float u = height(cell + ivec2(0, 1));
+    vertexNorm = normalize(vec3(l - r, 2.0 * float(scale), d - u));
+    uv = biomeUV[h <= 0.375 * meshHeight ? 0 : (h <= 0.625 * meshHeight ? 1 : 2)];
+    lightSpaceView = lightSpaceMatrix * vec4(fragPos, 1);
+    gl_Position = MVP * vec4(fragPos, 1.0);
+}
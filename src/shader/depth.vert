@@ -1,11 +1,21 @@
 #version 330 core
-layout (location = 0) in vec3 aPos;
-layout (location = 3) in vec3 aOffset;
+layout (location = 0) in float aHeight;
 
 uniform mat4 lightSpaceMatrix;
-uniform mat4 u_model;
+uniform int chunkWidth;
+uniform int chunkVertices;
+uniform float heightScale;
+uniform samplerBuffer chunkOffsets;
+uniform bool gpuHeightfield;
+uniform sampler2DArray heightfield;
 
 void main()
 {
-    gl_Position = lightSpaceMatrix * u_model * vec4(aPos+aOffset, 1.0);
-}
\ No newline at end of file
+    int slot = gl_VertexID / chunkVertices;
+    int vertex = gl_VertexID % chunkVertices;
+    vec2 offset = texelFetch(chunkOffsets, slot).xy;
+    ivec2 grid = ivec2(vertex % chunkWidth, vertex / chunkWidth);
+    float height = gpuHeightfield ? texelFetch(heightfield, ivec3(grid + 1, slot), 0).r : aHeight * heightScale;
+    vec3 aPos = vec3(offset.x + float(grid.x), height, offset.y + float(grid.y));
+    gl_Position = lightSpaceMatrix * vec4(aPos, 1.0);
+}
@@ -0,0 +1,31 @@
+#version 330 core
+
+uniform mat4 lightSpaceMatrix;
+uniform sampler2DArray heightmap;
+uniform int gridSize;
+uniform int textureSize;
+uniform vec2 worldOffset;
+uniform int level;
+uniform ivec2 levelBase;
+uniform ivec2 texelBase;
+uniform bool morph;
+
+float height(ivec2 cell) {
+    ivec2 texel = (texelBase + cell + textureSize) % textureSize;
+    return texelFetch(heightmap, ivec3(texel, level), 0).r;
+}
+
+void main()
+{
+    ivec2 cell = ivec2(gl_VertexID % (gridSize + 1), gl_VertexID / (gridSize + 1));
+    int scale = 1 << level;
+    float h = height(cell);
+    if (morph) {
+        int edge = min(min(cell.x, cell.y), min(gridSize - cell.x, gridSize - cell.y));
+        float alpha = clamp(1.0 - float(edge) / float(gridSize / 8), 0.0, 1.0);
+        ivec2 odd = cell & 1;
+        h = mix(h, 0.5 * (height(cell - odd) + height(cell + odd)), alpha);
+    }
+    vec3 aPos = vec3(worldOffset.x + float((levelBase.x + cell.x) * scale), h, worldOffset.y + float((levelBase.y + cell.y) * scale));
+    gl_Position = lightSpaceMatrix * vec4(aPos, 1.0);
+}
@@ -4,8 +4,12 @@ layout(location = 5) in mat4 aInstanceMatrix;
 
 uniform mat4 lightSpaceMatrix;
 uniform mat4 u_model;
+// Baked models store positions as normalized shorts
+uniform vec3 positionScale = vec3(1.0);
+uniform vec3 positionOffset = vec3(0.0);
 
 void main()
 {
-    gl_Position = lightSpaceMatrix * u_model * aInstanceMatrix * vec4(aPos, 1.0);
+    vec3 localPosition = positionOffset + positionScale * aPos;
+    gl_Position = lightSpaceMatrix * u_model * aInstanceMatrix * vec4(localPosition, 1.0);
 }
\ No newline at end of file
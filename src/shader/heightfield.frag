@@ -0,0 +1,67 @@
+#version 330 core
+
+// One chunk heightmap per draw: fBm of improved Perlin noise on the z = 0
+// slice, eased and scaled exactly like Terrain::generate_noise_map and
+// Terrain::generate_heights
+uniform usampler2D permutation;     // 256 entries, the table is indexed & 255
+uniform ivec2 origin;               // Grid point of texel (0, 0)
+uniform int octaves;
+uniform float persistence;
+uniform float lacunarity;
+uniform float scale;
+uniform float maxPossibleHeight;
+uniform float meshHeight;
+uniform float waterHeight;
+
+layout (location = 0) out float height;
+
+int perm(int i)
+{
+    return int(texelFetch(permutation, ivec2(i & 255, 0), 0).r);
+}
+
+float fade(float t)
+{
+    return t * t * t * (t * (t * 6.0 - 15.0) + 10.0);
+}
+
+float grad(int hash, float x, float y)
+{
+    int h = hash & 15;
+    float u = h < 8 ? x : y;
+    float v = h < 4 ? y : (h == 12 || h == 14 ? x : 0.0);
+    return ((h & 1) == 0 ? u : -u) + ((h & 2) == 0 ? v : -v);
+}
+
+float noise(float x, float y)
+{
+    float fx = floor(x), fy = floor(y);
+    int X = int(fx) & 255;
+    int Y = int(fy) & 255;
+    x -= fx;
+    y -= fy;
+    float u = fade(x);
+    float v = fade(y);
+    int A = perm(X) + Y;
+    int B = perm(X + 1) + Y;
+
+    return mix(mix(grad(perm(perm(A)), x, y), grad(perm(perm(B)), x - 1.0, y), u),
+               mix(grad(perm(perm(A + 1)), x, y - 1.0), grad(perm(perm(B + 1)), x - 1.0, y - 1.0), u), v);
+}
+
+void main()
+{
+    ivec2 grid = origin + ivec2(gl_FragCoord.xy);
+    float value = 0.0;
+    float amp = 1.0;
+    float freq = 1.0;
+    for (int o = 0; o < octaves; o++) {
+        value += noise(float(grid.x) / scale * freq, float(grid.y) / scale * freq) * amp;
+        amp *= persistence;
+        freq *= lacunarity;
+    }
+
+    // Cubed by hand: pow() is undefined for negative bases in GLSL
+    float n = (value + 1.0) / maxPossibleHeight * 1.1;
+    height = max(n * n * n * meshHeight, waterHeight * 0.5 * meshHeight);
+}
@@ -2,7 +2,10 @@
 layout (location = 0) in vec3 aPos;
 layout (location = 1) in vec2 vertexUV;
 layout (location = 2) in vec3 vertexColor;
-layout (location = 3) in mat4 aInstanceMatrix;
+// Particle position and scale
+layout (location = 3) in vec4 aInstance;
+// Its emitter, only bound when drawing the GPU simulation's state
+layout (location = 4) in uint aEmitter;
 
 
 out vec2 uv;
@@ -12,11 +15,25 @@ out vec3 color;
 uniform vec3 u_viewPos;
 uniform mat4 MVP;
 
+// The GPU state holds every particle, those of emitters out of range are
+// moved outside the clip volume
+uniform bool cullRange = false;
+uniform vec2 rangeCenter;
+uniform vec2 rangeExtent;
+uniform samplerBuffer emitterCenters;
+
 
 
 
 void main() {
+    if (cullRange) {
+        vec2 center = texelFetch(emitterCenters, int(aEmitter)).xz;
+        if (any(greaterThan(abs(center - rangeCenter), rangeExtent))) {
+            gl_Position = vec4(0.0, 0.0, 2.0, 1.0);
+            return;
+        }
+    }
     uv = vertexUV;
     color = vertexColor;
-    gl_Position = MVP * aInstanceMatrix * vec4(aPos,1.0);
+    gl_Position = MVP * vec4(aInstance.xyz + aInstance.w * aPos, 1.0);
 }
\ No newline at end of file
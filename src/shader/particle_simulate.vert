@@ -0,0 +1,58 @@
+#version 330 core
+
+// GPU particle step: one point per particle, captured by transform feedback
+// into the other state buffer. Mirrors ParticleSystem::simulate_scalar and
+// respawn, hash included, so the CPU path is its reference.
+layout(location = 0) in vec4 positionScale;
+layout(location = 1) in vec2 speedLife;
+layout(location = 2) in uvec2 respawnsEmitter;
+
+out vec4 nextPositionScale;
+out vec2 nextSpeedLife;
+flat out uvec2 nextRespawnsEmitter;
+
+uniform float time;
+uniform uint seed;
+uniform samplerBuffer emitterCenters;
+
+uint hash(uint x) {
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+float random(uint base, uint k, float low, float high) {
+    return low + float(hash(base + k) >> 8) * (1.0 / 16777216.0) * (high - low);
+}
+
+void main() {
+    vec4 position = positionScale;
+    float speed = speedLife.x;
+    float life = speedLife.y - time;
+    uint respawns = respawnsEmitter.x;
+    if (life > 0.0) {
+        // Rise at half the speed and drift back along z at it
+        float step = speed * time;
+        position.y += step * 0.5;
+        position.z -= step;
+    } else {
+        // Somewhere within 5 units of the emitter, up to a unit above it
+        vec3 center = texelFetch(emitterCenters, int(respawnsEmitter.y)).xyz;
+        respawns += 1u;
+        uint base = hash(hash(uint(gl_VertexID) ^ seed) + respawns);
+        float angle = random(base, 0u, 0.0, 6.28318531);
+        float radius = random(base, 1u, 0.0, 5.0);
+        position.x = center.x + radius * cos(angle);
+        position.z = center.z + radius * sin(angle);
+        position.y = random(base, 2u, center.y, center.y + 1.0);
+        speed = random(base, 3u, 5.0, 10.0);
+        life = random(base, 4u, 0.0, 1.0);
+        position.w = random(base, 5u, 0.1, 1.1);
+    }
+    nextPositionScale = position;
+    nextSpeedLife = vec2(speed, life);
+    nextRespawnsEmitter = uvec2(respawns, respawnsEmitter.y);
+}
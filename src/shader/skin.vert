@@ -0,0 +1,42 @@
+#version 330 core
+
+// Pre-skinning: each vertex is skinned once per frame into a transform
+// feedback buffer, which the shadow and colour passes then draw as a static
+// mesh
+layout(location = 0) in vec3 vertexPosition;
+layout(location = 1) in vec3 vertexNormal;
+layout(location = 3) in vec4 a_joint;
+layout(location = 4) in vec4 a_weight;
+
+out vec3 skinnedPosition;
+out vec3 skinnedNormal;
+
+// Baked models store positions as normalized shorts
+uniform vec3 positionScale = vec3(1.0);
+uniform vec3 positionOffset = vec3(0.0);
+
+// Joint palette: the rows of each joint matrix's 3x4 affine part, three
+// texels per joint
+uniform samplerBuffer jointPalette;
+
+mat4 jointSkin(vec4 joints, vec4 weights) {
+    vec4 row0 = vec4(0.0);
+    vec4 row1 = vec4(0.0);
+    vec4 row2 = vec4(0.0);
+    for (int i = 0; i < 4; i++) {
+        int texel = int(joints[i]) * 3;
+        row0 += weights[i] * texelFetch(jointPalette, texel);
+        row1 += weights[i] * texelFetch(jointPalette, texel + 1);
+        row2 += weights[i] * texelFetch(jointPalette, texel + 2);
+    }
+    float weight = weights.x + weights.y + weights.z + weights.w;
+    return transpose(mat4(row0, row1, row2, vec4(0.0, 0.0, 0.0, weight)));
+}
+
+void main() {
+    vec3 localPosition = positionOffset + positionScale * vertexPosition;
+    mat4 skinMat = jointSkin(a_joint, a_weight);
+    vec4 position = skinMat * vec4(localPosition, 1.0);
+    skinnedPosition = position.xyz / position.w;
+    skinnedNormal = transpose(inverse(mat3(skinMat))) * vertexNormal;
+}
@@ -1,8 +1,7 @@
 #version 330 core
-layout (location = 0) in vec3 aPos;
-layout (location = 1) in vec3 aNormal;
-layout (location = 2) in vec2 aUV;
-layout (location = 3) in vec3 aOffset;
+layout (location = 0) in float aHeight;
+layout (location = 1) in vec2 aNormal;
+layout (location = 2) in uint aBiome;
 
 
 out vec3 fragPos;
@@ -10,15 +9,47 @@ out vec3 vertexNorm;
 out vec4 lightSpaceView;
 out vec2 uv;
 
-uniform mat4 u_model;
 uniform mat4 MVP;
 uniform mat4 lightSpaceMatrix;
+uniform int chunkWidth;
+uniform int chunkVertices;
+uniform float heightScale;
+// World xz offset of every chunk slot; gl_VertexID includes the slot's base vertex
+uniform samplerBuffer chunkOffsets;
+// GPU generated terrain: heights of every slot, with a one texel border
+uniform bool gpuHeightfield;
+uniform sampler2DArray heightfield;
 
+// Biome index -> texture atlas uv, must match Terrain::generate_biome
+const vec2 biomeUV[4] = vec2[](vec2(0.375, 0.5), vec2(0.625, 0.5), vec2(0.95, 0.5), vec2(0.0));
+
+vec3 decodeNormal(vec2 e) {
+    vec3 n = vec3(e.x, 1.0 - abs(e.x) - abs(e.y), e.y);
+    if (n.y < 0.0) {
+        n.xz = (1.0 - abs(n.zx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.z >= 0.0 ? 1.0 : -1.0);
+    }
+    return normalize(n);
+}
 
 void main() {
-    fragPos = vec3(u_model * vec4(aPos + aOffset, 1.0));
-    vertexNorm = transpose(inverse(mat3(u_model))) * aNormal;
-    uv = aUV;
+    int slot = gl_VertexID / chunkVertices;
+    int vertex = gl_VertexID % chunkVertices;
+    vec2 offset = texelFetch(chunkOffsets, slot).xy;
+    ivec2 grid = ivec2(vertex % chunkWidth, vertex / chunkWidth);
+    fragPos = vec3(offset.x + float(grid.x), aHeight * heightScale, offset.y + float(grid.y));
+    vertexNorm = decodeNormal(aNormal);
+    uv = biomeUV[aBiome];
+    if (gpuHeightfield) {
+        // Same central differences as the CPU generator, the biome is still
+        // a vertex attribute
+        ivec3 texel = ivec3(grid + 1, slot);
+        fragPos.y = texelFetch(heightfield, texel, 0).r;
+        float l = texelFetch(heightfield, texel - ivec3(1, 0, 0), 0).r;
+        float r = texelFetch(heightfield, texel + ivec3(1, 0, 0), 0).r;
+        float d = texelFetch(heightfield, texel - ivec3(0, 1, 0), 0).r;
+        float u = texelFetch(heightfield, texel + ivec3(0, 1, 0), 0).r;
+        vertexNorm = normalize(vec3(l - r, 2.0, d - u));
+    }
     lightSpaceView = lightSpaceMatrix * vec4(fragPos, 1);
-    gl_Position = MVP * u_model * vec4(aPos+aOffset , 1.0);
-}
\ No newline at end of file
+    gl_Position = MVP * vec4(fragPos, 1.0);
+}
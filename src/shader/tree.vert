@@ -14,12 +14,16 @@ out vec4 lightSpaceView;
 uniform mat4 u_model;
 uniform mat4 MVP;
 uniform mat4 lightSpaceMatrix;
+// Baked models store positions as normalized shorts
+uniform vec3 positionScale = vec3(1.0);
+uniform vec3 positionOffset = vec3(0.0);
 
 
 
 
 void main() {
-    fragPos = vec3(u_model * aInstanceMatrix * vec4(aPos, 1.0));
+    vec3 localPosition = positionOffset + positionScale * aPos;
+    fragPos = vec3(u_model * aInstanceMatrix * vec4(localPosition, 1.0));
     vertexNorm = transpose(inverse(mat3(u_model * aInstanceMatrix))) * aNormal;
     uv= vertexUV;
     lightSpaceView = lightSpaceMatrix * vec4(fragPos, 1);
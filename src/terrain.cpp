@@ -1,73 +1,23 @@
 #include "terrain.h"
+#include "thread_pool.h"
 #include <glm/gtx/string_cast.hpp>
-double fade(double t) { return t * t * t * (t * (t * 6 - 15) + 10); };
-    
-double lerp(double t, double a, double b) { return a + t * (b - a); }
-    
-double grad(int hash, double x, double y, double z) {
-   int h = hash & 15;                      // CONVERT LO 4 BITS OF HASH CODE
-   double u = h<8 ? x : y,                 // INTO 12 GRADIENT DIRECTIONS.
-          v = h<4 ? y : h==12||h==14 ? x : z;
-   return ((h&1) == 0 ? u : -u) + ((h&2) == 0 ? v : -v);
-}
-    
-double perlin_noise(float x, float y, std::vector<int> &p) {
-    int z = 0.5;
-    
-    int X = (int)floor(x) & 255,                  // FIND UNIT CUBE THAT
-        Y = (int)floor(y) & 255,                  // CONTAINS POINT.
-        Z = (int)floor(z) & 255;
-    x -= floor(x);                                // FIND RELATIVE X,Y,Z
-    y -= floor(y);                                // OF POINT IN CUBE.
-    z -= floor(z);
-    double u = fade(x),                                // COMPUTE FADE CURVES
-           v = fade(y),                                // FOR EACH OF X,Y,Z.
-           w = fade(z);
-    int A = p[X  ]+Y, AA = p[A]+Z, AB = p[A+1]+Z,      // HASH COORDINATES OF
-        B = p[X+1]+Y, BA = p[B]+Z, BB = p[B+1]+Z;      // THE 8 CUBE CORNERS,
-
-    return lerp(w, lerp(v, lerp(u, grad(p[AA  ], x  , y  , z   ),  // AND ADD
-                                   grad(p[BA  ], x-1, y  , z   )), // BLENDED
-                           lerp(u, grad(p[AB  ], x  , y-1, z   ),  // RESULTS
-                                   grad(p[BB  ], x-1, y-1, z   ))),// FROM  8
-                   lerp(v, lerp(u, grad(p[AA+1], x  , y  , z-1 ),  // CORNERS
-                                   grad(p[BA+1], x-1, y  , z-1 )), // OF CUBE
-                           lerp(u, grad(p[AB+1], x  , y-1, z-1 ),
-                                   grad(p[BB+1], x-1, y-1, z-1 ))));
-}
-
-std::vector<int> get_permutation_vector () {
-    std::vector<int> p;
-
-    std::vector<int> permutation = { 151,160,137,91,90,15,
-    131,13,201,95,96,53,194,233,7,225,140,36,103,30,69,142,8,99,37,240,21,10,23,
-    190, 6,148,247,120,234,75,0,26,197,62,94,252,219,203,117,35,11,32,57,177,33,
-    88,237,149,56,87,174,20,125,136,171,168, 68,175,74,165,71,134,139,48,27,166,
-    77,146,158,231,83,111,229,122,60,211,133,230,220,105,92,41,55,46,245,40,244,
-    102,143,54, 65,25,63,161, 1,216,80,73,209,76,132,187,208, 89,18,169,200,196,
-    135,130,116,188,159,86,164,100,109,198,173,186, 3,64,52,217,226,250,124,123,
-    5,202,38,147,118,126,255,82,85,212,207,206,59,227,47,16,58,17,182,189,28,42,
-    223,183,170,213,119,248,152, 2,44,154,163, 70,221,153,101,155,167, 43,172,9,
-    129,22,39,253, 19,98,108,110,79,113,224,232,178,185, 112,104,218,246,97,228,
-    251,34,242,193,238,210,144,12,191,179,162,241, 81,51,145,235,249,14,239,107,
-    49,192,214, 31,181,199,106,157,184, 84,204,176,115,121,50,45,127, 4,150,254,
-    138,236,205,93,222,114,67,29,24,72,243,141,128,195,78,66,215,61,156,180
-    };
+#include <chrono>
+#include <algorithm>
+#include <cstddef>
+#include <iterator>
+#include <condition_variable>
+#include <mutex>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define TERRAIN_HAS_SSE2 1
+#include <emmintrin.h>
+#endif
 
-    for (int j = 0; j < 2; j++)
-        for (int i=0; i < 256; i++) {
-            p.push_back(permutation[i]);
-        }
-    
-    return p;
-}
 
 void Terrain::render(glm::mat4 &mvp, glm::vec3 cameraPosition, Shadow shadow, Light light, GLuint tex) {
     // Per-frame time logic
     
-    // Measures number of map chunks away from origin map chunk the camera is
-    gridPosX = (int)(cameraPosition.x - originX) / chunkWidth + xMapChunks / 2;
-    gridPosY = (int)(cameraPosition.z - originY) / chunkHeight + yMapChunks / 2;
+    update_grid_position(cameraPosition);
 
     
     glUseProgram(programID);
@@ -84,37 +34,40 @@ void Terrain::render(glm::mat4 &mvp, glm::vec3 cameraPosition, Shadow shadow, Li
     glBindTexture(GL_TEXTURE_2D,tex);
     glUniform1i(glGetUniformLocation(programID, "tex"),1);
     glUniformMatrix4fv(lightSpaceMatrixID, 1, GL_FALSE, &shadow.lightSpaceView[0][0]);
+    glUniform1i(chunkWidthID, chunkWidth);
+    glUniform1f(heightScaleID, TERRAIN_HEIGHT_RANGE * meshHeight);
+    glUniform1i(chunkVerticesID, chunkWidth * chunkHeight);
+    glActiveTexture(GL_TEXTURE0+2);
+    glBindTexture(GL_TEXTURE_BUFFER, chunkOffsetTexture);
+    glUniform1i(chunkOffsetsID, 2);
+    // Samplers of different types may not share a unit, so the heightfield
+    // always gets its own
+    glActiveTexture(GL_TEXTURE0+3);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, heightfield ? heightfield->texture : 0);
+    glUniform1i(heightfieldID, 3);
+    glUniform1i(gpuHeightfieldID, heightfield != NULL);
     // Render map chunks
-    std::vector<glm::mat4> modelMatrices;
-    for (int y = 0; y < yMapChunks; y++) 
-        for (int x = 0; x < xMapChunks; x++) {
-            // Only render chunk if it's within render distance
-            if (std::abs(gridPosX - x) <= chunk_render_distance && (y - gridPosY) <= chunk_render_distance) {
-                glm::mat4 model = glm::mat4(1.0f);
-                model = glm::translate(model, glm::vec3(-chunkWidth / 2.0 + (chunkWidth - 1) * x, 0.0, -chunkHeight / 2.0 + (chunkHeight - 1) * y));
-                modelMatrices.push_back(model);
-                //std::cout << "translate " << glm::to_string(glm::vec3(-chunkWidth / 2.0 + (chunkWidth - 1) * x, 0.0, -chunkHeight / 2.0 + (chunkHeight - 1) * y)) << std::endl;
-                glUniformMatrix4fv(modelID, 1, GL_FALSE, &model[0][0]);
-                
-                // Terrain chunk
-                glBindVertexArray(map_chunks[x + y*xMapChunks]);
-                glDrawElements(GL_TRIANGLES, nIndices, GL_UNSIGNED_INT, 0);
-            }
-        }
-    std::vector<glm::mat4> instancesWithinRenderDist;
-    for(glm::mat4& instance : instanceMatrices) {
-        glm::vec3 pos = glm::vec3(instance[3]);
-        if (std::abs(pos.x) <= chunk_render_distance*chunkWidth && std::abs(pos.z) <= chunk_render_distance*chunkHeight) {
-            instancesWithinRenderDist.push_back(instance);
-        }
+    if (clipmap) {
+        trianglesDrawn = clipmap->draw(programID);
+    } else {
+        trianglesDrawn = draw_visible_chunks(mvp, 0, chunksDrawn, chunksCulled);
     }
-    std::vector<ParticleGenerator> particleGeneratorWithinRenderDist;
-    for(ParticleGenerator& pGen : particleGenerators) {
-        glm::vec3 pos = pGen.center;
-        if (std::abs(pos.x-originX) <= chunk_render_distance*chunkWidth && std::abs(pos.z-originY-5.0f) <= chunk_render_distance*chunkHeight) {
-            particleGeneratorWithinRenderDist.push_back(pGen);
-        }
+    double sinceLog = std::chrono::duration<double>(std::chrono::steady_clock::now() - lastStatsLog).count();
+    if (sinceLog >= 1.0 && clipmap) {
+        std::cout << "Terrain clipmap: " << trianglesDrawn << " triangles, " << clipmap->samplesWritten
+                  << " height samples regenerated" << std::endl;
+        clipmap->samplesWritten = 0;
+        lastStatsLog = std::chrono::steady_clock::now();
+    } else if (sinceLog >= 1.0) {
+        std::cout << "Terrain: " << chunksDrawn << " chunks drawn, " << chunksCulled << " culled, "
+                  << trianglesDrawn << " triangles (shadow pass: " << shadowChunksDrawn << " drawn, "
+                  << shadowChunksCulled << " culled, " << shadowTrianglesDrawn << " triangles), "
+                  << animationUpdates << " animation poses" << std::endl;
+        animationUpdates = 0;
+        lastStatsLog = std::chrono::steady_clock::now();
     }
+    std::vector<glm::mat4> instancesWithinRenderDist = instances_within_render_distance();
+    animationViewProjection = mvp;
     
     glEnable(GL_CULL_FACE);
     tree.render(mvp, cameraPosition, shadow, light,instancesWithinRenderDist );
@@ -122,58 +75,107 @@ void Terrain::render(glm::mat4 &mvp, glm::vec3 cameraPosition, Shadow shadow, Li
     fox.render(mvp, cameraPosition, shadow, light, instancesWithinRenderDist);
     bird.render(mvp, cameraPosition, shadow, light, instancesWithinRenderDist);
     goose.render(mvp, cameraPosition, shadow, light, instancesWithinRenderDist);
-    for(ParticleGenerator& pGen : particleGeneratorWithinRenderDist) {
-        pGen.render(mvp,cameraPosition);
-    }
+    particles.render(mvp, cameraPosition, glm::vec2(originX, originY + 5.0f),
+                     glm::vec2(chunk_render_distance * chunkWidth, chunk_render_distance * chunkHeight));
     glDisable(GL_CULL_FACE);
 }
 
 
+std::vector<glm::mat4> Terrain::instances_within_render_distance() {
+    std::vector<glm::mat4> instancesWithinRenderDist;
+    for(glm::mat4& instance : instanceMatrices) {
+        glm::vec3 pos = glm::vec3(instance[3]);
+        if (std::abs(pos.x) <= chunk_render_distance*chunkWidth && std::abs(pos.z) <= chunk_render_distance*chunkHeight) {
+            instancesWithinRenderDist.push_back(instance);
+        }
+    }
+    return instancesWithinRenderDist;
+}
+
 void Terrain::update(float deltaTime, float particleTime, float chunks, float chunkWidth, float origin) {
-    bot.update(deltaTime);
-    bird.update(deltaTime);
-    bird.setTransform(deltaTime/4,chunks,chunkWidth,origin, 1);
-    fox.update(deltaTime);
-    fox.setTransform(deltaTime*4,chunks,chunkWidth,origin, 0);
+    Entity *animated[4] = { &bot, &bird, &fox, &goose };
+    int levels[4] = { 0, 0, 0, 0 };
+    int updated[4] = { 0, 0, 0, 0 };
+    bool lod = use_animation_lod && animationViewKnown;
+    if (lod) {
+        // Poses follow what the last frame's camera and shadow map saw
+        std::vector<glm::mat4> instances = instances_within_render_distance();
+        Frustum cameraFrustum = Camera::createFrustumFromMatrix(animationViewProjection);
+        Frustum shadowFrustum = Camera::createFrustumFromMatrix(animationLightProjection);
+        for (int i = 0; i < 4; i++) {
+            levels[i] = animated[i]->animationLod(instances, animationViewProjection, cameraFrustum, shadowFrustum, animation_lod_sizes);
+        }
+    }
     float drift = std::fmod(deltaTime * 0.006f, 127.0f * 3.0f);
-    for(ParticleGenerator& pGen : particleGenerators) {
-        pGen.update(particleTime, glm::vec3(pGen.center.x,pGen.center.y,pGen.center.z+drift));
+    auto animate = [&](int i) {
+        if (lod) {
+            updated[i] = animated[i]->updateLod(deltaTime, levels[i]);
+        } else {
+            animated[i]->update(deltaTime);
+        }
+    };
+    auto simulate = [&](int begin, int end) {
+        particles.simulate(particleTime, glm::vec3(0.0f, 0.0f, drift), begin, end);
+    };
+
+    // Entities and emitters only touch their own state, and none of it
+    // reaches GL until the join. GPU particles are stepped after it.
+    int batch = std::max(1, particle_emitters_per_job);
+    int cpuEmitters = particles.useGpu ? 0 : particles.emitters();
+    if (use_parallel_update) {
+        if (!updateJobs) {
+            updateJobs.reset(new JobSystem(update_threads));
+        }
+        for (int i = 0; i < 4; i++) {
+            updateJobs->submit([&animate, i]() { animate(i); });
+        }
+        for (int e = 0; e < cpuEmitters; e += batch) {
+            int end = std::min(e + batch, cpuEmitters);
+            updateJobs->submit([&simulate, e, end]() { simulate(e, end); });
+        }
+        updateJobs->wait();
+    } else {
+        for (int i = 0; i < 4; i++) {
+            animate(i);
+        }
+        simulate(0, cpuEmitters);
+    }
+    particles.simulate_gpu(particleTime, glm::vec3(0.0f, 0.0f, drift));
+
+    for (int i = 0; i < 4; i++) {
+        animationUpdates += updated[i];
     }
-    goose.update(deltaTime);
+    bird.setTransform(deltaTime/4,chunks,chunkWidth,origin, 1);
+    fox.setTransform(deltaTime*4,chunks,chunkWidth,origin, 0);
 }
 
 void Terrain::render(glm::vec3 cameraPosition, GLuint terrainDepthID, GLuint treeDepthID, glm::mat4 vp, GLuint botDepthID) {
     // Per-frame time logic
     // Measures number of map chunks away from origin map chunk the camera is
     glUseProgram(terrainDepthID);
-    gridPosX = (int)(cameraPosition.x - originX) / chunkWidth + xMapChunks / 2;
-    gridPosY = (int)(cameraPosition.z - originY) / chunkHeight + yMapChunks / 2;
+    update_grid_position(cameraPosition);
     glUniformMatrix4fv(glGetUniformLocation(terrainDepthID, "lightSpaceMatrix"), 1, GL_FALSE, glm::value_ptr(vp));
-    // Render map chunks
-    std::vector<glm::mat4> modelMatrices;
-    for (int y = 0; y < yMapChunks; y++) 
-        for (int x = 0; x < xMapChunks; x++) {
-            // Only render chunk if it's within render distance
-            if (std::abs(gridPosX - x) <= chunk_render_distance && (y - gridPosY) <= chunk_render_distance) {
-                glm::mat4 model = glm::mat4(1.0f);
-                model = glm::translate(model, glm::vec3(-chunkWidth / 2.0 + (chunkWidth - 1) * x, 0.0, -chunkHeight / 2.0 + (chunkHeight - 1) * y));
-                modelMatrices.push_back(model);
-                //std::cout << "translate " << glm::to_string(glm::vec3(-chunkWidth / 2.0 + (chunkWidth - 1) * x, 0.0, -chunkHeight / 2.0 + (chunkHeight - 1) * y)) << std::endl;
-                glUniformMatrix4fv(glGetUniformLocation(terrainDepthID, "u_model"), 1, GL_FALSE, &model[0][0]);
-                
-                // Terrain chunk
-                glBindVertexArray(map_chunks[x + y*xMapChunks]);
-                glDrawElements(GL_TRIANGLES, nIndices, GL_UNSIGNED_INT, 0);
-            }
-    }
-    std::vector<glm::mat4> instancesWithinRenderDist;
-    
-    for(glm::mat4& instance : instanceMatrices) {
-        glm::vec3 pos = glm::vec3(instance[3]);
-        if (std::abs(pos.x) <= chunk_render_distance*chunkWidth && std::abs(pos.z) <= chunk_render_distance*chunkHeight) {
-            instancesWithinRenderDist.push_back(instance);
-        }
+    glUniform1i(glGetUniformLocation(terrainDepthID, "chunkWidth"), chunkWidth);
+    glUniform1f(glGetUniformLocation(terrainDepthID, "heightScale"), TERRAIN_HEIGHT_RANGE * meshHeight);
+    glUniform1i(glGetUniformLocation(terrainDepthID, "chunkVertices"), chunkWidth * chunkHeight);
+    glActiveTexture(GL_TEXTURE0+2);
+    glBindTexture(GL_TEXTURE_BUFFER, chunkOffsetTexture);
+    glUniform1i(glGetUniformLocation(terrainDepthID, "chunkOffsets"), 2);
+    glActiveTexture(GL_TEXTURE0+3);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, heightfield ? heightfield->texture : 0);
+    glUniform1i(glGetUniformLocation(terrainDepthID, "heightfield"), 3);
+    glUniform1i(glGetUniformLocation(terrainDepthID, "gpuHeightfield"), heightfield != NULL);
+    // Render map chunks, coarser than the main pass
+    if (clipmap) {
+        glUseProgram(clipmap->depthProgramID);
+        glUniformMatrix4fv(glGetUniformLocation(clipmap->depthProgramID, "lightSpaceMatrix"), 1, GL_FALSE, glm::value_ptr(vp));
+        shadowTrianglesDrawn = clipmap->draw(clipmap->depthProgramID);
+    } else {
+        shadowTrianglesDrawn = draw_visible_chunks(vp, shadow_lod_bias, shadowChunksDrawn, shadowChunksCulled);
     }
+    std::vector<glm::mat4> instancesWithinRenderDist = instances_within_render_distance();
+    animationLightProjection = vp;
+    animationViewKnown = true;
 
       
     
@@ -205,8 +207,7 @@ void Terrain::setup_instancing(GLuint particleTex, GLuint particleShader) {
         glm::vec3 coord = glm::vec3(xPos, yPos, zPos);
         std::cout << i << " " << glm::to_string(coord) << std::endl;
         instanceMatrices.push_back(model);
-        ParticleGenerator particleGenerator(particleShader, particleTex, 10, glm::vec3(xPos+originX, yPos, zPos+originY-5.0f));
-        particleGenerators.push_back(particleGenerator);
+        particles.add_emitter(glm::vec3(xPos+originX, yPos, zPos+originY-5.0f), particles_per_tree);
     }
     //m = glm::scale(m, glm::vec3(0.5f,0.5f,0.5f));
     // Duplicate trees in all four quadrants
@@ -219,21 +220,30 @@ void Terrain::setup_instancing(GLuint particleTex, GLuint particleShader) {
         // Second quadrant
         glm::mat4 model2 = glm::translate(glm::mat4(1.0f), glm::vec3(-pos.x, pos.y, pos.z));
         instanceMatrices.push_back(model2);
-        ParticleGenerator particleGenerator1(particleShader, particleTex, 10, glm::vec3(-pos.x+originX, pos.y, pos.z+originY-5.0f));
-        particleGenerators.push_back(particleGenerator1);
+        particles.add_emitter(glm::vec3(-pos.x+originX, pos.y, pos.z+originY-5.0f), particles_per_tree);
 
         // Third quadrant
         glm::mat4 model3 = glm::translate(glm::mat4(1.0f), glm::vec3(-pos.x, pos.y, -pos.z));
         instanceMatrices.push_back(model3);
-        ParticleGenerator particleGenerator2(particleShader, particleTex, 10, glm::vec3(-pos.x+originX, pos.y, -pos.z+originY-5.0f));
-        particleGenerators.push_back(particleGenerator2);
+        particles.add_emitter(glm::vec3(-pos.x+originX, pos.y, -pos.z+originY-5.0f), particles_per_tree);
 
         // Fourth quadrant
         glm::mat4 model4 = glm::translate(glm::mat4(1.0f), glm::vec3(pos.x, pos.y, -pos.z));
         instanceMatrices.push_back(model4);
-        ParticleGenerator particleGenerator3(particleShader, particleTex, 10, glm::vec3(pos.x+originX, pos.y, -pos.z+originY-5.0f));
-        particleGenerators.push_back(particleGenerator3);
+        particles.add_emitter(glm::vec3(pos.x+originX, pos.y, -pos.z+originY-5.0f), particles_per_tree);
+    }
+    particles.init(particleShader, particleTex);
+    particles.sortByDepth = sort_particles;
+    if (use_gpu_particles && (!sort_particles || sort_gpu_particles)) {
+        particles.readBackToSort = sort_gpu_particles;
+        particles.enable_gpu("../src/shader/particle_simulate.vert");
     }
+    bool sorted = particles.sortByDepth && (!particles.useGpu || particles.readBackToSort);
+    std::cout << "Particles: " << particles.particles() << " simulated on the " << (particles.useGpu ? "GPU" : "CPU")
+              << ", drawn " << (sorted ? "back to front" : "unsorted")
+              << (particles.useGpu && sorted ? " from a read-back every frame" : "")
+              << (use_gpu_particles && !particles.useGpu && sort_particles ? " (sorting keeps the simulation on the CPU)" : "")
+              << std::endl;
     glm::mat4 mTree = glm::translate(m, glm::vec3(originX, 0.0f, originY));
     glm::mat4 mBot = glm::translate(m, glm::vec3(originX, 0.0f, originY));
     glm::mat4 mBird = glm::translate(m, glm::vec3(originX, 20.0f, originY));
@@ -247,122 +257,387 @@ void Terrain::setup_instancing(GLuint particleTex, GLuint particleShader) {
     // //mBird = glm::rotate(mBird, glm::radians(90.0f), glm::vec3(0.0f,0.0f,1.0f));
     
     std::cout << "matrix_Size: " << instanceMatrices.size() << std::endl;
-    tree = Entity("../src/model/low/low.gltf", "../src/shader/tree.vert", "../src/shader/bot.frag",
+    tree = Entity("../src/model/low/low.glb", "../src/shader/tree.vert", "../src/shader/bot.frag",
         mTree, false, instanceMatrices.size(), instanceMatrices);
-    bot = Entity("../src/model/bot/bot.gltf", "../src/shader/bot.vert", "../src/shader/bot.frag",
+    bot = Entity("../src/model/bot/bot.glb", "../src/shader/bot.vert", "../src/shader/bot.frag",
     mBot, true, instanceMatrices.size(), instanceMatrices);
-    goose = Entity("../src/model/goose/goose.gltf", "../src/shader/bot.vert", "../src/shader/bot.frag",
+    goose = Entity("../src/model/goose/goose.glb", "../src/shader/bot.vert", "../src/shader/bot.frag",
     mGoose, true, instanceMatrices.size(), instanceMatrices);
-    fox = Entity("../src/model/fox/fox.gltf", "../src/shader/bot.vert", "../src/shader/bot.frag",
+    fox = Entity("../src/model/fox/Fox.glb", "../src/shader/bot.vert", "../src/shader/bot.frag",
     mFox, true, instanceMatrices.size(), instanceMatrices);
-    bird = Entity("../src/model/bird/bird.gltf", "../src/shader/bot.vert", "../src/shader/bot.frag",
+    bird = Entity("../src/model/bird/bird.glb", "../src/shader/bot.vert", "../src/shader/bot.frag",
         mBird, true, instanceMatrices.size(), instanceMatrices);
+    if (use_animation_compression) {
+        bot.compressAnimations(animation_compression);
+        goose.compressAnimations(animation_compression);
+        fox.compressAnimations(animation_compression);
+        bird.compressAnimations(animation_compression);
+    }
+    // Same order as palette_models and update()
+    Entity *animated[4] = { &bot, &bird, &fox, &goose };
+    const char *names[4] = { "bot", "bird", "fox", "goose" };
+    for (int i = 0; i < 4; i++) {
+        if (use_animation_palettes && palette_models[i]) {
+            animated[i]->enableAnimationPalette(animation_palette_rate);
+        }
+        if (use_preskinning && !animated[i]->usePalette) {
+            animated[i]->enablePreskinning("../src/shader/skin.vert");
+        }
+        std::cout << "Animation " << names[i] << ": "
+                  << (animated[i]->usePalette ? "palette" : animated[i]->usePreskinning ? "pre-skinned" : "skinned per pass")
+                  << std::endl;
+    }
 }
 
 
 
 
-void Terrain::generate_map_chunk(GLuint &VAO, int xOffset, int yOffset, std::vector<treeCoord> &treeCoords) {
-    std::vector<int> indices;
-    std::vector<float> noise_map;
-    std::vector<float> vertices;
-    std::vector<float> normals;
-    std::vector<float> uvs;
+void Terrain::generate_map_chunks(const std::vector<std::pair<int, int>> &coords) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    int nChunks = coords.size();
+    int cacheHits = cache.hits, cacheMisses = cache.misses;
+    std::vector<ChunkData> chunks(nChunks);
+    std::vector<char> ready(nChunks, 0);
+    std::mutex readyMutex;
+    std::condition_variable readyCond;
+
+    // CPU stage: noise, vertices, normals and biome on the worker pool.
+    // Every chunk only reads the noise params and writes its own slot, so the
+    // result does not depend on how many workers run or in which order.
+    ThreadPool pool(generation_threads);
+    for (int i = 0; i < nChunks; i++) {
+        pool.submit([this, i, &coords, &chunks, &ready, &readyMutex, &readyCond]() {
+            generate_chunk_data(chunks[i], coords[i].first, coords[i].second);
+            std::lock_guard<std::mutex> lock(readyMutex);
+            ready[i] = 1;
+            readyCond.notify_all();
+        });
+    }
+
+    // GL stage: upload in chunk order on the context thread while the workers
+    // are still busy with later chunks
+    for (int i = 0; i < nChunks; i++) {
+        {
+            std::unique_lock<std::mutex> lock(readyMutex);
+            readyCond.wait(lock, [&ready, i]() { return ready[i] != 0; });
+        }
+        int x = coords[i].first, y = coords[i].second;
+        upload_map_chunk(slot_index(x, y), chunks[i], x, y);
+        treeCoords.insert(treeCoords.end(), chunks[i].treeCoords.begin(), chunks[i].treeCoords.end());
+        chunks[i] = ChunkData();
+    }
+    pool.wait();
+
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Generated " << nChunks << " terrain chunks on " << pool.size()
+              << " threads in " << ms << " ms (noise: " << PerlinNoise::backend_name(noise.backend) << ")" << std::endl;
+    if (cache.enabled) {
+        cacheHits = cache.hits - cacheHits;
+        cacheMisses = cache.misses - cacheMisses;
+        std::cout << "Terrain chunk cache: " << cacheHits << " hits, " << cacheMisses << " misses, "
+                  << (cacheMisses == 0 ? "warm" : cacheHits == 0 ? "cold" : "partial") << " start" << std::endl;
+    }
+    if (terrainVBO != 0) {
+        std::cout << "Terrain vertices: " << sizeof(TerrainVertex) << " bytes each, "
+                  << (double)map_chunks.size() * chunkWidth * chunkHeight * sizeof(TerrainVertex) / (1024.0 * 1024.0)
+                  << " MB in " << map_chunks.size() << " chunk slots" << std::endl;
+    }
+}
+
+void Terrain::init_gpu_heightfield() {
+    if (!use_gpu_heightfield) {
+        return;
+    }
+    if ((int)map_chunks.size() > GpuHeightfield::max_layers()) {
+        std::cout << "GPU heightfield needs " << map_chunks.size() << " texture layers, only "
+                  << GpuHeightfield::max_layers() << " available, generating on the CPU" << std::endl;
+        return;
+    }
+    heightfield.reset(new GpuHeightfield(chunkWidth + 2, chunkHeight + 2, map_chunks.size(), noise));
+    if (!heightfield->valid()) {
+        std::cout << "GPU heightfield pass unavailable, generating on the CPU" << std::endl;
+        heightfield.reset();
+    }
+}
+
+// Renders every chunk's heights on the GPU, then reads each layer back for
+// the CPU-side work that needs them: tree placement and culling bounds
+void Terrain::generate_map_chunks_gpu(const std::vector<std::pair<int, int>> &coords) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    FbmParams params = { octaves, persistence, lacunarity, noiseScale };
     
-    // Generate map
-    indices = generate_indices();
-    noise_map = generate_noise_map(xOffset, yOffset);
-    vertices = generate_vertices(noise_map);
-    normals = generate_normals(indices, vertices);
-    uvs = generate_biome(vertices, treeCoords, xOffset, yOffset);
+    heightfield->begin(params, meshHeight, WATER_HEIGHT);
+    for (size_t i = 0; i < coords.size(); i++) {
+        int x = coords[i].first, y = coords[i].second;
+        heightfield->render_layer(slot_index(x, y), x * (chunkWidth - 1) - 1, y * (chunkHeight - 1) - 1);
+    }
+    heightfield->end();
+    glFinish();
+    double gpuMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
     
-    GLuint VBO[3], EBO;
+    std::vector<float> heights((chunkWidth + 2) * (chunkHeight + 2));
+    glBindBuffer(GL_ARRAY_BUFFER, terrainVBO);
+    for (size_t i = 0; i < coords.size(); i++) {
+        int x = coords[i].first, y = coords[i].second;
+        heightfield->read_layer(slot_index(x, y), &heights[0]);
+        
+        // Biomes by the same rule as CPU chunks, into the slot's biome bytes
+        ChunkData chunk;
+        std::vector<float> vertices = generate_vertices(heights);
+        std::vector<GLubyte> biomes = generate_biome(vertices, chunk.treeCoords, x, y);
+        glBufferSubData(GL_ARRAY_BUFFER, slot_index(x, y) * biomes.size(), biomes.size(), &biomes[0]);
+        chunk.minHeight = chunk.maxHeight = vertices[1];
+        for (size_t v = 1; v < vertices.size(); v += 3) {
+            chunk.minHeight = std::min(chunk.minHeight, vertices[v]);
+            chunk.maxHeight = std::max(chunk.maxHeight, vertices[v]);
+        }
+        assign_slot(slot_index(x, y), chunk, x, y);
+        treeCoords.insert(treeCoords.end(), chunk.treeCoords.begin(), chunk.treeCoords.end());
+    }
     
-    // Create buffers and arrays
-    glGenBuffers(3, VBO);
-    glGenBuffers(1, &EBO);
-    glGenVertexArrays(1, &VAO);
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Generated " << coords.size() << " terrain chunks on the GPU in " << ms << " ms ("
+              << gpuMs << " ms noise pass, " << ms - gpuMs << " ms readback and tree placement), "
+              << (double)heightfield->width * heightfield->height * heightfield->layers * sizeof(float) / (1024.0 * 1024.0)
+              << " MB heightfield" << std::endl;
+}
+
+void Terrain::generate_chunk_data(ChunkData &chunk, int xOffset, int yOffset, bool readCache) {
+    if (readCache && cache.load(xOffset, yOffset, chunk)) {
+        return;
+    }
+    std::vector<float> heights = generate_heights(generate_noise_map(xOffset, yOffset));
+    std::vector<float> vertices = generate_vertices(heights);
+    std::vector<float> normals(chunkWidth * chunkHeight * 3);
+    generate_normals(&heights[0], chunkWidth, chunkHeight, &normals[0]);
+    std::vector<GLubyte> biomes = generate_biome(vertices, chunk.treeCoords, xOffset, yOffset);
+    chunk.minHeight = chunk.maxHeight = vertices[1];
+    for (size_t i = 1; i < vertices.size(); i += 3) {
+        chunk.minHeight = std::min(chunk.minHeight, vertices[i]);
+        chunk.maxHeight = std::max(chunk.maxHeight, vertices[i]);
+    }
+    chunk.vertices = pack_vertices(vertices, normals, biomes, TERRAIN_HEIGHT_RANGE * meshHeight);
+    cache.store(xOffset, yOffset, chunk);
+}
+
+std::vector<TerrainVertex> Terrain::pack_vertices(const std::vector<float> &vertices, const std::vector<float> &normals, const std::vector<GLubyte> &biomes, float heightRange) {
+    std::vector<TerrainVertex> packed(biomes.size());
+    float heightScale = 65535.0f / heightRange;
     
-    // Bind vertices to VBO
-    glBindVertexArray(VAO);
-    glBindBuffer(GL_ARRAY_BUFFER, VBO[0]);
-    glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(float), &vertices[0], GL_STATIC_DRAW);
+    for (size_t i = 0; i < packed.size(); i++) {
+        TerrainVertex &v = packed[i];
+        float h = glm::clamp(vertices[i*3 + 1] * heightScale, 0.0f, 65535.0f);
+        v.height = (GLushort)(h + 0.5f);
+        
+        // Octahedral encoding around +y: project onto the octahedron, fold
+        // the lower half over and keep xz
+        glm::vec3 n(normals[i*3], normals[i*3 + 1], normals[i*3 + 2]);
+        n /= std::fabs(n.x) + std::fabs(n.y) + std::fabs(n.z);
+        glm::vec2 oct(n.x, n.z);
+        if (n.y < 0) {
+            oct = (1.0f - glm::abs(glm::vec2(oct.y, oct.x))) * glm::vec2(oct.x >= 0 ? 1 : -1, oct.y >= 0 ? 1 : -1);
+        }
+        v.normal[0] = (GLbyte)std::round(glm::clamp(oct.x, -1.0f, 1.0f) * 127.0f);
+        v.normal[1] = (GLbyte)std::round(glm::clamp(oct.y, -1.0f, 1.0f) * 127.0f);
+        
+        v.biome = biomes[i];
+        v.pad[0] = v.pad[1] = v.pad[2] = 0;
+    }
+    return packed;
+}
+
+void Terrain::upload_index_buffer() {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    indexMode = use_triangle_strips ? GL_TRIANGLE_STRIP : GL_TRIANGLES;
+
+    // Drop the levels too coarse for this chunk size
+    lodLevels = 0;
+    while (lodLevels < TERRAIN_LOD_LEVELS && (chunkWidth - 1) % TERRAIN_LOD_STEPS[lodLevels] == 0
+           && (chunkHeight - 1) % TERRAIN_LOD_STEPS[lodLevels] == 0) {
+        lodLevels++;
+    }
+
+    std::vector<GLushort> indices;
+    for (int level = 0; level < lodLevels; level++)
+        for (int mask = 0; mask < TERRAIN_LOD_MASKS; mask++) {
+            // The coarsest level has no coarser neighbour to stitch to
+            int stitch = level + 1 < lodLevels ? mask : 0;
+            std::vector<GLushort> triangles = generate_indices(chunkWidth, chunkHeight, TERRAIN_LOD_STEPS[level], stitch);
+            int nTriangles = 0;
+            for (size_t i = 0; i < triangles.size(); i += 3) {
+                if (triangles[i] != triangles[i+1] && triangles[i+1] != triangles[i+2] && triangles[i] != triangles[i+2]) {
+                    nTriangles++;
+                }
+            }
+            const std::vector<GLushort> &range = use_triangle_strips
+                ? generate_strip_indices(chunkWidth, chunkHeight, TERRAIN_LOD_STEPS[level], stitch) : triangles;
+            lodIndexOffset[level][mask] = indices.size() * sizeof(GLushort);
+            lodIndexCount[level][mask] = range.size();
+            lodTriangles[level][mask] = nTriangles;
+            indices.insert(indices.end(), range.begin(), range.end());
+        }
+
+    glGenBuffers(1, &indexBuffer);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLushort), &indices[0], GL_STATIC_DRAW);
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    double sharedMB = indices.size() * sizeof(GLushort) / (1024.0 * 1024.0);
+    std::cout << "Terrain index buffer: " << lodLevels << " LOD levels x " << TERRAIN_LOD_MASKS << " border stitches, "
+              << indices.size() << (use_triangle_strips ? " strip" : " triangle") << " indices, "
+              << sharedMB << " MB shared by every chunk, uploaded in "
+              << ms << " ms" << std::endl;
+}
+
+// One VAO over a vertex buffer with room for every slot, plus the buffer
+// texture of per-slot world offsets
+void Terrain::allocate_chunk_storage() {
+    GLsizeiptr chunkBytes = chunkWidth * chunkHeight * sizeof(TerrainVertex);
     
-    // Create element buffer
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(int), &indices[0], GL_STATIC_DRAW);
+    glGenVertexArrays(1, &terrainVAO);
+    glGenBuffers(1, &terrainVBO);
+    glBindVertexArray(terrainVAO);
+    glBindBuffer(GL_ARRAY_BUFFER, terrainVBO);
+    // Heights come from the texture array instead, so only the biome byte
+    // of each vertex is stored
+    GLsizeiptr biomeBytes = chunkWidth * chunkHeight;
+    glBufferData(GL_ARRAY_BUFFER, (heightfield ? biomeBytes : chunkBytes) * map_chunks.size(), NULL, GL_STATIC_DRAW);
     
-    // Configure vertex position attribute
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*)0);
-    glEnableVertexAttribArray(0);
+    // Shared element buffer
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer);
     
-    // Bind vertices to VBO
-    glBindBuffer(GL_ARRAY_BUFFER, VBO[1]);
-    glBufferData(GL_ARRAY_BUFFER, normals.size() * sizeof(float), &normals[0], GL_STATIC_DRAW);
+    if (!heightfield) {
+        configure_vertex_attributes();
+    } else {
+        glVertexAttribIPointer(2, 1, GL_UNSIGNED_BYTE, 1, (void*)0);
+        glEnableVertexAttribArray(2);
+    }
+    glBindVertexArray(0);
     
-    // Configure vertex normals attribute
-    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*)0);
-    glEnableVertexAttribArray(1);
+    std::vector<glm::vec2> offsets(map_chunks.size(), glm::vec2(0.0f));
+    glGenBuffers(1, &chunkOffsetBuffer);
+    glBindBuffer(GL_TEXTURE_BUFFER, chunkOffsetBuffer);
+    glBufferData(GL_TEXTURE_BUFFER, offsets.size() * sizeof(glm::vec2), &offsets[0], GL_DYNAMIC_DRAW);
+    glGenTextures(1, &chunkOffsetTexture);
+    glBindTexture(GL_TEXTURE_BUFFER, chunkOffsetTexture);
+    glTexBuffer(GL_TEXTURE_BUFFER, GL_RG32F, chunkOffsetBuffer);
+    glBindTexture(GL_TEXTURE_BUFFER, 0);
     
-    // Bind vertices to VBO
-    glBindBuffer(GL_ARRAY_BUFFER, VBO[2]);
-    glBufferData(GL_ARRAY_BUFFER, uvs.size() * sizeof(float), &uvs[0], GL_STATIC_DRAW);
+    drawCounts.reserve(map_chunks.size());
+    drawIndexOffsets.reserve(map_chunks.size());
+    drawBaseVertices.reserve(map_chunks.size());
+}
+
+void Terrain::upload_map_chunk(int slotIndex, ChunkData &chunk, int x, int y) {
+    // Cached chunks upload straight from the file mapping, or decode
+    // straight into the mapped buffer when compressed. A chunk that fails to
+    // decode is generated again in its place, trees included.
+    const CachedChunk &cached = chunk.cached;
+    GLsizeiptr size = chunkWidth * chunkHeight * sizeof(TerrainVertex);
+    GLintptr offset = slotIndex * size;
+    const void *data = chunk.vertices.empty() ? NULL : &chunk.vertices[0];
+    if (cached.file) {
+        data = cached.codec == CHUNK_CODEC_RAW ? cached.payload : NULL;
+    }
+    assign_slot(slotIndex, chunk, x, y);
+    if (terrainVBO == 0) {
+        return;
+    }
     
-    // Configure vertex colors attribute
-    glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(float), (void*)0);
-    glEnableVertexAttribArray(2);
+    // Recycled slots overwrite their region in place
+    glBindBuffer(GL_ARRAY_BUFFER, terrainVBO);
+    if (data != NULL) {
+        glBufferSubData(GL_ARRAY_BUFFER, offset, size, data);
+    } else {
+        TerrainVertex *dst = (TerrainVertex *)glMapBufferRange(GL_ARRAY_BUFFER, offset, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT);
+        bool decoded = dst != NULL && cached.decode(dst);
+        if (dst != NULL) {
+            glUnmapBuffer(GL_ARRAY_BUFFER);
+        }
+        if (!decoded) {
+            std::cout << "Corrupt cached terrain chunk " << x << ", " << y << ", generating it again" << std::endl;
+            chunk = ChunkData();
+            generate_chunk_data(chunk, x, y, false);
+            assign_slot(slotIndex, chunk, x, y);
+            glBindBuffer(GL_ARRAY_BUFFER, terrainVBO);
+            glBufferSubData(GL_ARRAY_BUFFER, offset, size, &chunk.vertices[0]);
+        }
+    }
 }
 
+// Slot bookkeeping shared by the vertex and GPU heightfield paths
+void Terrain::assign_slot(int slotIndex, const ChunkData &chunk, int x, int y) {
+    ChunkSlot &slot = map_chunks[slotIndex];
+    slot.x = x;
+    slot.y = y;
+    slot.resident = true;
+    slot.minHeight = chunk.minHeight;
+    slot.maxHeight = chunk.maxHeight;
+    
+    if (chunkOffsetBuffer == 0) {
+        return;
+    }
+    glm::vec2 worldOffset(-chunkWidth / 2.0 + (chunkWidth - 1) * x, -chunkHeight / 2.0 + (chunkHeight - 1) * y);
+    glBindBuffer(GL_TEXTURE_BUFFER, chunkOffsetBuffer);
+    glBufferSubData(GL_TEXTURE_BUFFER, slotIndex * sizeof(glm::vec2), sizeof(glm::vec2), &worldOffset[0]);
+}
 
-std::vector<float>  Terrain::generate_noise_map(int offsetX, int offsetY) {
-    std::vector<float> noiseValues;
-    std::vector<float> normalizedNoiseValues;
-    std::vector<int> p = get_permutation_vector();
+void Terrain::configure_vertex_attributes() {
+    // Height
+    glVertexAttribPointer(0, 1, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(TerrainVertex), (void*)offsetof(TerrainVertex, height));
+    glEnableVertexAttribArray(0);
     
+    // Octahedral normal
+    glVertexAttribPointer(1, 2, GL_BYTE, GL_TRUE, sizeof(TerrainVertex), (void*)offsetof(TerrainVertex, normal));
+    glEnableVertexAttribArray(1);
+    
+    // Biome index
+    glVertexAttribIPointer(2, 1, GL_UNSIGNED_BYTE, sizeof(TerrainVertex), (void*)offsetof(TerrainVertex, biome));
+    glEnableVertexAttribArray(2);
+}
+
+
+// Upper bound of the raw fBm sum, used to normalise it
+float Terrain::max_noise_height() {
     float amp  = 1;
-    float freq = 1;
     float maxPossibleHeight = 0;
     
     for (int i = 0; i < octaves; i++) {
         maxPossibleHeight += amp;
         amp *= persistence;
     }
+    return maxPossibleHeight;
+}
+
+std::vector<float>  Terrain::generate_noise_map(int offsetX, int offsetY) {
+    // One extra sample on every side, taken from the neighbouring chunks, so
+    // normals along chunk borders match on both sides of the seam
+    std::vector<float> noiseValues((chunkWidth + 2) * (chunkHeight + 2));
+    FbmParams params = { octaves, persistence, lacunarity, noiseScale };
+    float maxPossibleHeight = max_noise_height();
     
-    for (int y = 0; y < chunkHeight; y++) {
-        for (int x = 0; x < chunkWidth; x++) {
-            amp  = 1;
-            freq = 1;
-            float noiseHeight = 0;
-            for (int i = 0; i < octaves; i++) {
-                float xSample = (x + offsetX * (chunkWidth-1))  / noiseScale * freq;
-                float ySample = (y + offsetY * (chunkHeight-1)) / noiseScale * freq;
-                
-                float perlinValue = perlin_noise(xSample, ySample, p);
-                noiseHeight += perlinValue * amp;
-                amp  *= persistence;
-                freq *= lacunarity;
-            }
-            
-            noiseValues.push_back(noiseHeight);
-        }
-    }
+    noise.fbm_tile(&noiseValues[0], offsetX * (chunkWidth-1) - 1, offsetY * (chunkHeight-1) - 1,
+                   chunkWidth + 2, chunkHeight + 2, params);
     
-    for (int y = 0; y < chunkHeight; y++) {
-        for (int x = 0; x < chunkWidth; x++) {
-            normalizedNoiseValues.push_back((noiseValues[x + y*chunkWidth] + 1) / maxPossibleHeight);
-        }
+    for (float &value : noiseValues) {
+        value = (value + 1) / maxPossibleHeight;
     }
 
-    return normalizedNoiseValues;
+    return noiseValues;
 }
 
 
-std::vector<float> Terrain::generate_biome(const std::vector<float> &vertices, std::vector<treeCoord> &treeCoords, int xOffset, int yOffset) {
-    std::vector<float> uvs;
+std::vector<GLubyte> Terrain::generate_biome(const std::vector<float> &vertices, std::vector<treeCoord> &treeCoords, int xOffset, int yOffset) {
+    std::vector<GLubyte> biomes;
     std::vector<float> textureHeights;
-    glm::vec2 uv = glm::vec2(0.0f);
+    GLubyte biome = BIOME_NONE;
+    biomes.reserve(vertices.size() / 3);
+    // Seeded from the chunk position so placement is reproducible no matter
+    // which worker generates the chunk
+    std::minstd_rand rng(seed * 2654435761u ^ (unsigned int)(xOffset * 73856093) ^ (unsigned int)(yOffset * 19349663));
     
 
+    // Must match the biome uv table in terrain.vert
     textureHeights.push_back(0.375);                               
     textureHeights.push_back(0.625);                              
     textureHeights.push_back(0.95);                
@@ -371,24 +646,69 @@ std::vector<float> Terrain::generate_biome(const std::vector<float> &vertices, s
         for (int j = 0; j < textureHeights.size(); j++) {
             // NOTE: The max height of a vertex is "meshHeight"
             if (vertices[i] <= textureHeights[j] * meshHeight) {
-                uv = glm::vec2(textureHeights[j], 0.5f);
-                // uv.x -= static_cast<float>(rand()) / static_cast<float>(RAND_MAX) * 0.1f - 0.05f;
-                // uv.y -= static_cast<float>(rand()) / static_cast<float>(RAND_MAX) * 0.1f - 0.05f;
+                biome = j;
                 if (j == 0) {
-                    if (rand() % 10000 < 5) {
+                    if (rng() % 10000 < 5) {
                         treeCoords.push_back(treeCoord{vertices[i-1], vertices[i], vertices[i+1], xOffset, yOffset});
                     }
                 }
                 break;
             }
         }
-        uvs.push_back(uv.x);
-        uvs.push_back(uv.y);
+        // Vertices above the last height keep the previous vertex's biome
+        biomes.push_back(biome);
+    }
+    return biomes;
+}
+
+// Per-vertex normals from central differences on the heightfield.
+// heights is (width + 2) x (height + 2) with a one sample border; normals
+// receives width * height xyz triples. One pass, no allocations.
+void Terrain::generate_normals(const float *heights, int width, int height, float *normals) {
+    int stride = width + 2;
+    for (int y = 0; y < height; y++) {
+        const float *row  = heights + (y + 1) * stride + 1;
+        const float *down = row - stride;
+        const float *up   = row + stride;
+        float *out = normals + y * width * 3;
+        int x = 0;
+#if TERRAIN_HAS_SSE2
+        __m128 two  = _mm_set1_ps(2.0f);
+        __m128 four = _mm_set1_ps(4.0f);
+        for (; x + 4 <= width; x += 4) {
+            __m128 nx = _mm_sub_ps(_mm_loadu_ps(row + x - 1), _mm_loadu_ps(row + x + 1));
+            __m128 nz = _mm_sub_ps(_mm_loadu_ps(down + x), _mm_loadu_ps(up + x));
+            __m128 len = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, nx), four), _mm_mul_ps(nz, nz)));
+            nx = _mm_div_ps(nx, len);
+            __m128 ny = _mm_div_ps(two, len);
+            nz = _mm_div_ps(nz, len);
+
+            // SoA -> xyz xyz xyz xyz
+            __m128 xyLo = _mm_unpacklo_ps(nx, ny);                          // x0 y0 x1 y1
+            __m128 xyHi = _mm_unpackhi_ps(nx, ny);                          // x2 y2 x3 y3
+            __m128 zx   = _mm_shuffle_ps(nz, nx, _MM_SHUFFLE(1, 1, 0, 0));  // z0 z0 x1 x1
+            __m128 yz   = _mm_shuffle_ps(ny, nz, _MM_SHUFFLE(1, 1, 1, 1));  // y1 y1 z1 z1
+            __m128 zxy  = _mm_shuffle_ps(nz, xyHi, _MM_SHUFFLE(3, 2, 3, 2)); // z2 z3 x3 y3
+            _mm_storeu_ps(out + x * 3,     _mm_shuffle_ps(xyLo, zx, _MM_SHUFFLE(2, 0, 1, 0)));
+            _mm_storeu_ps(out + x * 3 + 4, _mm_shuffle_ps(yz, xyHi, _MM_SHUFFLE(1, 0, 2, 0)));
+            _mm_storeu_ps(out + x * 3 + 8, _mm_shuffle_ps(zxy, zxy, _MM_SHUFFLE(1, 3, 2, 0)));
+        }
+#endif
+        // Same operations as the vector path so a column gives identical
+        // normals whichever path it lands on
+        for (; x < width; x++) {
+            float nx = row[x - 1] - row[x + 1];
+            float nz = down[x] - up[x];
+            float len = std::sqrt(nx * nx + 4.0f + nz * nz);
+            out[x * 3]     = nx / len;
+            out[x * 3 + 1] = 2.0f / len;
+            out[x * 3 + 2] = nz / len;
+        }
     }
-    return uvs;
 }
 
-std::vector<float>  Terrain::generate_normals(const std::vector<int> &indices, const std::vector<float> &vertices) {
+// Previous per-triangle normal generator, kept for the benchmark comparison
+std::vector<float>  Terrain::generate_triangle_normals(const std::vector<GLushort> &indices, const std::vector<float> &vertices) {
     int pos;
     glm::vec3 normal;
     std::vector<float> normals;
@@ -418,45 +738,345 @@ std::vector<float>  Terrain::generate_normals(const std::vector<int> &indices, c
     return normals;
 }
 
-std::vector<float>  Terrain::generate_vertices(const std::vector<float> &noise_map) {
+std::vector<float>  Terrain::generate_heights(const std::vector<float> &noise_map) {
+    std::vector<float> heights(noise_map.size());
+    
+    for (size_t i = 0; i < noise_map.size(); i++) {
+        // Apply cubic easing to the noise
+        float easedNoise = std::pow(noise_map[i] * 1.1, 3);
+        // Scale noise to match meshHeight
+        // Pervent vertex height from being below WATER_HEIGHT
+        heights[i] = std::fmax(easedNoise * meshHeight, WATER_HEIGHT * 0.5 * meshHeight);
+    }
+    
+    return heights;
+}
+
+std::vector<float>  Terrain::generate_vertices(const std::vector<float> &heights) {
     std::vector<float> v;
+    v.reserve(chunkWidth * chunkHeight * 3);
     
-    for (int y = 0; y < chunkHeight + 1; y++)
+    // Skip the border samples around the chunk
+    for (int y = 0; y < chunkHeight; y++)
         for (int x = 0; x < chunkWidth; x++) {
             v.push_back(x);
-            // Apply cubic easing to the noise
-            float easedNoise = std::pow(noise_map[x + y*chunkWidth] * 1.1, 3);
-            // Scale noise to match meshHeight
-            // Pervent vertex height from being below WATER_HEIGHT
-            v.push_back(std::fmax(easedNoise * meshHeight, WATER_HEIGHT * 0.5 * meshHeight));
+            v.push_back(heights[(x + 1) + (y + 1)*(chunkWidth + 2)]);
             v.push_back(y);
         }
     
     return v;
 }
 
-std::vector<int> Terrain::generate_indices() {
-    std::vector<int> indices;
+// Index of grid vertex (x, y) of a level with the given step. Vertices on a
+// stitched border snap down onto the coarser neighbour's grid, which
+// collapses the extra border triangles and leaves no T-junctions.
+static GLushort lod_vertex(int x, int y, int width, int height, int step, int stitchMask) {
+    int coarse = step;
+    for (int level = 0; level + 1 < TERRAIN_LOD_LEVELS; level++) {
+        if (TERRAIN_LOD_STEPS[level] == step) {
+            coarse = TERRAIN_LOD_STEPS[level + 1];
+        }
+    }
+    if (((stitchMask & LOD_STITCH_LEFT) && x == 0) || ((stitchMask & LOD_STITCH_RIGHT) && x == width - 1)) {
+        y = y / coarse * coarse;
+    }
+    if (((stitchMask & LOD_STITCH_BACK) && y == 0) || ((stitchMask & LOD_STITCH_FRONT) && y == height - 1)) {
+        x = x / coarse * coarse;
+    }
+    return x + y*width;
+}
+
+std::vector<GLushort> Terrain::generate_indices(int width, int height, int step, int stitchMask) {
+    std::vector<GLushort> indices;
+    indices.reserve((width - 1) / step * (height - 1) / step * 6);
     
-    for (int y = 0; y < chunkHeight; y++)
-        for (int x = 0; x < chunkWidth; x++) {
-            int pos = x + y*chunkWidth;
-            
-            if (x == chunkWidth - 1 || y == chunkHeight - 1) {
-                // Don't create indices for right or top edge
+    for (int y = 0; y < height - 1; y += step)
+        for (int x = 0; x < width - 1; x += step) {
+            GLushort pos = lod_vertex(x, y, width, height, step, stitchMask);
+            GLushort right = lod_vertex(x + step, y, width, height, step, stitchMask);
+            GLushort up = lod_vertex(x, y + step, width, height, step, stitchMask);
+            GLushort upRight = lod_vertex(x + step, y + step, width, height, step, stitchMask);
+            // Top left triangle of square
+            indices.push_back(up);
+            indices.push_back(pos);
+            indices.push_back(upRight);
+            // Bottom right triangle of square
+            indices.push_back(right);
+            indices.push_back(upRight);
+            indices.push_back(pos);
+        }
+
+    return indices;
+}
+
+std::vector<GLushort> Terrain::generate_strip_indices(int width, int height, int step, int stitchMask) {
+    std::vector<GLushort> indices;
+    indices.reserve((height - 1) / step * ((width - 1) / step * 2 + 3));
+    
+    // One strip per row of quads, zig-zagging between rows y+step and y with
+    // the same winding as the triangle list
+    for (int y = 0; y < height - 1; y += step) {
+        for (int x = 0; x < width; x += step) {
+            indices.push_back(lod_vertex(x, y + step, width, height, step, stitchMask));
+            indices.push_back(lod_vertex(x, y, width, height, step, stitchMask));
+        }
+        indices.push_back(PRIMITIVE_RESTART_INDEX);
+    }
+
+    return indices;
+}
+
+int Terrain::lod_for_distance(int distance, const int *lodDistances, int levels) {
+    int level = 0;
+    while (level + 1 < levels && distance >= lodDistances[level]) {
+        level++;
+    }
+    return level;
+}
+
+// Level of chunk (x, y) from its Chebyshev distance to the camera chunk
+int Terrain::chunk_lod(int x, int y, int lodBias) {
+    int distance = std::max(std::abs(gridPosX - x), std::abs(gridPosY - y));
+    return std::min(lod_for_distance(distance, lod_distances, lodLevels) + lodBias, lodLevels - 1);
+}
+
+// Adds one chunk at its LOD, stitched to coarser neighbours, to the draw
+// batch. Returns the number of triangles queued.
+int Terrain::queue_chunk(int x, int y, int lodBias) {
+    int level = chunk_lod(x, y, lodBias);
+    int mask = 0;
+    if (chunk_in_world(x - 1, y) && chunk_lod(x - 1, y, lodBias) > level) mask |= LOD_STITCH_LEFT;
+    if (chunk_in_world(x + 1, y) && chunk_lod(x + 1, y, lodBias) > level) mask |= LOD_STITCH_RIGHT;
+    if (chunk_in_world(x, y - 1) && chunk_lod(x, y - 1, lodBias) > level) mask |= LOD_STITCH_BACK;
+    if (chunk_in_world(x, y + 1) && chunk_lod(x, y + 1, lodBias) > level) mask |= LOD_STITCH_FRONT;
+
+    drawCounts.push_back(lodIndexCount[level][mask]);
+    drawIndexOffsets.push_back((GLvoid*)lodIndexOffset[level][mask]);
+    drawBaseVertices.push_back(slot_index(x, y) * chunkWidth * chunkHeight);
+    return lodTriangles[level][mask];
+}
+
+// Culls the resident chunks within render distance against the frustum of
+// viewProjection and draws the rest with one call. Returns the triangle count.
+int Terrain::draw_visible_chunks(const glm::mat4 &viewProjection, int lodBias, int &drawn, int &culled) {
+    Frustum frustum = Camera::createFrustumFromMatrix(viewProjection);
+    int triangles = 0;
+    drawn = 0;
+    culled = 0;
+    drawCounts.clear();
+    drawIndexOffsets.clear();
+    drawBaseVertices.clear();
+    
+    int x0, x1, y0, y1;
+    visible_chunk_range(x0, x1, y0, y1);
+    for (int y = y0; y <= y1; y++) 
+        for (int x = x0; x <= x1; x++) {
+            // Only render chunk if it's within render distance and streamed in
+            ChunkSlot *slot = resident_chunk(x, y);
+            if (slot == NULL || std::abs(gridPosX - x) > chunk_render_distance || std::abs(gridPosY - y) > chunk_render_distance) {
+                continue;
+            }
+            glm::vec3 boxMin(-chunkWidth / 2.0 + (chunkWidth - 1) * x, slot->minHeight, -chunkHeight / 2.0 + (chunkHeight - 1) * y);
+            glm::vec3 boxMax = boxMin + glm::vec3(chunkWidth - 1, 0, chunkHeight - 1);
+            boxMax.y = slot->maxHeight;
+            if (!frustum.isOnFrustum(boxMin, boxMax)) {
+                culled++;
                 continue;
-            } else {
-                // Top left triangle of square
-                indices.push_back(pos + chunkWidth);
-                indices.push_back(pos);
-                indices.push_back(pos + chunkWidth + 1);
-                // Bottom right triangle of square
-                indices.push_back(pos + 1);
-                indices.push_back(pos + 1 + chunkWidth);
-                indices.push_back(pos);
             }
+            triangles += queue_chunk(x, y, lodBias);
+            drawn++;
         }
+    
+    if (drawn > 0) {
+        draw_chunks_begin();
+        glBindVertexArray(terrainVAO);
+        glMultiDrawElementsBaseVertex(indexMode, &drawCounts[0], GL_UNSIGNED_SHORT, &drawIndexOffsets[0], drawn, &drawBaseVertices[0]);
+        glBindVertexArray(0);
+        draw_chunks_end();
+    }
+    return triangles;
+}
 
-    return indices;
+// Measures number of map chunks away from origin map chunk the camera is
+void Terrain::update_grid_position(glm::vec3 cameraPosition) {
+    if (streaming) {
+        // Chunk whose footprint contains the camera, negative chunks included
+        gridPosX = (int)std::floor((cameraPosition.x + chunkWidth / 2.0f) / (chunkWidth - 1));
+        gridPosY = (int)std::floor((cameraPosition.z + chunkHeight / 2.0f) / (chunkHeight - 1));
+    } else {
+        gridPosX = (int)(cameraPosition.x - originX) / chunkWidth + xMapChunks / 2;
+        gridPosY = (int)(cameraPosition.z - originY) / chunkHeight + yMapChunks / 2;
+    }
+}
+
+bool Terrain::chunk_in_world(int x, int y) {
+    return streaming || (x >= 0 && x < xMapChunks && y >= 0 && y < yMapChunks);
+}
+
+// Slot of chunk (x, y): its grid index, or its toroidal position in the ring
+int Terrain::slot_index(int x, int y) {
+    if (!streaming) {
+        return x + y*xMapChunks;
+    }
+    int sx = ((x % ringSize) + ringSize) % ringSize;
+    int sy = ((y % ringSize) + ringSize) % ringSize;
+    return sx + sy*ringSize;
+}
+
+ChunkSlot *Terrain::resident_chunk(int x, int y) {
+    if (!chunk_in_world(x, y)) {
+        return NULL;
+    }
+    ChunkSlot &slot = map_chunks[slot_index(x, y)];
+    return slot.resident && slot.x == x && slot.y == y ? &slot : NULL;
+}
+
+void Terrain::visible_chunk_range(int &x0, int &x1, int &y0, int &y1) {
+    if (streaming) {
+        x0 = gridPosX - chunk_render_distance;
+        x1 = gridPosX + chunk_render_distance;
+        y0 = gridPosY - chunk_render_distance;
+        y1 = gridPosY + chunk_render_distance;
+    } else {
+        x0 = 0;
+        x1 = xMapChunks - 1;
+        y0 = 0;
+        y1 = yMapChunks - 1;
+    }
+}
+
+void Terrain::init_streaming() {
+    // Wide enough that everything within render distance of the look-ahead
+    // point maps to a distinct slot
+    ringSize = 2 * (chunk_render_distance + stream_prefetch_chunks) + 1;
+    map_chunks.resize(ringSize * ringSize);
+    allocate_chunk_storage();
+
+    // Fill the view around the start position up front so the first frame
+    // has terrain and its trees can be instanced
+    lastCameraPosition = glm::vec3(originX, 0, originY);
+    update_grid_position(lastCameraPosition);
+    std::vector<std::pair<int, int>> coords;
+    for (int y = gridPosY - chunk_render_distance; y <= gridPosY + chunk_render_distance; y++)
+        for (int x = gridPosX - chunk_render_distance; x <= gridPosX + chunk_render_distance; x++) {
+            coords.push_back(std::make_pair(x, y));
+        }
+    generate_map_chunks(coords);
+
+    streamPool.reset(new ThreadPool(generation_threads));
+    std::cout << "Terrain streaming: " << ringSize << "x" << ringSize << " chunk slots, prefetch "
+              << stream_prefetch_chunks << " chunks, upload budget " << stream_upload_budget_ms << " ms/frame" << std::endl;
 }
 
+// Requests the chunks around the camera and ahead of it, then uploads
+// finished ones until the frame's budget is spent
+void Terrain::stream_chunks(glm::vec3 cameraPosition, glm::vec3 cameraFront, float deltaTime) {
+    if (clipmap) {
+        clipmap->update(cameraPosition);
+    }
+    if (!streaming) {
+        return;
+    }
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    update_grid_position(cameraPosition);
+    float speed = deltaTime > 0 ? glm::length(cameraPosition - lastCameraPosition) / deltaTime : 0;
+    lastCameraPosition = cameraPosition;
+
+    // Look-ahead chunk: at least one chunk along the view direction, further
+    // the faster the camera moves, but never past the prefetch ring
+    int aheadX = gridPosX, aheadY = gridPosY;
+    glm::vec2 front(cameraFront.x, cameraFront.z);
+    if (glm::length(front) > 1e-4f) {
+        float chunksAhead = 1.0f + speed * stream_prefetch_seconds / (chunkWidth - 1);
+        chunksAhead = std::min(chunksAhead, (float)stream_prefetch_chunks);
+        front = glm::normalize(front) * chunksAhead;
+        aheadX += (int)std::round(front.x);
+        aheadY += (int)std::round(front.y);
+    }
+
+    // Visible chunks nearest first, then the look-ahead window
+    std::vector<std::pair<int, std::pair<int, int>>> wanted;
+    for (int y = aheadY - chunk_render_distance; y <= aheadY + chunk_render_distance; y++)
+        for (int x = aheadX - chunk_render_distance; x <= aheadX + chunk_render_distance; x++) {
+            int distance = std::max(std::abs(gridPosX - x), std::abs(gridPosY - y));
+            wanted.push_back(std::make_pair(distance + (distance > chunk_render_distance ? ringSize : 0), std::make_pair(x, y)));
+        }
+    for (int y = gridPosY - chunk_render_distance; y <= gridPosY + chunk_render_distance; y++)
+        for (int x = gridPosX - chunk_render_distance; x <= gridPosX + chunk_render_distance; x++) {
+            if (std::max(std::abs(aheadX - x), std::abs(aheadY - y)) > chunk_render_distance) {
+                wanted.push_back(std::make_pair(std::max(std::abs(gridPosX - x), std::abs(gridPosY - y)), std::make_pair(x, y)));
+            }
+        }
+    std::sort(wanted.begin(), wanted.end());
+
+    // Keep the queue short so priorities follow the camera
+    size_t maxInFlight = 2 * streamPool->size() + 2;
+    for (size_t i = 0; i < wanted.size() && streamRequested.size() < maxInFlight; i++) {
+        int x = wanted[i].second.first, y = wanted[i].second.second;
+        if (resident_chunk(x, y) != NULL || streamRequested.count(wanted[i].second)) {
+            continue;
+        }
+        streamRequested.insert(wanted[i].second);
+        streamPool->submit([this, x, y]() {
+            StreamedChunk chunk;
+            chunk.x = x;
+            chunk.y = y;
+            generate_chunk_data(chunk.data, x, y);
+            std::lock_guard<std::mutex> lock(streamMutex);
+            streamFinished.push_back(std::move(chunk));
+        });
+    }
+
+    std::vector<StreamedChunk> finished;
+    {
+        std::lock_guard<std::mutex> lock(streamMutex);
+        finished.swap(streamFinished);
+    }
+    // At least one upload per frame so streaming always makes progress
+    size_t uploaded = 0;
+    for (; uploaded < finished.size(); uploaded++) {
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        if (uploaded > 0 && ms >= stream_upload_budget_ms) {
+            break;
+        }
+        StreamedChunk &chunk = finished[uploaded];
+        streamRequested.erase(std::make_pair(chunk.x, chunk.y));
+        // The camera moved on and the slot now belongs to a nearer chunk
+        if (std::max(std::abs(gridPosX - chunk.x), std::abs(gridPosY - chunk.y)) > chunk_render_distance + stream_prefetch_chunks) {
+            streamDropped++;
+            continue;
+        }
+        upload_map_chunk(slot_index(chunk.x, chunk.y), chunk.data, chunk.x, chunk.y);
+        streamUploads++;
+    }
+    if (uploaded < finished.size()) {
+        std::lock_guard<std::mutex> lock(streamMutex);
+        streamFinished.insert(streamFinished.begin(), std::make_move_iterator(finished.begin() + uploaded),
+                              std::make_move_iterator(finished.end()));
+    }
+
+    double frameMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    streamWorstFrameMs = std::max(streamWorstFrameMs, frameMs);
+    streamLogTime += deltaTime;
+    if (streamLogTime >= 1.0f && streamUploads + streamDropped > 0) {
+        std::cout << "Terrain streaming: " << streamUploads << " chunks uploaded, " << streamDropped
+                  << " dropped, worst frame " << streamWorstFrameMs << " ms" << std::endl;
+        streamUploads = 0;
+        streamDropped = 0;
+        streamWorstFrameMs = 0;
+        streamLogTime = 0;
+    }
+}
+
+void Terrain::draw_chunks_begin() {
+    if (indexMode == GL_TRIANGLE_STRIP) {
+        glEnable(GL_PRIMITIVE_RESTART);
+        glPrimitiveRestartIndex(PRIMITIVE_RESTART_INDEX);
+    }
+}
+
+void Terrain::draw_chunks_end() {
+    if (indexMode == GL_TRIANGLE_STRIP) {
+        glDisable(GL_PRIMITIVE_RESTART);
+    }
+}
@@ -16,9 +16,45 @@
 #include "entity.h"
 #include "constants.h"
 #include <render/shader.h>
-#include "particle_generator.h"
+#include "particle_system.h"
+#include "noise.h"
+#include "thread_pool.h"
+#include "job_system.h"
+#include "chunk_cache.h"
+#include "camera.h"
+#include "gpu_heightfield.h"
+#include "clipmap.h"
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <utility>
 
 
+// CMake points the chunk cache into the build tree
+#ifndef TERRAIN_CACHE_DIR
+#define TERRAIN_CACHE_DIR "terrain_cache"
+#endif
+
+// Chunks are at most 255x255 vertices so 16-bit indices always fit;
+// the top value is reserved to restart triangle strips
+const GLushort PRIMITIVE_RESTART_INDEX = 0xFFFF;
+
+// Geomipmap levels: vertex step of each level. Every step must divide the
+// chunk size - 1 (126 by default) and each step divides the next, so a
+// finer chunk can snap its border onto its coarser neighbour's vertices.
+const int TERRAIN_LOD_LEVELS = 4;
+const int TERRAIN_LOD_STEPS[TERRAIN_LOD_LEVELS] = { 1, 2, 6, 18 };
+
+// Stitch mask bits: the neighbour on that side is one level coarser
+enum TerrainLodSide {
+    LOD_STITCH_LEFT = 1,    // -x
+    LOD_STITCH_RIGHT = 2,   // +x
+    LOD_STITCH_BACK = 4,    // -z
+    LOD_STITCH_FRONT = 8    // +z
+};
+const int TERRAIN_LOD_MASKS = 16;
+
 // Structs
 struct treeCoord {
     float xpos;
@@ -36,6 +72,47 @@ struct treeCoord {
     }
 };
 
+// Heights are quantized over [0, TERRAIN_HEIGHT_RANGE * meshHeight]; eased
+// noise peaks around 1.5 * meshHeight
+const float TERRAIN_HEIGHT_RANGE = 2.0f;
+// Biome index used before any vertex of a chunk matched a texture height
+const GLubyte BIOME_NONE = 3;
+
+// Compact terrain vertex. x/z come from gl_VertexID in terrain.vert, so
+// only the height, an octahedral-encoded normal and the biome are stored.
+struct TerrainVertex {
+    GLushort height;    // Normalized over the height range
+    GLbyte normal[2];   // Octahedral xz, snorm8
+    GLubyte biome;      // Row of the biome uv table in terrain.vert
+    GLubyte pad[3];
+};
+
+// CPU-side output of one map chunk. Filled on a worker thread, consumed by
+// the GL upload on the context thread.
+struct ChunkData {
+    std::vector<TerrainVertex> vertices;
+    std::vector<treeCoord> treeCoords;
+    float minHeight = 0;
+    float maxHeight = 0;
+    CachedChunk cached;     // Set instead of vertices when read from the chunk cache
+};
+
+// One chunk's region of the shared terrain vertex buffer. In streaming mode
+// a slot is recycled for whichever chunk maps onto it in the ring.
+struct ChunkSlot {
+    int x = 0;
+    int y = 0;
+    bool resident = false;
+    float minHeight = 0;    // Height range for the culling AABB
+    float maxHeight = 0;
+};
+
+// Chunk finished by a streaming worker, waiting for its upload
+struct StreamedChunk {
+    int x;
+    int y;
+    ChunkData data;
+};
 
 
 class Terrain
@@ -43,7 +120,6 @@ class Terrain
 public:
 
     GLuint programID;
-    GLuint modelID;
     GLuint mvpMatrixID;
     GLuint ambientID;
     GLuint diffuseID;
@@ -52,6 +128,12 @@ public:
     GLuint viewPosID;
     GLuint depthSamplerID;
     GLuint lightSpaceMatrixID;
+    GLuint chunkWidthID;
+    GLuint heightScaleID;
+    GLuint chunkVerticesID;
+    GLuint chunkOffsetsID;
+    GLuint gpuHeightfieldID;
+    GLuint heightfieldID;
 
     float WATER_HEIGHT = 0.1;
     int chunk_render_distance = 4;
@@ -63,7 +145,68 @@ public:
     int gridPosY = 0;
     float originX;
     float originY;
-    int nIndices;
+    GLuint indexBuffer;              // One 16-bit index buffer shared by every chunk
+    // Index range of every [level][stitch mask] combination in indexBuffer
+    GLsizei lodIndexCount[TERRAIN_LOD_LEVELS][TERRAIN_LOD_MASKS];
+    size_t lodIndexOffset[TERRAIN_LOD_LEVELS][TERRAIN_LOD_MASKS];
+    int lodTriangles[TERRAIN_LOD_LEVELS][TERRAIN_LOD_MASKS];
+    int lodLevels = TERRAIN_LOD_LEVELS;     // Levels whose step fits the chunk size
+    // Chebyshev chunk distance at which each coarser level starts. Must be
+    // strictly increasing so neighbours never differ by more than one level.
+    int lod_distances[TERRAIN_LOD_LEVELS - 1] = { 1, 2, 4 };
+    int shadow_lod_bias = 1;         // Extra levels of coarsening in the depth pass
+    // Every chunk slot lives in one vertex buffer drawn through one VAO, so
+    // the visible chunks go out in a single glMultiDrawElementsBaseVertex.
+    // The shader finds a chunk's world offset in chunkOffsetBuffer from
+    // gl_VertexID / (vertices per chunk).
+    GLuint terrainVAO = 0;
+    GLuint terrainVBO = 0;
+    GLuint chunkOffsetBuffer = 0;
+    GLuint chunkOffsetTexture = 0;
+    std::vector<GLsizei> drawCounts;         // Batch of the pass being drawn
+    std::vector<GLvoid*> drawIndexOffsets;
+    std::vector<GLint> drawBaseVertices;
+
+    // Per-frame stats of the last main/shadow pass
+    int trianglesDrawn = 0;
+    int shadowTrianglesDrawn = 0;
+    int chunksDrawn = 0;
+    int chunksCulled = 0;
+    int shadowChunksDrawn = 0;
+    int shadowChunksCulled = 0;
+    std::chrono::steady_clock::time_point lastStatsLog;
+
+    // GPU generation backend: heights live in a texture array layer per
+    // chunk slot and terrain.vert fetches them instead of vertex attributes
+    bool use_gpu_heightfield = false;
+    std::unique_ptr<GpuHeightfield> heightfield;
+
+    // Clipmap renderer: replaces the chunk meshes with nested rings around
+    // the camera. Chunks are still generated on the CPU to place the trees.
+    bool use_clipmap = false;
+    int clipmap_levels = 6;
+    int clipmap_grid = 128;
+    std::unique_ptr<Clipmap> clipmap;
+
+    // Streaming mode: a fixed ring of chunk slots around the camera chunk
+    // instead of the fixed xMapChunks x yMapChunks grid
+    bool streaming = false;
+    int stream_prefetch_chunks = 2;        // Extra ring of slots the look-ahead may request into
+    float stream_prefetch_seconds = 2.0f;  // Look-ahead time along Camera::Front at the current speed
+    float stream_upload_budget_ms = 2.0f;  // GL upload time allowed per frame
+    int ringSize = 0;
+    glm::vec3 lastCameraPosition;
+    int streamUploads = 0;                 // Stats since the last streaming log line
+    int streamDropped = 0;
+    double streamWorstFrameMs = 0;
+    float streamLogTime = 0;
+    GLenum indexMode = GL_TRIANGLES;
+    bool use_triangle_strips = false; // Strips with primitive restart instead of a triangle list
+    unsigned int seed = 0;           // Seeds per-chunk biome/tree placement
+    unsigned int generation_threads = 0;  // 0 = one worker per hardware thread
+    bool use_chunk_cache = true;
+    std::string cache_directory = TERRAIN_CACHE_DIR;
+    ChunkCache cache;
 
     // Noise params
     int octaves = 5;
@@ -71,16 +214,53 @@ public:
     float noiseScale = 64;  // Horizontal scaling
     float persistence = 0.5;
     float lacunarity = 2;
+    PerlinNoise noise;
 
     // Model params
     float MODEL_SCALE = 3;
     float MODEL_BRIGHTNESS = 6;
+    // Reduce and quantize the animated models' keyframes at load
+    bool use_animation_compression = true;
+    AnimationCompression animation_compression;
+    // Bake the animated models' clips into palette textures so every instance
+    // plays its own clip and phase with no per-frame CPU animation.
+    // palette_models (bot, bird, fox, goose) can take a model off it, to
+    // save its palette texture: its instances then share one CPU-animated
+    // pose, pre-skinned below.
+    bool use_animation_palettes = true;
+    bool palette_models[4] = { true, true, true, true };
+    float animation_palette_rate = 30.0f;  // Frames per second of clip
+    // Skin the models without a palette once per frame by transform
+    // feedback for both the shadow and the colour pass
+    bool use_preskinning = true;
+    // Animation LOD: screen heights, as fractions of the viewport, below
+    // which an animated model drops to the next ANIMATION_LOD_INTERVALS
+    // level. update() works from the previous frame's camera and light.
+    bool use_animation_lod = true;
+    float animation_lod_sizes[ANIMATION_LOD_LEVELS - 1] = { 0.1f, 0.04f, 0.015f };
+    bool animationViewKnown = false;
+    glm::mat4 animationViewProjection;
+    glm::mat4 animationLightProjection;
+    int animationUpdates = 0;       // Poses computed since the last stats log
+    // Update phase: each animated model and each batch of particle
+    // emitters is a job, joined before anything is uploaded or drawn
+    bool use_parallel_update = true;
+    unsigned int update_threads = 0;       // 0 = one per hardware thread besides the main one
+    int particle_emitters_per_job = 16;
 
-    std::vector<GLuint> map_chunks;
+    std::vector<ChunkSlot> map_chunks;
     std::vector<GLuint> trees;
     std::vector<treeCoord> treeCoords;
     std::vector<glm::mat4> instanceMatrices;
-    std::vector<ParticleGenerator> particleGenerators;
+    // One emitter per tree, drawn with a single call
+    ParticleSystem particles;
+    int particles_per_tree = 10;
+    // Sorting needs the positions on the CPU, so with sort_particles the
+    // simulation stays there unless sort_gpu_particles opts in to reading
+    // the GPU state back every frame, which waits for the step
+    bool use_gpu_particles = true;      // Transform feedback simulation
+    bool sort_particles = true;         // Back to front on the CPU
+    bool sort_gpu_particles = false;
     Entity tree;
     Entity bot;
     Entity fox;
@@ -88,18 +268,53 @@ public:
     Entity goose;
     
 
-    Terrain(int xMapChunks, int yMapChunks, int chunkWidth, int chunkHeight, float originX, float originY)
+    Terrain(int xMapChunks, int yMapChunks, int chunkWidth, int chunkHeight, float originX, float originY,
+            bool streaming = false, bool gpuHeightfield = false, bool clipmapTerrain = false)
     : xMapChunks(xMapChunks), yMapChunks(yMapChunks), chunkWidth(chunkWidth), chunkHeight(chunkHeight),
-    originX(originX), originY(originY) {
-        nIndices = chunkWidth * chunkHeight * 6;
-        programID = LoadShadersFromFile("../src/shader/terrain.vert", "../src/shader/terrain.frag");
-        map_chunks.resize(xMapChunks * yMapChunks);
-        for (int y = 0; y < yMapChunks; y++)
-            for (int x = 0; x < xMapChunks; x++) {
-                generate_map_chunk(map_chunks[x + y*xMapChunks], x, y, treeCoords);
+    originX(originX), originY(originY), use_gpu_heightfield(gpuHeightfield && !clipmapTerrain),
+    use_clipmap(clipmapTerrain), streaming(streaming && !clipmapTerrain), noise(seed) {
+        if (use_clipmap) {
+            programID = LoadShadersFromFile("../src/shader/clipmap.vert", "../src/shader/terrain.frag");
+            if (streaming || gpuHeightfield) {
+                std::cout << "Clipmap terrain replaces chunk streaming and the GPU heightfield" << std::endl;
+            }
+        } else {
+            programID = LoadShadersFromFile("../src/shader/terrain.vert", "../src/shader/terrain.frag");
+            // Index layout is identical for every chunk, so all chunk VAOs share one
+            // element buffer holding every LOD level
+            upload_index_buffer();
+        }
+        if (use_chunk_cache) {
+            ChunkCacheKey key = { seed, octaves, persistence, lacunarity, noiseScale, meshHeight, WATER_HEIGHT, chunkWidth, chunkHeight };
+            cache.open(cache_directory, key);
+        }
+        if (this->streaming) {
+            if (use_gpu_heightfield) {
+                std::cout << "GPU heightfield is not available when streaming, generating on the CPU" << std::endl;
+            }
+            init_streaming();
+        } else {
+            std::vector<std::pair<int, int>> coords;
+            for (int i = 0; i < xMapChunks * yMapChunks; i++) {
+                coords.push_back(std::make_pair(i % xMapChunks, i / xMapChunks));
+            }
+            map_chunks.resize(xMapChunks * yMapChunks);
+            init_gpu_heightfield();
+            if (use_clipmap) {
+                FbmParams params = { octaves, persistence, lacunarity, noiseScale };
+                clipmap.reset(new Clipmap(noise, params, meshHeight, WATER_HEIGHT,
+                                          glm::vec2(-chunkWidth / 2.0f, -chunkHeight / 2.0f), clipmap_levels, clipmap_grid));
+                clipmap->update(glm::vec3(originX, 0, originY));
+            } else {
+                allocate_chunk_storage();
+            }
+            if (heightfield) {
+                generate_map_chunks_gpu(coords);
+            } else {
+                generate_map_chunks(coords);
+            }
         }
         mvpMatrixID = glGetUniformLocation(programID, "MVP");
-        modelID = glGetUniformLocation(programID, "u_model");
         ambientID = glGetUniformLocation(programID, "ambient");
 		diffuseID = glGetUniformLocation(programID, "diffuse");
         specularID = glGetUniformLocation(programID, "specular");
@@ -107,21 +322,61 @@ public:
 		viewPosID = glGetUniformLocation(programID, "u_viewPos");
         depthSamplerID = glGetUniformLocation(programID, "shadowMap");
         lightSpaceMatrixID = glGetUniformLocation(programID, "lightSpaceMatrix");
+        chunkWidthID = glGetUniformLocation(programID, "chunkWidth");
+        heightScaleID = glGetUniformLocation(programID, "heightScale");
+        chunkVerticesID = glGetUniformLocation(programID, "chunkVertices");
+        chunkOffsetsID = glGetUniformLocation(programID, "chunkOffsets");
+        gpuHeightfieldID = glGetUniformLocation(programID, "gpuHeightfield");
+        heightfieldID = glGetUniformLocation(programID, "heightfield");
         trees.reserve(xMapChunks * yMapChunks);
 
         
     }
-    std::vector<int> generate_indices();
+    static std::vector<GLushort> generate_indices(int width, int height, int step = 1, int stitchMask = 0);
+    static std::vector<GLushort> generate_strip_indices(int width, int height, int step = 1, int stitchMask = 0);
+    void upload_index_buffer();
+    static int lod_for_distance(int distance, const int *lodDistances, int levels);
+    int chunk_lod(int x, int y, int lodBias);
+    int queue_chunk(int x, int y, int lodBias);
+    int draw_visible_chunks(const glm::mat4 &viewProjection, int lodBias, int &drawn, int &culled);
     std::vector<float> generate_noise_map(int xOffset, int yOffset);
-    std::vector<float> generate_vertices(const std::vector<float> &noise_map);
-    std::vector<float> generate_normals(const std::vector<int> &indices, const std::vector<float> &vertices);
-    std::vector<float>  generate_biome(const std::vector<float> &vertices, std::vector<treeCoord> &treeCoords, int xOffset, int yOffset);
-    void generate_map_chunk(GLuint &VAO, int xOffset, int yOffset, std::vector<treeCoord> &treeCoords);
+    std::vector<float> generate_heights(const std::vector<float> &noise_map);
+    std::vector<float> generate_vertices(const std::vector<float> &heights);
+    static void generate_normals(const float *heights, int width, int height, float *normals);
+    static std::vector<float> generate_triangle_normals(const std::vector<GLushort> &indices, const std::vector<float> &vertices);
+    std::vector<GLubyte> generate_biome(const std::vector<float> &vertices, std::vector<treeCoord> &treeCoords, int xOffset, int yOffset);
+    static std::vector<TerrainVertex> pack_vertices(const std::vector<float> &vertices, const std::vector<float> &normals, const std::vector<GLubyte> &biomes, float heightRange);
+    float max_noise_height();
+    void generate_map_chunks(const std::vector<std::pair<int, int>> &coords);
+    void init_gpu_heightfield();
+    void generate_map_chunks_gpu(const std::vector<std::pair<int, int>> &coords);
+    void generate_chunk_data(ChunkData &chunk, int xOffset, int yOffset, bool readCache = true);
+    void allocate_chunk_storage();
+    void assign_slot(int slot, const ChunkData &chunk, int x, int y);
+    void upload_map_chunk(int slot, ChunkData &chunk, int x, int y);
+    void update_grid_position(glm::vec3 cameraPosition);
+    bool chunk_in_world(int x, int y);
+    int slot_index(int x, int y);
+    ChunkSlot *resident_chunk(int x, int y);
+    void visible_chunk_range(int &x0, int &x1, int &y0, int &y1);
+    void init_streaming();
+    void stream_chunks(glm::vec3 cameraPosition, glm::vec3 cameraFront, float deltaTime);
+    void configure_vertex_attributes();
+    void draw_chunks_begin();
+    void draw_chunks_end();
     void render(glm::mat4 &mvp, glm::vec3 cameraPosition, Shadow shadow, Light light, GLuint tex);
     void render(glm::vec3 cameraPosition, GLuint terrainDepthID, GLuint treeDepthID, glm::mat4 vp, GLuint botDepthID);
     void setup_instancing(GLuint particleTex, GLuint particleShader);
+    std::vector<glm::mat4> instances_within_render_distance();
     void update(float deltaTime, float particleTime, float chunks, float chunkWidth, float origin);
 
+private:
+    std::set<std::pair<int, int>> streamRequested;  // Chunks queued or being generated
+    std::mutex streamMutex;
+    std::vector<StreamedChunk> streamFinished;      // Guarded by streamMutex
+    std::unique_ptr<JobSystem> updateJobs;
+    // Declared last so its workers are joined before the queue above is destroyed
+    std::unique_ptr<ThreadPool> streamPool;
 };
 
 #endif;
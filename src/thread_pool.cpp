@@ -0,0 +1,61 @@
+#include "thread_pool.h"
+
+ThreadPool::ThreadPool(unsigned int threads) {
+    if (threads == 0) {
+        threads = std::thread::hardware_concurrency();
+    }
+    if (threads == 0) {
+        threads = 1;
+    }
+    workers.reserve(threads);
+    for (unsigned int i = 0; i < threads; i++) {
+        workers.push_back(std::thread(&ThreadPool::workerLoop, this));
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    jobAvailable.notify_all();
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+}
+
+void ThreadPool::submit(std::function<void()> job) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        jobs.push(std::move(job));
+        pending++;
+    }
+    jobAvailable.notify_one();
+}
+
+void ThreadPool::wait() {
+    std::unique_lock<std::mutex> lock(mutex);
+    jobsDone.wait(lock, [this]() { return pending == 0; });
+}
+
+void ThreadPool::workerLoop() {
+    for (;;) {
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            jobAvailable.wait(lock, [this]() { return stopping || !jobs.empty(); });
+            if (jobs.empty()) {
+                return;
+            }
+            job = std::move(jobs.front());
+            jobs.pop();
+        }
+
+        job();
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--pending == 0) {
+            jobsDone.notify_all();
+        }
+    }
+}
@@ -0,0 +1,43 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+
+// Fixed-size pool of worker threads consuming a shared FIFO of jobs.
+// Jobs must not touch GL state: only the thread owning the context may do that.
+class ThreadPool
+{
+public:
+    // threads == 0 uses one worker per hardware thread
+    explicit ThreadPool(unsigned int threads = 0);
+    ~ThreadPool();
+
+    void submit(std::function<void()> job);
+
+    // Blocks until every submitted job has finished
+    void wait();
+
+    unsigned int size() const { return (unsigned int)workers.size(); }
+
+private:
+    void workerLoop();
+
+    std::vector<std::thread> workers;
+    std::queue<std::function<void()>> jobs;
+    std::mutex mutex;
+    std::condition_variable jobAvailable;
+    std::condition_variable jobsDone;
+    int pending = 0;
+    bool stopping = false;
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+};
+
+#endif